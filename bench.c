@@ -1,4 +1,5 @@
 #include "ncx_slab.h"
+#include <unistd.h>
 #include <sys/time.h>
 
 uint64_t usTime()  
@@ -14,6 +15,329 @@ uint64_t usTime()
 	return usec;
 }
 
+/*
+ * 每个slab类各构造一个只剩最后一个空闲chunk的页, 反复 alloc/free 该chunk,
+ * 衡量在几乎满的页上查找空闲位的开销
+ */
+void bench_full_page(ncx_slab_pool_t *sp)
+{
+	size_t size[] = { 8, 16, 32, 64, 128, 256, 512, 1024 };
+	size_t pagesize = getpagesize();
+	char *p, *prev;
+	uint64_t us;
+	int i, j;
+
+	printf("\nnearly full page\n");
+	printf("size\tns/op\n");
+
+	for (j = 0; j < sizeof(size)/sizeof(size_t); j++)
+	{
+		size_t s = size[j];
+
+		prev = ncx_slab_alloc(sp, s);
+		for ( ;; ) {
+			p = ncx_slab_alloc(sp, s);
+			if ((p - (char *) ncx_slab_start(sp)) / pagesize
+				!= (prev - (char *) ncx_slab_start(sp)) / pagesize)
+			{
+				break;
+			}
+			prev = p;
+		}
+
+		ncx_slab_free(sp, p);
+		ncx_slab_free(sp, prev);
+
+		us = usTime();
+		for (i = 0; i < 1000000; i++)
+		{
+			p = ncx_slab_alloc(sp, s);
+
+			ncx_slab_free(sp, p);
+		}
+		us = usTime() - us;
+
+		printf("%zu\t%.1f\n", s, (double) us * 1000 / 1000000);
+	}
+}
+
+/*
+ * 在碎片化的大池上反复申请/释放 1~16 页的块:
+ * 先申请大量 1~4 页的块再隔一个释放一个, 造成数万个空闲块;
+ * 最后比较统计快照和遍历统计的耗时
+ */
+void bench_fragmented_pages()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	size_t 	pool_size, pagesize;
+	u_char 	*space;
+	void 	**frag, *live[64];
+	unsigned int r;
+	uint64_t us;
+	int i, n, ops;
+
+	pool_size = 1024 * 1024 * 1024;  //1G
+	pagesize = getpagesize();
+	space = (u_char *)malloc(pool_size);
+	sp = (ncx_slab_pool_t*) space;
+
+	sp->addr = space;
+	sp->min_shift = 3;
+	sp->end = space + pool_size;
+
+	ncx_slab_init(sp);
+
+	n = 60000;
+	frag = (void **) malloc(n * sizeof(void *));
+	r = 1;
+
+	for (i = 0; i < n; i++) {
+		r = r * 1103515245 + 12345;
+		frag[i] = ncx_slab_alloc(sp, pagesize * (1 + (r >> 16) % 4));
+	}
+
+	for (i = 0; i < n; i += 2) {
+		ncx_slab_free(sp, frag[i]);
+	}
+
+	ncx_slab_stat(sp, &stat);
+
+	memset(live, 0, sizeof(live));
+	ops = 1000000;
+
+	us = usTime();
+	for (i = 0; i < ops; i++)
+	{
+		r = r * 1103515245 + 12345;
+
+		if (live[i % 64]) {
+			ncx_slab_free(sp, live[i % 64]);
+		}
+
+		live[i % 64] = ncx_slab_alloc(sp, pagesize * (1 + (r >> 16) % 16));
+	}
+	us = usTime() - us;
+
+	printf("\nfragmented pool (%zu free pages, max run %zu)\n",
+		   stat.free_page, stat.max_free_pages);
+	printf("multi-page alloc+free\t%.1f ns/op\n", (double) us * 1000 / ops);
+
+	// 增量计数的快照 vs 遍历整个页数组
+	us = usTime();
+	for (i = 0; i < 10000; i++) {
+		ncx_slab_stat_snapshot(sp, &stat);
+	}
+	us = usTime() - us;
+	printf("stat snapshot\t\t%.1f us\n", (double) us / 10000);
+
+	us = usTime();
+	for (i = 0; i < 10; i++) {
+		ncx_slab_stat(sp, &stat);
+	}
+	us = usTime() - us;
+	printf("stat walk\t\t%.1f us\n", (double) us / 10);
+
+	free(frag);
+	free(space);
+}
+
+/*
+ * 随机访问的分配抖动: 保持大量存活对象, 随机替换并读写,
+ * 比较普通页和大页(ncx_slab_create NCX_SLAB_HUGEPAGE)下的 TLB 开销
+ */
+void bench_hugepage()
+{
+	ncx_slab_pool_t *sp;
+	char 	*backing[] = { "none", "4K pages", "hugetlb", "thp" };
+	ncx_uint_t flags[] = { 0, NCX_SLAB_HUGEPAGE };
+	u_char 	**live, *p;
+	unsigned int r;
+	u_char 	sum;
+	uint64_t us;
+	int 	i, j, k, n, ops;
+
+	n = 200000;
+	ops = 2000000;
+	live = (u_char **) malloc(n * sizeof(u_char *));
+
+	printf("\nrandom churn, %d live objects\n", n);
+	printf("backing\tns/op\n");
+
+	for (j = 0; j < sizeof(flags)/sizeof(ncx_uint_t); j++)
+	{
+		sp = ncx_slab_create(512 * 1024 * 1024, 0, flags[j]);
+		if (sp == NULL) {
+			continue;
+		}
+
+		r = 1;
+		sum = 0;
+
+		for (i = 0; i < n; i++) {
+			r = r * 1103515245 + 12345;
+			live[i] = ncx_slab_alloc(sp, 16 + (r >> 16) % 2048);
+			live[i][0] = (u_char) i;
+		}
+
+		us = usTime();
+		for (i = 0; i < ops; i++)
+		{
+			r = r * 1103515245 + 12345;
+			k = (r >> 8) % n;
+
+			// 读到的值写进新对象, 随机读不会被优化掉
+			sum += live[(k * 7919) % n][0];
+
+			ncx_slab_free(sp, live[k]);
+			p = ncx_slab_alloc(sp, 16 + (r >> 16) % 2048);
+			p[0] = sum;
+			live[k] = p;
+		}
+		us = usTime() - us;
+
+		printf("%s\t%.1f\n", backing[sp->backing], (double) us * 1000 / ops);
+
+		ncx_slab_destroy(sp);
+	}
+
+	free(live);
+}
+
+/*
+ * 每次分配/释放一批同样大小的chunk: 逐个调用 vs 批量接口, 按单个对象计时
+ */
+void bench_batch()
+{
+	ncx_slab_pool_t *sp;
+	size_t 	size[] = { 32, 64, 256, 1024 };
+	void 	*ptrs[32];
+	uint64_t us, t1, t2;
+	int 	i, j, k, n, rounds;
+
+	n = sizeof(ptrs)/sizeof(void *);
+	rounds = 100000;
+
+	sp = ncx_slab_create(64 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return;
+	}
+
+	printf("\nbatch of %d\n", n);
+	printf("size\tsingle\tbatch\t(ns/obj)\n");
+
+	for (j = 0; j < sizeof(size)/sizeof(size_t); j++)
+	{
+		us = usTime();
+		for (i = 0; i < rounds; i++)
+		{
+			for (k = 0; k < n; k++) {
+				ptrs[k] = ncx_slab_alloc(sp, size[j]);
+			}
+			for (k = 0; k < n; k++) {
+				ncx_slab_free(sp, ptrs[k]);
+			}
+		}
+		t1 = usTime() - us;
+
+		us = usTime();
+		for (i = 0; i < rounds; i++)
+		{
+			k = ncx_slab_alloc_batch(sp, size[j], n, ptrs);
+			ncx_slab_free_batch(sp, ptrs, k);
+		}
+		t2 = usTime() - us;
+
+		printf("%zu\t%.1f\t%.1f\n", size[j],
+			   (double) t1 * 1000 / rounds / n, (double) t2 * 1000 / rounds / n);
+	}
+
+	ncx_slab_destroy(sp);
+}
+
+/*
+ * 对象缓存 vs 通用分配: 同样大小的对象分配 n 个再全部释放, 按单个对象计时,
+ * 并比较 n 个对象占用的页数
+ */
+void bench_cache()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_cache_t *cache;
+	ncx_slab_stat_t stat;
+	size_t 	size[] = { 24, 72, 136, 520, 1100 };
+	size_t 	pages[2];
+	void 	**ptrs;
+	uint64_t us, t[2];
+	int 	i, j, n, r, rounds;
+
+	n = 10000;
+	rounds = 100;
+	ptrs = (void **) malloc(n * sizeof(void *));
+
+	printf("\nobject cache, %d objects\n", n);
+	printf("size\tslab\tcache\t(ns/obj)\tslab\tcache\t(pages)\n");
+
+	for (j = 0; j < sizeof(size)/sizeof(size_t); j++)
+	{
+		sp = ncx_slab_create(64 * 1024 * 1024, 0, 0);
+		if (sp == NULL) {
+			break;
+		}
+
+		us = usTime();
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < n; i++) {
+				ptrs[i] = ncx_slab_alloc(sp, size[j]);
+			}
+
+			if (r == 0) {
+				ncx_slab_stat_snapshot(sp, &stat);
+				pages[0] = stat.pages - stat.free_page;
+			}
+
+			for (i = 0; i < n; i++) {
+				ncx_slab_free(sp, ptrs[i]);
+			}
+		}
+		t[0] = usTime() - us;
+
+		cache = ncx_slab_cache_create(sp, size[j], 0, NULL);
+		if (cache == NULL) {
+			printf("%zu\tcache create failed, skipped\n", size[j]);
+			ncx_slab_destroy(sp);
+			continue;
+		}
+
+		us = usTime();
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < n; i++) {
+				ptrs[i] = ncx_slab_cache_alloc(cache);
+			}
+
+			if (r == 0) {
+				ncx_slab_stat_snapshot(sp, &stat);
+				pages[1] = stat.p_cache;
+			}
+
+			for (i = 0; i < n; i++) {
+				ncx_slab_cache_free(cache, ptrs[i]);
+			}
+		}
+		t[1] = usTime() - us;
+
+		printf("%zu\t%.1f\t%.1f\t\t%zu\t%zu\n", size[j],
+			   (double) t[0] * 1000 / rounds / n,
+			   (double) t[1] * 1000 / rounds / n, pages[0], pages[1]);
+
+		ncx_slab_cache_destroy(cache);
+		ncx_slab_destroy(sp);
+	}
+
+	free(ptrs);
+}
+
 int main(int argc, char **argv)
 {
 	ncx_slab_pool_t *sp;
@@ -73,7 +397,17 @@ int main(int argc, char **argv)
 		printf("%.2f\n", (double)t1 / (double)t2);
 	}
 
+	bench_full_page(sp);
+
 	free(space);
 
+	bench_fragmented_pages();
+
+	bench_hugepage();
+
+	bench_batch();
+
+	bench_cache();
+
 	return 0;
 }
@@ -0,0 +1,179 @@
+#include "ncx_slab.hpp"
+#include <sys/time.h>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <functional>
+
+/*
+ * STL容器 insert/erase: 默认分配器 vs ncx::slab_allocator vs std::pmr + ncx::slab_resource.
+ * 每轮插入N个随机key再按插入顺序全部删除, 按单次操作计时.
+ * 另外比较 ncx::fixed_pool 与通用 ncx_slab_alloc 分配同样大小的对象
+ */
+
+#define N       200000
+#define ROUNDS  10
+
+static uint64_t usTime()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static unsigned int keys[N];
+
+template <typename Map>
+static double bench_map(Map &m)
+{
+	uint64_t us;
+	int r, i;
+
+	us = usTime();
+	for (r = 0; r < ROUNDS; r++)
+	{
+		for (i = 0; i < N; i++) {
+			m.emplace(keys[i], i);
+		}
+
+		for (i = 0; i < N; i++) {
+			m.erase(keys[i]);
+		}
+	}
+	us = usTime() - us;
+
+	return (double) us * 1000 / (2.0 * N * ROUNDS);
+}
+
+template <typename List>
+static double bench_list(List &l)
+{
+	uint64_t us;
+	int r, i;
+
+	us = usTime();
+	for (r = 0; r < ROUNDS; r++)
+	{
+		for (i = 0; i < N; i++) {
+			if (keys[i] & 1) {
+				l.push_back(i);
+			} else {
+				l.push_front(i);
+			}
+		}
+
+		while (!l.empty()) {
+			l.pop_front();
+		}
+	}
+	us = usTime() - us;
+
+	return (double) us * 1000 / (2.0 * N * ROUNDS);
+}
+
+#define FIXED   4096
+
+static void *objs[FIXED];
+
+/* 分配 FIXED 个对象再全部释放, 按单次操作计时 */
+template <typename Alloc, typename Free>
+static double bench_fixed(Alloc alloc, Free dealloc)
+{
+	uint64_t us;
+	int r, i;
+
+	us = usTime();
+	for (r = 0; r < ROUNDS * 10; r++)
+	{
+		for (i = 0; i < FIXED; i++) {
+			objs[i] = alloc();
+		}
+
+		for (i = 0; i < FIXED; i++) {
+			dealloc(objs[(i * 7) % FIXED]);
+		}
+	}
+	us = usTime() - us;
+
+	return (double) us * 1000 / (2.0 * FIXED * ROUNDS * 10);
+}
+
+template <std::size_t Size>
+static void bench_fixed_size(ncx_slab_pool_t *sp)
+{
+	ncx::fixed_pool<Size, 8, FIXED> fp(sp);
+	double t[3];
+
+	t[0] = bench_fixed([sp] { return ncx_slab_alloc(sp, Size); },
+					   [sp] (void *p) { ncx_slab_free(sp, p); });
+	t[1] = bench_fixed([sp] { return ncx_slab_alloc_locked(sp, Size); },
+					   [sp] (void *p) { ncx_slab_free_locked(sp, p); });
+	t[2] = bench_fixed([&fp] { return fp.allocate(); },
+					   [&fp] (void *p) { fp.deallocate(p); });
+
+	printf("%zu\t%.1f\t%.1f\t%.1f\n", Size, t[0], t[1], t[2]);
+}
+
+int main(int argc, char **argv)
+{
+	ncx_slab_pool_t *sp;
+	unsigned int k;
+	int i;
+
+	sp = ncx_slab_create(256 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	for (i = 0, k = 1; i < N; i++) {
+		k = k * 1103515245 + 12345;
+		keys[i] = k;
+	}
+
+	typedef std::pair<const unsigned int, int> value_t;
+	ncx::slab_allocator<value_t> alloc(sp);
+	ncx::slab_resource res(sp);
+
+	printf("container\tstd\tncx\tpmr\t(ns/op)\n");
+
+	{
+		std::map<unsigned int, int> a;
+		std::map<unsigned int, int, std::less<unsigned int>,
+				 ncx::slab_allocator<value_t> > b(alloc);
+		std::pmr::map<unsigned int, int> c(&res);
+
+		printf("map\t\t%.1f\t%.1f\t%.1f\n", bench_map(a), bench_map(b), bench_map(c));
+	}
+
+	{
+		std::unordered_map<unsigned int, int> a;
+		std::unordered_map<unsigned int, int, std::hash<unsigned int>,
+						   std::equal_to<unsigned int>,
+						   ncx::slab_allocator<value_t> > b(0, std::hash<unsigned int>(),
+															 std::equal_to<unsigned int>(), alloc);
+		std::pmr::unordered_map<unsigned int, int> c(&res);
+
+		printf("unordered_map\t%.1f\t%.1f\t%.1f\n", bench_map(a), bench_map(b), bench_map(c));
+	}
+
+	{
+		std::list<int> a;
+		std::list<int, ncx::slab_allocator<int> > b(alloc);
+		std::pmr::list<int> c(&res);
+
+		printf("list\t\t%.1f\t%.1f\t%.1f\n", bench_list(a), bench_list(b), bench_list(c));
+	}
+
+	printf("\nsize\talloc\tlocked\tfixed\t(ns/op, %d objects)\n", FIXED);
+
+	bench_fixed_size<16>(sp);
+	bench_fixed_size<64>(sp);
+	bench_fixed_size<200>(sp);
+	bench_fixed_size<1000>(sp);
+
+	ncx_slab_destroy(sp);
+
+	return 0;
+}
@@ -0,0 +1,269 @@
+#include "ncx_slab.h"
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+ * 多进程共享内存压测: 父进程在 MAP_SHARED 内存上初始化一个池,
+ * 依次 fork 出 1, 2, 4, ... 个 worker 同时 alloc/free, 最后一轮正好 N 个,
+ * 统计总吞吐.
+ *
+ * 每 SAMPLE 次操作计一次 free+alloc 的延迟; 每 LOCK_SAMPLE 次操作改为
+ * 显式加锁后调用 ncx_slab_free_locked/ncx_slab_alloc_locked, 分别计出
+ * 等锁时间和持锁时间. lock% 由采样的持锁时间按采样率放大后除以墙钟时间,
+ * 接近100%说明这把池锁已成为瓶颈
+ */
+
+#define LIVE            64
+#define SAMPLE          4
+#define LOCK_SAMPLE     16
+
+/* 每个worker的结果, 放在共享内存中由父进程汇总 */
+typedef struct {
+	uint64_t 	hold_ns;                /* 采样的持锁时间之和 */
+	uint32_t 	p50, p99, p999;         /* free+alloc 延迟 */
+	uint32_t 	hold_p50, hold_p99;
+	uint32_t 	wait_p99;
+} worker_stat_t;
+
+uint64_t usTime()
+{
+	struct timeval tv;
+	uint64_t usec;
+
+	gettimeofday(&tv, NULL);
+
+	usec = ((uint64_t)tv.tv_sec)*1000000LL;
+	usec += tv.tv_usec;
+
+	return usec;
+}
+
+static inline uint64_t nsTime()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t lat_pct(uint32_t *lat, int n, int permille)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	qsort(lat, n, sizeof(uint32_t), lat_cmp);
+
+	return lat[(uint64_t) n * permille / 1000];
+}
+
+static void worker(ncx_slab_pool_t *sp, volatile int *go, worker_stat_t *ws,
+	int id, int ops)
+{
+	void *live[LIVE] = { NULL };
+	size_t size[] = { 16, 30, 64, 120, 256, 500, 1000, 3000 };
+	unsigned int r = id * 2654435761u;
+	uint32_t *lat, *hold, *wait;
+	uint64_t t0, t1, t2;
+	int i, k, n, nl;
+	size_t s;
+
+	lat = (uint32_t *) malloc((ops / SAMPLE + 1) * sizeof(uint32_t));
+	hold = (uint32_t *) malloc((ops / LOCK_SAMPLE + 1) * sizeof(uint32_t));
+	wait = (uint32_t *) malloc((ops / LOCK_SAMPLE + 1) * sizeof(uint32_t));
+	memset(ws, 0, sizeof(worker_stat_t));
+	n = nl = 0;
+
+	while (*go == 0) {
+		usleep(100);
+	}
+
+	for (i = 0; i < ops; i++)
+	{
+		r = r * 1103515245 + 12345;
+		k = i % LIVE;
+		s = size[(r >> 16) % (sizeof(size)/sizeof(size_t))];
+
+		if (i % LOCK_SAMPLE == 0) {
+			t0 = nsTime();
+			ncx_shmtx_lock(&sp->mutex);
+			t1 = nsTime();
+
+			if (live[k]) {
+				ncx_slab_free_locked(sp, live[k]);
+			}
+			live[k] = ncx_slab_alloc_locked(sp, s);
+
+			t2 = nsTime();
+			ncx_shmtx_unlock(&sp->mutex);
+
+			wait[nl] = t1 - t0;
+			hold[nl++] = t2 - t1;
+			lat[n++] = nsTime() - t0;
+			ws->hold_ns += t2 - t1;
+
+			continue;
+		}
+
+		if (i % SAMPLE == 0) {
+			t0 = nsTime();
+			if (live[k]) {
+				ncx_slab_free(sp, live[k]);
+			}
+			live[k] = ncx_slab_alloc(sp, s);
+			lat[n++] = nsTime() - t0;
+
+			continue;
+		}
+
+		if (live[k]) {
+			ncx_slab_free(sp, live[k]);
+		}
+
+		live[k] = ncx_slab_alloc(sp, s);
+	}
+
+	ws->p50 = lat_pct(lat, n, 500);
+	ws->p99 = lat_pct(lat, n, 990);
+	ws->p999 = lat_pct(lat, n, 999);
+	ws->hold_p50 = lat_pct(hold, nl, 500);
+	ws->hold_p99 = lat_pct(hold, nl, 990);
+	ws->wait_p99 = lat_pct(wait, nl, 990);
+
+	for (k = 0; k < LIVE; k++) {
+		if (live[k]) {
+			ncx_slab_free(sp, live[k]);
+		}
+	}
+
+	_exit(0);
+}
+
+#define ncx_max(a, b)   ((a) > (b) ? (a) : (b))
+#define ncx_min(a, b)   ((a) < (b) ? (a) : (b))
+
+static void print_stat(worker_stat_t *ws)
+{
+	printf("%u\t%u\t%u\t%u\t%u\t%u", ws->p50, ws->p99, ws->p999,
+		   ws->hold_p50, ws->hold_p99, ws->wait_p99);
+}
+
+int main(int argc, char **argv)
+{
+	ncx_slab_pool_t *sp;
+	worker_stat_t *ws;
+	size_t 	pool_size, map_size;
+	u_char 	*space;
+	volatile int *go;
+	int 	max_workers, ops, n, i;
+	worker_stat_t max;
+	uint64_t us;
+	pid_t 	pid;
+
+	// 不指定时按CPU数, 至少4个进程; 指定了就照用
+	if (argc > 1) {
+		max_workers = atoi(argv[1]);
+		if (max_workers < 1) {
+			fprintf(stderr, "usage: %s [max workers] [ops per worker]\n", argv[0]);
+			return -1;
+		}
+
+	} else {
+		max_workers = ncx_max(sysconf(_SC_NPROCESSORS_ONLN), 4);
+	}
+	ops = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	pool_size = 64 * 1024 * 1024;
+	map_size = pool_size + 4096 + max_workers * sizeof(worker_stat_t);
+	space = (u_char *) mmap(NULL, map_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (space == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	go = (volatile int *) (space + pool_size);
+	ws = (worker_stat_t *) (space + pool_size + 4096);
+	sp = (ncx_slab_pool_t*) space;
+
+	sp->addr = space;
+	sp->min_shift = 3;
+	sp->end = space + pool_size;
+
+	ncx_slab_init(sp);
+
+#if (NCX_HAVE_SHMTX)
+	printf("lock: spin+futex\n");
+#else
+	printf("lock: none (build with -DNCX_HAVE_SHMTX)\n");
+#endif
+	printf("workers\tops\tms\tMops/s\tper-worker\t"
+		   "p50\tp99\tp999\thold50\thold99\twait99\tlock%%\n");
+
+	// 按2的幂递增, 最后一轮正好是 max_workers 个
+	for (n = 1; n <= max_workers;
+		 n = (n < max_workers) ? ncx_min(n << 1, max_workers) : n + 1)
+	{
+		*go = 0;
+
+		for (i = 0; i < n; i++) {
+			pid = fork();
+			if (pid == 0) {
+				worker(sp, go, &ws[i], i + 1, ops);
+			}
+			if (pid == -1) {
+				perror("fork");
+				return -1;
+			}
+		}
+
+		us = usTime();
+		*go = 1;
+
+		for (i = 0; i < n; i++) {
+			wait(NULL);
+		}
+
+		us = usTime() - us;
+
+		// 汇总行的延迟取各worker中最差的, 其后每个worker一行
+		memset(&max, 0, sizeof(worker_stat_t));
+
+		for (i = 0; i < n; i++) {
+			max.hold_ns += ws[i].hold_ns;
+			max.p50 = ncx_max(max.p50, ws[i].p50);
+			max.p99 = ncx_max(max.p99, ws[i].p99);
+			max.p999 = ncx_max(max.p999, ws[i].p999);
+			max.hold_p50 = ncx_max(max.hold_p50, ws[i].hold_p50);
+			max.hold_p99 = ncx_max(max.hold_p99, ws[i].hold_p99);
+			max.wait_p99 = ncx_max(max.wait_p99, ws[i].wait_p99);
+		}
+
+		printf("%d\t%llu\t%llu\t%.2f\t%.2f\t", n,
+			   (unsigned long long) n * ops, (unsigned long long) us / 1000,
+			   (double) n * ops / us, (double) ops / us);
+		print_stat(&max);
+		printf("\t%.1f\n", (double) max.hold_ns * LOCK_SAMPLE / 10 / us);
+
+		for (i = 0; n > 1 && i < n; i++) {
+			printf("  #%d\t\t\t\t\t", i);
+			print_stat(&ws[i]);
+			printf("\n");
+		}
+	}
+
+	munmap(space, map_size);
+
+	return 0;
+}
@@ -0,0 +1,669 @@
+#include "ncx_slab.h"
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+/*
+ * 场景化压测, 输出CSV, 每行一次测量:
+ *   mixed     混合大小分布, 少量存活对象
+ *   lifetime  保持大量存活对象, 随机替换(随机生命周期)
+ *   prodcons  生产者线程分配, 消费者线程释放
+ *   aging     长时间运行, 大小分布分阶段漂移, 每阶段采样一次池的统计
+ *   large     大于 run class 的按页分配反复申请/释放
+ *
+ * 每个场景分别跑 ncx 和 malloc, 各自在 fork 出的子进程中运行, 互不影响RSS.
+ * 每 BENCH_SAMPLE 次操作计时一次, 得到 p50/p99/p999 (ns);
+ * ops_per_sec 按整个场景的墙钟时间计算, 包括采样计时本身的开销.
+ *
+ * 用法: ./suite_bench [场景名|all] [操作数倍率]
+ * suite_bench_pic 以 NCX_SLAB_PIC 编译, 与 suite_bench 中 ncx 的结果对比
+ * 即偏移换算的开销.
+ */
+
+#define BENCH_POOL_SIZE     ((size_t) 1024 * 1024 * 1024)
+#define BENCH_SAMPLE        4
+#define BENCH_RING          4096
+
+typedef struct {
+	const char 	*name;
+	void 		*(*alloc)(size_t size);
+	void 		(*free)(void *p);
+} bench_allocator_t;
+
+typedef struct {
+	uint32_t 	*lat;
+	size_t 		 n, cap;
+} bench_lat_t;
+
+typedef struct {
+	bench_allocator_t 	*a;
+	bench_lat_t 		 lat;
+	void *volatile 		*ring;
+	volatile size_t 	*head, *tail;
+	size_t 				 ops;
+	unsigned int 		 seed;
+} bench_thread_t;
+
+static ncx_slab_pool_t 	*sp;
+static double 			 scale = 1.0;
+
+
+static void *
+ncx_alloc(size_t size)
+{
+	return ncx_slab_alloc(sp, size);
+}
+
+
+static void
+ncx_free(void *p)
+{
+	ncx_slab_free(sp, p);
+}
+
+
+static bench_allocator_t allocators[] = {
+#if (NCX_SLAB_PIC)
+	{ "ncx_pic", ncx_alloc, ncx_free },
+#else
+	{ "ncx",    ncx_alloc, ncx_free },
+#endif
+	{ "malloc", malloc,    free     },
+};
+
+
+static inline uint64_t
+nsTime()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* 队列满/空时等待, 自旋一段时间后让出CPU, CPU数少于线程数时也能推进 */
+static inline void
+bench_wait(ncx_uint_t *spin)
+{
+	if (++*spin % 64) {
+		ncx_cpu_pause();
+		return;
+	}
+
+	sched_yield();
+}
+
+
+static inline unsigned int
+bench_rand(unsigned int *r)
+{
+	*r ^= *r << 13;
+	*r ^= *r >> 17;
+	*r ^= *r << 5;
+
+	return *r;
+}
+
+
+/* 60% 8~128, 30% ~2K, 9% ~16K, 1% ~128K */
+static size_t
+bench_mixed_size(unsigned int *r)
+{
+	unsigned int x = bench_rand(r);
+	unsigned int k = x % 100;
+
+	x >>= 8;
+
+	if (k < 60) {
+		return 8 + x % 121;
+	}
+
+	if (k < 90) {
+		return 129 + x % 1920;
+	}
+
+	if (k < 99) {
+		return 2049 + x % 14336;
+	}
+
+	return 16385 + x % 114688;
+}
+
+
+static void
+bench_lat_init(bench_lat_t *l, size_t ops)
+{
+	l->cap = ops / BENCH_SAMPLE + 1;
+	l->lat = (uint32_t *) malloc(l->cap * sizeof(uint32_t));
+	l->n = 0;
+}
+
+
+static inline void
+bench_lat_add(bench_lat_t *l, uint64_t ns)
+{
+	if (l->n < l->cap) {
+		l->lat[l->n++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+	}
+}
+
+
+static int
+bench_lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static uint32_t
+bench_lat_pct(bench_lat_t *l, double pct)
+{
+	if (l->n == 0) {
+		return 0;
+	}
+
+	return l->lat[(size_t) (l->n * pct / 100)];
+}
+
+
+static size_t
+bench_rss_kb()
+{
+	FILE 	*fp;
+	size_t 	 size, rss;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL) {
+		return 0;
+	}
+
+	if (fscanf(fp, "%zu %zu", &size, &rss) != 2) {
+		rss = 0;
+	}
+
+	fclose(fp);
+
+	return rss * (getpagesize() / 1024);
+}
+
+
+static void
+bench_header()
+{
+	printf("scenario,allocator,threads,step,ops,ops_per_sec,"
+		   "p50_ns,p99_ns,p999_ns,rss_kb,used_kb,used_pct,"
+		   "free_pages,max_free_pages\n");
+}
+
+
+/* 输出一行, malloc 没有池的统计, 对应列留空 */
+static void
+bench_report(const char *scenario, bench_allocator_t *a, int threads,
+	int step, size_t ops, uint64_t ns, bench_lat_t *l)
+{
+	ncx_slab_stat_t stat;
+
+	qsort(l->lat, l->n, sizeof(uint32_t), bench_lat_cmp);
+
+	printf("%s,%s,%d,%d,%zu,%.0f,%u,%u,%u,%zu,", scenario, a->name, threads,
+		   step, ops, ns ? (double) ops * 1000000000 / ns : 0,
+		   bench_lat_pct(l, 50), bench_lat_pct(l, 99), bench_lat_pct(l, 99.9),
+		   bench_rss_kb());
+
+	if (a->alloc == ncx_alloc) {
+		ncx_slab_stat_snapshot(sp, &stat);
+		printf("%zu,%zu,%zu,%zu\n", stat.used_size / 1024, stat.used_pct,
+			   stat.free_page, stat.max_free_pages);
+
+	} else {
+		printf(",,,\n");
+	}
+
+	fflush(stdout);
+}
+
+
+/* 存活窗口只有64个对象, 主要看不同大小混合时的分配路径 */
+static void
+bench_mixed(bench_allocator_t *a)
+{
+	void 			*live[64];
+	bench_lat_t 	 l;
+	unsigned int 	 r;
+	uint64_t 		 t, ns;
+	size_t 			 i, k, ops;
+
+	ops = 4000000 * scale;
+	bench_lat_init(&l, ops);
+	memset(live, 0, sizeof(live));
+	r = 1;
+
+	ns = nsTime();
+	for (i = 0; i < ops; i++)
+	{
+		k = i % 64;
+
+		if (i % BENCH_SAMPLE == 0) {
+			t = nsTime();
+			if (live[k]) {
+				a->free(live[k]);
+			}
+			live[k] = a->alloc(bench_mixed_size(&r));
+			bench_lat_add(&l, nsTime() - t);
+			continue;
+		}
+
+		if (live[k]) {
+			a->free(live[k]);
+		}
+		live[k] = a->alloc(bench_mixed_size(&r));
+	}
+	ns = nsTime() - ns;
+
+	bench_report("mixed", a, 1, 0, ops, ns, &l);
+
+	for (k = 0; k < 64; k++) {
+		if (live[k]) {
+			a->free(live[k]);
+		}
+	}
+}
+
+
+/* 保持20万个存活对象, 每次随机释放一个再分配一个, 对象的生命周期随机 */
+static void
+bench_lifetime(bench_allocator_t *a)
+{
+	void 			**live;
+	bench_lat_t 	 l;
+	unsigned int 	 r;
+	uint64_t 		 t, ns;
+	size_t 			 i, k, n, ops;
+
+	n = 200000;
+	ops = 4000000 * scale;
+	live = (void **) malloc(n * sizeof(void *));
+	r = 2;
+
+	for (i = 0; i < n; i++) {
+		live[i] = a->alloc(8 + bench_rand(&r) % 1024);
+	}
+
+	bench_lat_init(&l, ops);
+
+	ns = nsTime();
+	for (i = 0; i < ops; i++)
+	{
+		k = bench_rand(&r) % n;
+
+		if (i % BENCH_SAMPLE == 0) {
+			t = nsTime();
+			a->free(live[k]);
+			live[k] = a->alloc(8 + bench_rand(&r) % 1024);
+			bench_lat_add(&l, nsTime() - t);
+			continue;
+		}
+
+		a->free(live[k]);
+		live[k] = a->alloc(8 + bench_rand(&r) % 1024);
+	}
+	ns = nsTime() - ns;
+
+	bench_report("lifetime", a, 1, 0, ops, ns, &l);
+
+	for (i = 0; i < n; i++) {
+		a->free(live[i]);
+	}
+
+	free(live);
+}
+
+
+static void *
+bench_producer(void *arg)
+{
+	bench_thread_t 	*bt = arg;
+	void 			*p;
+	uint64_t 		 t;
+	size_t 			 i, h;
+	ncx_uint_t 		 spin = 0;
+
+	for (i = 0; i < bt->ops; i++)
+	{
+		h = *bt->head;
+
+		while (h - *bt->tail == BENCH_RING) {
+			bench_wait(&spin);
+		}
+
+		if (i % BENCH_SAMPLE == 0) {
+			t = nsTime();
+			p = bt->a->alloc(bench_mixed_size(&bt->seed));
+			bench_lat_add(&bt->lat, nsTime() - t);
+
+		} else {
+			p = bt->a->alloc(bench_mixed_size(&bt->seed));
+		}
+
+		bt->ring[h % BENCH_RING] = p;
+
+		ncx_memory_barrier();
+		*bt->head = h + 1;
+	}
+
+	return NULL;
+}
+
+
+static void *
+bench_consumer(void *arg)
+{
+	bench_thread_t 	*bt = arg;
+	void 			*p;
+	uint64_t 		 t;
+	size_t 			 i, c;
+	ncx_uint_t 		 spin = 0;
+
+	for (i = 0; i < bt->ops; i++)
+	{
+		c = *bt->tail;
+
+		while (*bt->head == c) {
+			bench_wait(&spin);
+		}
+
+		ncx_memory_barrier();
+		p = bt->ring[c % BENCH_RING];
+
+		if (i % BENCH_SAMPLE == 0) {
+			t = nsTime();
+			if (p) {
+				bt->a->free(p);
+			}
+			bench_lat_add(&bt->lat, nsTime() - t);
+
+		} else if (p) {
+			bt->a->free(p);
+		}
+
+		ncx_memory_barrier();
+		*bt->tail = c + 1;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * pairs 对生产者/消费者线程, 每对之间一个单生产者单消费者的环形队列;
+ * 分配和释放总在不同线程, 延迟分位数把两边的采样合在一起统计
+ */
+static void
+bench_prodcons(bench_allocator_t *a, int pairs)
+{
+	bench_thread_t 	*bt;
+	pthread_t 		*tid;
+	bench_lat_t 	 l;
+	void *volatile 	*ring;
+	volatile size_t *idx;
+	uint64_t 		 ns;
+	size_t 			 ops;
+	int 			 i;
+
+	ops = 2000000 * scale;
+	bt = (bench_thread_t *) calloc(2 * pairs, sizeof(bench_thread_t));
+	tid = (pthread_t *) calloc(2 * pairs, sizeof(pthread_t));
+	ring = (void *volatile *) calloc(pairs * BENCH_RING, sizeof(void *));
+	// 每个计数器独占一个cache line
+	idx = (volatile size_t *) calloc(pairs * 16, sizeof(size_t));
+
+	for (i = 0; i < 2 * pairs; i++) {
+		bt[i].a = a;
+		bt[i].ring = ring + (i / 2) * BENCH_RING;
+		bt[i].head = idx + (i / 2) * 16;
+		bt[i].tail = idx + (i / 2) * 16 + 8;
+		bt[i].ops = ops;
+		bt[i].seed = i + 1;
+		bench_lat_init(&bt[i].lat, ops);
+	}
+
+	ns = nsTime();
+
+	for (i = 0; i < 2 * pairs; i++) {
+		pthread_create(&tid[i], NULL, (i & 1) ? bench_consumer : bench_producer,
+					   &bt[i]);
+	}
+
+	for (i = 0; i < 2 * pairs; i++) {
+		pthread_join(tid[i], NULL);
+	}
+
+	ns = nsTime() - ns;
+
+	bench_lat_init(&l, 2 * pairs * ops);
+
+	for (i = 0; i < 2 * pairs; i++) {
+		memcpy(l.lat + l.n, bt[i].lat.lat, bt[i].lat.n * sizeof(uint32_t));
+		l.n += bt[i].lat.n;
+		free(bt[i].lat.lat);
+	}
+
+	// 分配和释放各算一次操作
+	bench_report("prodcons", a, 2 * pairs, 0, 2 * pairs * ops, ns, &l);
+
+	free(l.lat);
+	free((void *) idx);
+	free((void *) ring);
+	free(tid);
+	free(bt);
+}
+
+
+/*
+ * 碎片老化: 10万个存活对象长时间随机替换, 每个阶段的大小分布不同
+ * (小对象为主 / 中等 / 混合 / 页级), 每阶段结束采样一次池的统计,
+ * 观察 used_pct 与 max_free_pages 随时间的变化
+ */
+static void
+bench_aging(bench_allocator_t *a)
+{
+	void 			**live;
+	bench_lat_t 	 l;
+	unsigned int 	 r;
+	uint64_t 		 t, ns;
+	size_t 			 i, k, n, ops, s;
+	int 			 step;
+
+	n = 100000;
+	ops = 1000000 * scale;
+	live = (void **) calloc(n, sizeof(void *));
+	r = 3;
+
+	for (step = 0; step < 16; step++)
+	{
+		bench_lat_init(&l, ops);
+
+		ns = nsTime();
+		for (i = 0; i < ops; i++)
+		{
+			k = bench_rand(&r) % n;
+
+			switch (step % 4) {
+			case 0:
+				s = 8 + bench_rand(&r) % 120;
+				break;
+			case 1:
+				s = 256 + bench_rand(&r) % 1792;
+				break;
+			case 2:
+				s = bench_mixed_size(&r);
+				break;
+			default:
+				s = 4096 + bench_rand(&r) % 12288;
+				break;
+			}
+
+			// 页级阶段只替换一部分对象, 避免把池用光
+			if (step % 4 == 3 && k % 8) {
+				s = 8 + bench_rand(&r) % 120;
+			}
+
+			t = (i % BENCH_SAMPLE == 0) ? nsTime() : 0;
+
+			if (live[k]) {
+				a->free(live[k]);
+			}
+			live[k] = a->alloc(s);
+
+			if (t) {
+				bench_lat_add(&l, nsTime() - t);
+			}
+		}
+		ns = nsTime() - ns;
+
+		bench_report("aging", a, 1, step, ops, ns, &l);
+
+		free(l.lat);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (live[i]) {
+			a->free(live[i]);
+		}
+	}
+
+	free(live);
+}
+
+
+/* 16K~1M 的大对象, 保持256个存活 */
+static void
+bench_large(bench_allocator_t *a)
+{
+	void 			*live[256];
+	bench_lat_t 	 l;
+	unsigned int 	 r;
+	uint64_t 		 t, ns;
+	size_t 			 i, k, ops, s;
+
+	ops = 400000 * scale;
+	bench_lat_init(&l, ops);
+	memset(live, 0, sizeof(live));
+	r = 4;
+
+	ns = nsTime();
+	for (i = 0; i < ops; i++)
+	{
+		k = bench_rand(&r) % 256;
+		s = 16384 + bench_rand(&r) % (1024 * 1024 - 16384);
+
+		t = (i % BENCH_SAMPLE == 0) ? nsTime() : 0;
+
+		if (live[k]) {
+			a->free(live[k]);
+		}
+		live[k] = a->alloc(s);
+
+		if (t) {
+			bench_lat_add(&l, nsTime() - t);
+		}
+	}
+	ns = nsTime() - ns;
+
+	bench_report("large", a, 1, 0, ops, ns, &l);
+
+	for (k = 0; k < 256; k++) {
+		if (live[k]) {
+			a->free(live[k]);
+		}
+	}
+}
+
+
+static void
+bench_prodcons_1(bench_allocator_t *a)
+{
+	bench_prodcons(a, 1);
+}
+
+
+static void
+bench_prodcons_4(bench_allocator_t *a)
+{
+	bench_prodcons(a, 4);
+}
+
+
+static struct {
+	const char 	*name;
+	void 		(*run)(bench_allocator_t *a);
+} scenarios[] = {
+	{ "mixed",    bench_mixed },
+	{ "lifetime", bench_lifetime },
+	{ "prodcons", bench_prodcons_1 },
+	{ "prodcons", bench_prodcons_4 },
+	{ "aging",    bench_aging },
+	{ "large",    bench_large },
+};
+
+
+int main(int argc, char **argv)
+{
+	const char 	*only;
+	pid_t 		 pid;
+	int 		 i, j, status, ret;
+
+	only = argc > 1 ? argv[1] : "all";
+	scale = argc > 2 ? atof(argv[2]) : 1.0;
+	ret = 0;
+
+	bench_header();
+	fflush(stdout);
+
+	for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++)
+	{
+		if (strcmp(only, "all") != 0 && strcmp(only, scenarios[i].name) != 0) {
+			continue;
+		}
+
+		for (j = 0; j < sizeof(allocators)/sizeof(allocators[0]); j++)
+		{
+			pid = fork();
+
+			if (pid == -1) {
+				perror("fork");
+				return -1;
+			}
+
+			if (pid == 0) {
+				sp = ncx_slab_create(BENCH_POOL_SIZE, 0, 0);
+				if (sp == NULL) {
+					_exit(1);
+				}
+
+				scenarios[i].run(&allocators[j]);
+
+				ncx_slab_tcache_flush(sp);
+				ncx_slab_destroy(sp);
+
+				_exit(0);
+			}
+
+			if (waitpid(pid, &status, 0) == -1
+				|| !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				fprintf(stderr, "%s/%s failed\n", scenarios[i].name,
+						allocators[j].name);
+				ret = -1;
+			}
+		}
+	}
+
+	return ret;
+}
@@ -1,4 +1,1612 @@
 #include "ncx_slab.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#define POOLS 	16
+
+/*
+ * 多个大小不同的池同时使用: 随机在各个池上 alloc/free, 全部释放后
+ * 每个池都应该重新合并成一整块空闲页. 过程中定期用 ncx_slab_stat
+ * 遍历核对增量维护的计数
+ */
+int test_many_pools()
+{
+	ncx_slab_pool_t *pools[POOLS];
+	ncx_slab_stat_t stat;
+	void 	*ptrs[POOLS][128];
+	size_t 	pool_size;
+	u_char 	*space;
+	unsigned int r;
+	int 	i, k, n, ret;
+
+	for (i = 0; i < POOLS; i++)
+	{
+		pool_size = (8 * 1024 * 1024) >> (i % 8);  //8M ~ 64K
+		space = (u_char *)malloc(pool_size);
+
+		pools[i] = (ncx_slab_pool_t*) space;
+		pools[i]->addr = space;
+		pools[i]->min_shift = 3;
+		pools[i]->end = space + pool_size;
+
+		ncx_slab_init(pools[i]);
+	}
+
+	memset(ptrs, 0, sizeof(ptrs));
+	r = 1;
+	ret = 0;
+
+	for (n = 0; n < 200000; n++)
+	{
+		r = r * 1103515245 + 12345;
+		i = (r >> 4) % POOLS;
+		k = (r >> 8) % 128;
+
+		if (ptrs[i][k]) {
+			ncx_slab_free(pools[i], ptrs[i][k]);
+			ptrs[i][k] = NULL;
+
+		} else {
+			ptrs[i][k] = ncx_slab_alloc(pools[i], 1 + (r >> 16) % 12000);
+		}
+
+		if (n % 10000 == 0 && ncx_slab_stat(pools[i], &stat) != 0) {
+			printf("pool %d: counters mismatch after %d ops\n", i, n);
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < POOLS; i++)
+	{
+		for (k = 0; k < 128; k++) {
+			if (ptrs[i][k]) {
+				ncx_slab_free(pools[i], ptrs[i][k]);
+			}
+		}
+
+		ncx_slab_tcache_flush(pools[i]);
+		// 保留的空slab也归还, 之后应当全部空闲
+		ncx_slab_retain(pools[i], 0);
+
+		if (ncx_slab_stat(pools[i], &stat) != 0) {
+			ret = -1;
+		}
+
+		if (stat.used_size || stat.free_page != stat.pages) {
+			printf("pool %d: %zu pages, %zu free\n",
+				   i, stat.pages, stat.free_page);
+			ret = -1;
+		}
+
+#if (PAGE_MERGE)
+		// 相邻空闲页合并后应当只剩一整块
+		if (stat.max_free_pages != stat.pages) {
+			printf("pool %d: %zu pages, max free run %zu\n",
+				   i, stat.pages, stat.max_free_pages);
+			ret = -1;
+		}
+#endif
+
+		free(pools[i]->addr);
+	}
+
+	return ret;
+}
+
+/*
+ * 不同的slab页大小: 每种页大小下把所有slab类都分配到好几页,
+ * 写满后检查没有重叠, 再全部释放
+ */
+int test_pagesize()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	size_t 	pagesize[] = { 4096, 16384, 65536, 2 * 1024 * 1024 };
+	size_t 	pool_size, s;
+	u_char 	*space, **ptrs;
+	int 	i, j, k, n, ret;
+
+	pool_size = 64 * 1024 * 1024;
+	space = (u_char *)malloc(pool_size);
+	n = 4096;
+	ptrs = (u_char **)malloc(n * sizeof(u_char *));
+	ret = 0;
+
+	for (i = 0; i < sizeof(pagesize)/sizeof(size_t); i++)
+	{
+		sp = (ncx_slab_pool_t*) space;
+
+		sp->addr = space;
+		sp->min_shift = 3;
+		sp->end = space + pool_size;
+
+		ncx_slab_init_pagesize(sp, pagesize[i]);
+
+		for (s = 8; s <= pagesize[i] * 2; s <<= 1)
+		{
+			for (k = 0; k < n; k++) {
+				ptrs[k] = ncx_slab_alloc(sp, s);
+				if (ptrs[k] == NULL) {
+					break;
+				}
+				memset(ptrs[k], k & 0xff, s);
+			}
+
+			for (j = 0; j < k; j++) {
+				if (ptrs[j][0] != (j & 0xff) || ptrs[j][s - 1] != (j & 0xff)) {
+					printf("pagesize %zu size %zu: chunk %d overlapped\n",
+						   pagesize[i], s, j);
+					ret = -1;
+				}
+				ncx_slab_free(sp, ptrs[j]);
+			}
+		}
+
+		ncx_slab_tcache_flush(sp);
+		ncx_slab_retain(sp, 0);
+
+		if (ncx_slab_stat(sp, &stat) != 0) {
+			ret = -1;
+		}
+
+		if (stat.used_size || stat.free_page != stat.pages) {
+			printf("pagesize %zu: %zu pages, %zu free\n",
+				   pagesize[i], stat.pages, stat.free_page);
+			ret = -1;
+		}
+
+#if (PAGE_MERGE)
+		if (stat.max_free_pages != stat.pages) {
+			printf("pagesize %zu: %zu pages, max free run %zu\n",
+				   pagesize[i], stat.pages, stat.max_free_pages);
+			ret = -1;
+		}
+#endif
+	}
+
+	free(ptrs);
+	free(space);
+
+	return ret;
+}
+
+/*
+ * 非2的幂的size class: 33字节按40字节分配, 1100字节按1280字节分配,
+ * 比半页大的从多页run中切分: 2100字节按2560, 5000字节按5120分配;
+ * ncx_slab_stat 中的 requested/consumed 能看出取整的浪费
+ */
+int test_size_class()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	size_t 	size[] = { 33, 1100, 2100, 5000 };
+	size_t 	class[] = { 40, 1280, 2560, 5120 };
+	size_t 	pool_size;
+	u_char 	*space, *p[8];
+	int 	i, j, ret;
+
+	pool_size = 1024 * 1024;
+	space = (u_char *)malloc(pool_size);
+	ret = 0;
+
+	for (i = 0; i < sizeof(size)/sizeof(size_t); i++)
+	{
+		sp = (ncx_slab_pool_t*) space;
+
+		sp->addr = space;
+		sp->min_shift = 3;
+		sp->end = space + pool_size;
+
+		ncx_slab_init_pagesize(sp, 4096);
+
+		for (j = 0; j < 8; j++) {
+			p[j] = ncx_slab_alloc(sp, size[i]);
+			memset(p[j], j, size[i]);
+		}
+
+		ncx_slab_tcache_flush(sp);
+		ncx_slab_stat_snapshot(sp, &stat);
+
+		if (p[2] - p[1] != class[i]
+			|| stat.requested_size != 8 * size[i]
+			|| stat.consumed_size != 8 * class[i]
+			|| stat.used_size != 8 * class[i])
+		{
+			printf("size %zu: step %zu, requested %zu, consumed %zu, used %zu\n",
+				   size[i], (size_t) (p[2] - p[1]), stat.requested_size,
+				   stat.consumed_size, stat.used_size);
+			ret = -1;
+		}
+
+		for (j = 0; j < 8; j++) {
+			if (p[j][size[i] - 1] != j) {
+				ret = -1;
+			}
+			ncx_slab_free(sp, p[j]);
+		}
+	}
+
+	free(space);
+
+	return ret;
+}
+
+/*
+ * 各size class的计数: 64K的池里反复申请100字节直到失败,
+ * 释放一半后检查 used/peak/allocs/frees/fails
+ */
+int test_class_stat()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_class_stat_t cs[NCX_SLAB_CLASS_MAX];
+	size_t 	pool_size;
+	u_char 	*space;
+	void 	*ptrs[1024];
+	int 	i, k, n, ret;
+
+	pool_size = 64 * 1024;
+	space = (u_char *)malloc(pool_size);
+	sp = (ncx_slab_pool_t*) space;
+
+	sp->addr = space;
+	sp->min_shift = 3;
+	sp->end = space + pool_size;
+
+	ncx_slab_init_pagesize(sp, 4096);
+
+	for (k = 0; k < 1024; k++) {
+		ptrs[k] = ncx_slab_alloc_locked(sp, 100);
+		if (ptrs[k] == NULL) {
+			break;
+		}
+	}
+
+	for (i = 0; i < k; i += 2) {
+		ncx_slab_free_locked(sp, ptrs[i]);
+	}
+
+	n = ncx_slab_stat_classes(sp, cs, NCX_SLAB_CLASS_MAX);
+
+	for (i = 0; i < n && cs[i].size != 112; i++) { /* void */ }
+
+	ret = 0;
+
+	if (k == 1024 || i == n || cs[n - 1].size != 0
+		|| cs[i].used != k - (k + 1) / 2 || cs[i].slabs < cs[i].partial)
+	{
+		ret = -1;
+	}
+
+#if (NCX_SLAB_STATS)
+	if (cs[i].peak != k || cs[i].allocs != k
+		|| cs[i].frees != (k + 1) / 2 || cs[i].fails != 1)
+	{
+		ret = -1;
+	}
+#endif
+
+	if (ret != 0) {
+		ncx_slab_stat_print(sp, stdout);
+	}
+
+	free(space);
+
+	return ret;
+}
+
+/*
+ * ncx_slab_alloc_aligned: 16字节到一页的各种对齐, 大小覆盖 slab/run/按页分配
+ */
+int test_aligned()
+{
+	ncx_slab_pool_t *sp;
+	size_t 	pool_size, align, s;
+	u_char 	*space, *p;
+	int 	ret;
+
+	pool_size = 8 * 1024 * 1024;
+	space = (u_char *)malloc(pool_size);
+	sp = (ncx_slab_pool_t*) space;
+
+	sp->addr = space;
+	sp->min_shift = 3;
+	sp->end = space + pool_size;
+
+	ncx_slab_init_pagesize(sp, 4096);
+	ret = 0;
+
+	for (align = 16; align <= 4096; align <<= 1)
+	{
+		for (s = 1; s < 40000; s = s * 3 + 1)
+		{
+			p = ncx_slab_alloc_aligned(sp, s, align);
+
+			if (p == NULL || ((uintptr_t) p & (align - 1))
+				|| ncx_slab_usable_size(sp, p) < s)
+			{
+				printf("align %zu size %zu: %p\n", align, s, (void *) p);
+				ret = -1;
+			}
+
+			ncx_slab_free(sp, p);
+		}
+	}
+
+	if (ncx_slab_alloc_aligned(sp, 8, 8192) != NULL) {
+		ret = -1;
+	}
+
+	ncx_slab_tcache_flush(sp);
+	free(space);
+
+	return ret;
+}
+
+/*
+ * 对象缓存: ctor 只在slab创建时调用, 释放再分配得到的仍是构造过的对象;
+ * 缓存对象也能用 ncx_slab_free 释放, destroy 之后页全部归还
+ */
+static int 	ctor_calls;
+
+static void test_ctor(void *obj)
+{
+	ctor_calls++;
+	*(uintptr_t *) obj = (uintptr_t) obj;
+}
+
+int test_cache()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_cache_t *cache;
+	ncx_slab_stat_t stat;
+	size_t 	pool_size, sizes[2] = { 40, 1000 };
+	ncx_uint_t 	free_pages;
+	u_char 	*space;
+	void 	*ptrs[100];
+	int 	i, k, ret;
+
+	pool_size = 1024 * 1024;
+	space = (u_char *)malloc(pool_size);
+	sp = (ncx_slab_pool_t*) space;
+
+	sp->addr = space;
+	sp->min_shift = 3;
+	sp->end = space + pool_size;
+
+	ncx_slab_init_pagesize(sp, 4096);
+	free_pages = sp->free_pages;
+	ret = 0;
+
+	for (k = 0; k < 2; k++)
+	{
+		ctor_calls = 0;
+
+		cache = ncx_slab_cache_create(sp, sizes[k], 0, test_ctor);
+		if (cache == NULL) {
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < 100; i++) {
+			ptrs[i] = ncx_slab_cache_alloc(cache);
+
+			if (ptrs[i] == NULL || *(uintptr_t *) ptrs[i] != (uintptr_t) ptrs[i]
+				|| ncx_slab_usable_size(sp, ptrs[i]) != cache->cls.size)
+			{
+				ret = -1;
+			}
+
+			*((uintptr_t *) ptrs[i] + 1) = i;
+		}
+
+		if (ctor_calls != (int) (cache->cls.slabs * cache->cls.chunks)) {
+			ret = -1;
+		}
+
+		for (i = 0; i < 100; i += 2) {
+			if (i % 4) {
+				ncx_slab_free(sp, ptrs[i]);
+			} else {
+				ncx_slab_cache_free(cache, ptrs[i]);
+			}
+		}
+
+		if (ncx_slab_stat(sp, &stat) != 0 || stat.p_cache == 0) {
+			ret = -1;
+		}
+
+		// 复用的对象没有被清理, ctor 也没有再调用
+		for (i = 0; i < 100; i += 2) {
+			ptrs[i] = ncx_slab_cache_alloc(cache);
+
+			if (*(uintptr_t *) ptrs[i] != (uintptr_t) ptrs[i]
+				|| *((uintptr_t *) ptrs[i] + 1) % 2 != 0)
+			{
+				ret = -1;
+			}
+		}
+
+		if (ctor_calls != (int) (cache->cls.slabs * cache->cls.chunks)) {
+			ret = -1;
+		}
+
+		ncx_slab_cache_destroy(cache);
+		ncx_slab_tcache_flush(sp);
+		ncx_slab_retain(sp, 0);
+
+		if (ncx_slab_stat(sp, &stat) != 0 || stat.p_cache != 0
+			|| sp->free_pages != free_pages)
+		{
+			ret = -1;
+		}
+	}
+
+	if (ret != 0) {
+		ncx_slab_stat_print(sp, stdout);
+	}
+
+	free(space);
+
+	return ret;
+}
+
+/*
+ * 可增长池: 用满后新增arena, 到上限后分配失败; 释放时按地址找到所属arena,
+ * 统计包含所有arena
+ */
+int test_grow()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	size_t 	pool_size;
+	void 	*ptrs[4096], *big;
+	int 	i, k, ret;
+
+	pool_size = 256 * 1024;
+
+	sp = ncx_slab_create(pool_size, 4096, NCX_SLAB_GROW);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ncx_slab_grow_limit(sp, 0, pool_size * 4);
+	ret = 0;
+
+	for (k = 0; k < 4096; k++) {
+		ptrs[k] = ncx_slab_alloc(sp, 100 + k % 900);
+		if (ptrs[k] == NULL) {
+			break;
+		}
+
+		if (ncx_slab_usable_size(sp, ptrs[k]) < 100 + (size_t) (k % 900)) {
+			ret = -1;
+		}
+	}
+
+	// 到上限之前新增了3个arena
+	if (k == 4096 || sp->narenas != 3
+		|| ncx_slab_stat(sp, &stat) != 0 || stat.pool_size <= pool_size * 3)
+	{
+		ret = -1;
+	}
+
+	for (i = 0; i < k; i++) {
+		ncx_slab_free(sp, ptrs[i]);
+	}
+
+	// 比arena还大的请求单独映射一个足够大的arena
+	ncx_slab_grow_limit(sp, 0, pool_size * 16);
+
+	big = ncx_slab_alloc(sp, pool_size * 2);
+
+	if (big == NULL || sp->narenas != 4
+		|| ncx_slab_usable_size(sp, big) < pool_size * 2)
+	{
+		ret = -1;
+	}
+
+	ncx_slab_free(sp, big);
+	ncx_slab_tcache_flush(sp);
+	ncx_slab_retain(sp, 0);
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.used_size != 0
+		|| stat.free_page != stat.pages)
+	{
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		ncx_slab_stat_print(sp, stdout);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+/*
+ * 保留空slab: 各种slab(SMALL/EXACT/BIG/RUN)反复分配释放不再进出页分配器;
+ * 超过上限时退到一半; 页不够用时保留的slab先还回来
+ */
+int test_retain()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	ncx_slab_class_stat_t cs[NCX_SLAB_CLASS_MAX];
+	size_t 	size[4], chunks;
+	void 	*p[64], **q;
+	ncx_uint_t 	free_pages, slot;
+	int 	i, j, k, ret;
+
+	sp = ncx_slab_create(1024 * 1024, 4096, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ret = 0;
+
+	size[0] = 24;
+	size[1] = sp->exact_size;
+	size[2] = 1000;
+	size[3] = 3000;
+
+	for (i = 0; i < 4; i++) {
+		p[i] = ncx_slab_alloc_locked(sp, size[i]);
+		ncx_slab_free_locked(sp, p[i]);
+	}
+
+	free_pages = sp->free_pages;
+
+	for (j = 0; j < 1000; j++) {
+		for (i = 0; i < 4; i++) {
+			p[i] = ncx_slab_alloc_locked(sp, size[i]);
+		}
+
+		// 用的都是保留的slab
+		if (sp->free_pages != free_pages) {
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < 4; i++) {
+			ncx_slab_free_locked(sp, p[i]);
+		}
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.used_size != 0
+		|| stat.retained_page == 0
+		|| stat.retained_page != stat.pages - stat.free_page)
+	{
+		ret = -1;
+	}
+
+	// 1000字节的BIG页: 依次释放6页, 保留到第4页, 第5页归还并退到2页, 第6页再保留
+	ncx_slab_retain(sp, 4);
+
+	ncx_slab_stat_classes(sp, cs, NCX_SLAB_CLASS_MAX);
+	for (slot = 0; cs[slot].size < size[2]; slot++) { /* void */ }
+
+	chunks = cs[slot].pages * sp->pagesize / cs[slot].size;
+
+	for (k = 0; k < (int) (6 * chunks) && k < 64; k++) {
+		p[k] = ncx_slab_alloc_locked(sp, size[2]);
+	}
+
+	for (i = 0; i < k; i++) {
+		ncx_slab_free_locked(sp, p[i]);
+	}
+
+	ncx_slab_stat_classes(sp, cs, NCX_SLAB_CLASS_MAX);
+
+	if (k != (int) (6 * chunks) || cs[slot].retained != 3
+		|| cs[slot].slabs != 3 || ncx_slab_stat(sp, &stat) != 0)
+	{
+		ret = -1;
+	}
+
+	// 占满整个池后全部释放, 页都留在class里; 大块分配时把保留的slab要回来
+	ncx_slab_retain(sp, 1024);
+
+	q = malloc(2048 * sizeof(void *));
+
+	for (k = 0; k < 2048; k++) {
+		q[k] = ncx_slab_alloc_locked(sp, size[2]);
+		if (q[k] == NULL) {
+			break;
+		}
+	}
+
+	for (i = 0; i < k; i++) {
+		ncx_slab_free_locked(sp, q[i]);
+	}
+
+	free(q);
+
+	if (sp->free_pages > 8) {
+		ret = -1;
+	}
+
+#if (PAGE_MERGE)
+	// 要回来的单页要合并才放得下大块
+	q = ncx_slab_alloc_locked(sp, 512 * 1024);
+	if (q == NULL) {
+		ret = -1;
+	}
+#endif
+
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("retain: free pages %zu/%zu, retained %zu\n",
+			   (size_t) sp->free_pages, (size_t) free_pages,
+			   stat.retained_page);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+/*
+ * 空闲页回收: 释放的大块空闲够久后中间页被 madvise 掉(mincore 看不到驻留),
+ * 再次分配时回收计数相应减少, 计数始终与遍历结果一致
+ */
+int test_purge()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	unsigned char vec;
+	u_char 	*p[32];
+	size_t 	size;
+	int 	i, ret;
+
+	sp = ncx_slab_create(16 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ncx_slab_purge_decay(sp, 1, 0);
+	ret = 0;
+
+	size = 64 * sp->pagesize;
+
+	for (i = 0; i < 32; i++) {
+		p[i] = ncx_slab_alloc(sp, size);
+		if (p[i] == NULL) {
+			ncx_slab_destroy(sp);
+			return -1;
+		}
+
+		memset(p[i], 1, size);
+	}
+
+	ncx_slab_stat(sp, &stat);
+	if (stat.purged_page != 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < 32; i += 2) {
+		ncx_slab_free(sp, p[i]);
+	}
+
+	usleep(20 * 1000);
+	ncx_slab_purge(sp);
+
+	// 每个空闲块只保留首尾页
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.purged_page < 16 * 62) {
+		ret = -1;
+	}
+
+	if (mincore(p[0] + sp->pagesize, sp->pagesize, &vec) == 0 && (vec & 1)) {
+		ret = -1;
+	}
+
+	for (i = 0; i < 32; i += 2) {
+		p[i] = ncx_slab_alloc(sp, size);
+		if (p[i] == NULL) {
+			ncx_slab_destroy(sp);
+			return -1;
+		}
+
+		memset(p[i], 2, size);
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < 32; i++) {
+		ncx_slab_free(sp, p[i]);
+	}
+
+	ncx_slab_tcache_flush(sp);
+	ncx_slab_retain(sp, 0);
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("purged %zu free %zu pages %zu\n",
+			   stat.purged_page, stat.free_page, stat.pages);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+/*
+ * 文件池: 正常关闭后重新打开, 数据和计数原样保留; 子进程打开后分配并改乱计数,
+ * 不关闭就退出, 再打开时修复: 计数与遍历一致, 全部释放后合并成一整块
+ */
+int test_persist()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	char 	path[64];
+	size_t 	*root, sizes[4] = { 24, 1000, 3000, 20000 };
+	u_char 	*p;
+	pid_t 	pid;
+	int 	i, status, ret;
+
+	snprintf(path, sizeof(path), "/tmp/ncx_persist_test.%d", (int) getpid());
+	unlink(path);
+
+	sp = ncx_slab_open(path, 4 * 1024 * 1024, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	// 根对象记录各chunk相对池头的偏移, 重新打开时池可能在别的地址
+	root = ncx_slab_alloc(sp, 64 * sizeof(size_t));
+
+	for (i = 0; i < 64; i++) {
+		p = ncx_slab_alloc(sp, sizes[i % 4]);
+		memset(p, i, sizes[i % 4]);
+		root[i] = p - (u_char *) sp;
+	}
+
+	ncx_slab_set_root(sp, root);
+
+	ret = (ncx_slab_open(path, 0, 0) == NULL) ? 0 : -1;
+
+	ncx_slab_close(sp);
+
+	sp = ncx_slab_open(path, 0, 0);
+	if (sp == NULL) {
+		unlink(path);
+		return -1;
+	}
+
+	root = ncx_slab_root(sp);
+
+	for (i = 0; i < 64; i++) {
+		p = (u_char *) sp + root[i];
+
+		if (p[sizes[i % 4] - 1] != i) {
+			ret = -1;
+		}
+
+		if (i % 2) {
+			ncx_slab_free(sp, p);
+		}
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		ret = -1;
+	}
+
+	ncx_slab_close(sp);
+
+	pid = fork();
+
+	if (pid == 0) {
+		sp = ncx_slab_open(path, 0, 0);
+		if (sp == NULL) {
+			_exit(1);
+		}
+
+		root = ncx_slab_root(sp);
+
+		for (i = 1; i < 64; i += 2) {
+			p = ncx_slab_alloc(sp, sizes[i % 4]);
+			memset(p, i, sizes[i % 4]);
+			root[i] = p - (u_char *) sp;
+		}
+
+		ncx_slab_tcache_flush(sp);
+
+		sp->free_pages = 0;
+		sp->free_map = 0;
+		sp->large_pages += 3;
+
+		_exit(0);
+	}
+
+	if (pid == -1 || waitpid(pid, &status, 0) == -1
+		|| !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		unlink(path);
+		return -1;
+	}
+
+	sp = ncx_slab_open(path, 0, 0);
+	if (sp == NULL) {
+		unlink(path);
+		return -1;
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || sp->free_map == 0) {
+		ret = -1;
+	}
+
+	root = ncx_slab_root(sp);
+
+	for (i = 0; i < 64; i++) {
+		p = (u_char *) sp + root[i];
+
+		if (p[0] != i) {
+			ret = -1;
+		}
+
+		ncx_slab_free(sp, p);
+	}
+
+	ncx_slab_free(sp, root);
+	ncx_slab_tcache_flush(sp);
+	ncx_slab_retain(sp, 0);
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("persist: free %zu/%zu pages\n", stat.free_page, stat.pages);
+	}
+
+	ncx_slab_close(sp);
+	unlink(path);
+
+	return ret;
+}
+
+#if (NCX_HAVE_SHMTX)
+/*
+ * 校验模式与并发: 子进程在共享池上不停分配释放, 父进程同时反复 ncx_slab_stat,
+ * 遍历和计数在同一把锁内读取, 不应出现不一致
+ */
+int test_stat_shared()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	void 	*p[256];
+	unsigned int r;
+	pid_t 	pid;
+	int 	i, k, status, bad;
+
+	sp = ncx_slab_create(16 * 1024 * 1024, 0, NCX_SLAB_SHARED);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	pid = fork();
+
+	if (pid == 0) {
+		memset(p, 0, sizeof(p));
+		r = 1;
+
+		for (i = 0; i < 500000; i++) {
+			r = r * 1103515245 + 12345;
+			k = (r >> 8) & 255;
+
+			if (p[k]) {
+				ncx_slab_free(sp, p[k]);
+			}
+
+			p[k] = ncx_slab_alloc(sp, 16 + (r >> 16) % 6000);
+		}
+
+		_exit(0);
+	}
+
+	if (pid == -1) {
+		ncx_slab_destroy(sp);
+		return -1;
+	}
+
+	bad = 0;
+
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		if (ncx_slab_stat(sp, &stat) != 0) {
+			bad++;
+		}
+	}
+
+	if (bad) {
+		printf("stat_shared: %d mismatches\n", bad);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return bad ? -1 : 0;
+}
+
+/*
+ * 持锁进程异常退出: 子进程持有池锁时 _exit, 父进程下次加锁发现持有者已不存在
+ * 即接管; 再一次子进程持锁退出后, 由父进程 ncx_shmtx_force_unlock 强制释放,
+ * 两种情况之后池都应可以继续使用
+ */
+int test_shmtx_owner()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	void 	*p;
+	pid_t 	pid;
+	int 	round, status, ret;
+
+	sp = ncx_slab_create(4 * 1024 * 1024, 0, NCX_SLAB_SHARED);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ret = 0;
+
+	for (round = 0; round < 2; round++)
+	{
+		pid = fork();
+
+		if (pid == 0) {
+			ncx_shmtx_lock(&sp->mutex);
+			(void) ncx_slab_alloc_locked(sp, 100);
+			_exit(0);
+		}
+
+		if (pid == -1) {
+			ret = -1;
+			break;
+		}
+
+		// 回收后 kill(pid, 0) 才返回 ESRCH
+		if (waitpid(pid, &status, 0) != pid || sp->mutex.lock != (uint32_t) pid) {
+			ret = -1;
+			break;
+		}
+
+		if (round == 1) {
+			if (ncx_shmtx_force_unlock(&sp->mutex, pid + 1) != 0
+				|| ncx_shmtx_force_unlock(&sp->mutex, pid) != 1
+				|| sp->mutex.lock != 0)
+			{
+				ret = -1;
+				break;
+			}
+		}
+
+		// 锁没能接管时这里会一直等下去, 由 alarm 结束测试
+		alarm(10);
+		p = ncx_slab_alloc(sp, 100);
+		alarm(0);
+
+		if (p == NULL || sp->mutex.lock != 0) {
+			ret = -1;
+			break;
+		}
+
+		ncx_slab_free(sp, p);
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || (ret == 0 && stat.used_size == 0)) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("shmtx_owner: lock %u, used %zu\n",
+			   (unsigned) sp->mutex.lock, stat.used_size);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+#endif
+
+#if (NCX_SLAB_TCACHE)
+/*
+ * 线程缓存: 几个线程各自分配, 再释放相邻线程分配的chunk, 每轮之间主线程
+ * 用 ncx_slab_stat 核对(缓存中的chunk计为已分配); 线程退出时缓存自动归还,
+ * 之后池应全部空闲. 另外, 池在别的线程仍缓存着它的chunk时被销毁, 同一地址上
+ * 可能建起新池, 那个线程之后使用新池和退出时都不能碰到旧的chunk
+ */
+#define TCACHE_THREADS 	4
+#define TCACHE_OBJS 	512
+#define TCACHE_ROUNDS 	50
+
+typedef struct {
+	ncx_slab_pool_t *sp, *next;
+	pthread_barrier_t barrier;
+	int 	id;
+	void 	*objs[TCACHE_THREADS][TCACHE_OBJS];
+	int 	bad;
+} tcache_test_t;
+
+typedef struct {
+	tcache_test_t *t;
+	int 	id;
+} tcache_arg_t;
+
+static void *tcache_worker(void *data)
+{
+	tcache_arg_t *a = data;
+	tcache_test_t *t = a->t;
+	u_char 	*p;
+	unsigned int r;
+	int 	i, k, round;
+
+	r = a->id + 1;
+
+	for (round = 0; round < TCACHE_ROUNDS; round++)
+	{
+		for (k = 0; k < TCACHE_OBJS; k++) {
+			r = r * 1103515245 + 12345;
+			p = ncx_slab_alloc(t->sp, 8 + (r >> 16) % 2000);
+			if (p != NULL) {
+				p[0] = (u_char) (a->id + k);
+			}
+
+			t->objs[a->id][k] = p;
+		}
+
+		// 主线程在两次等待之间核对计数
+		pthread_barrier_wait(&t->barrier);
+		pthread_barrier_wait(&t->barrier);
+
+		i = (a->id + 1) % TCACHE_THREADS;
+
+		for (k = 0; k < TCACHE_OBJS; k++) {
+			p = t->objs[i][k];
+			if (p == NULL || p[0] != (u_char) (i + k)) {
+				__sync_fetch_and_add(&t->bad, 1);
+				continue;
+			}
+
+			ncx_slab_free(t->sp, p);
+		}
+
+		pthread_barrier_wait(&t->barrier);
+	}
+
+	return NULL;
+}
+
+static void *tcache_holder(void *data)
+{
+	tcache_test_t *t = data;
+	void 	*p;
+
+	// 在旧池上留下缓存
+	p = ncx_slab_alloc(t->sp, 24);
+	ncx_slab_free(t->sp, p);
+
+	pthread_barrier_wait(&t->barrier);
+	pthread_barrier_wait(&t->barrier);
+
+	p = ncx_slab_alloc(t->next, 24);
+	if (p == NULL) {
+		t->bad++;
+		return NULL;
+	}
+
+	memset(p, 0x5a, 24);
+	ncx_slab_free(t->next, p);
+
+	return NULL;
+}
+
+int test_tcache()
+{
+	static tcache_test_t t;
+	tcache_arg_t args[TCACHE_THREADS];
+	pthread_t tids[TCACHE_THREADS];
+	ncx_slab_stat_t stat;
+	size_t 	cached;
+	int 	i, round, ret;
+
+	t.sp = ncx_slab_create(64 * 1024 * 1024, 0, 0);
+	if (t.sp == NULL) {
+		return -1;
+	}
+
+	ncx_slab_retain(t.sp, 0);
+	pthread_barrier_init(&t.barrier, NULL, TCACHE_THREADS + 1);
+
+	for (i = 0; i < TCACHE_THREADS; i++) {
+		args[i].t = &t;
+		args[i].id = i;
+		pthread_create(&tids[i], NULL, tcache_worker, &args[i]);
+	}
+
+	ret = 0;
+	cached = 0;
+
+	for (round = 0; round < TCACHE_ROUNDS; round++)
+	{
+		pthread_barrier_wait(&t.barrier);
+
+		if (ncx_slab_stat(t.sp, &stat) != 0) {
+			printf("tcache: counters mismatch in round %d\n", round);
+			ret = -1;
+		}
+
+		cached += stat.cached_size;
+
+		pthread_barrier_wait(&t.barrier);
+		pthread_barrier_wait(&t.barrier);
+	}
+
+	// 线程退出时归还各自的缓存
+	for (i = 0; i < TCACHE_THREADS; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_barrier_destroy(&t.barrier);
+
+	if (ncx_slab_stat(t.sp, &stat) != 0 || stat.cached_size != 0
+		|| stat.free_page != stat.pages || cached == 0 || t.bad)
+	{
+		printf("tcache: free %zu/%zu pages, cached %zu, bad %d\n",
+			   stat.free_page, stat.pages, stat.cached_size, t.bad);
+		ret = -1;
+	}
+
+	// 另一个线程还缓存着旧池的chunk时销毁它, 再建一个同样大小的池
+	pthread_barrier_init(&t.barrier, NULL, 2);
+	pthread_create(&tids[0], NULL, tcache_holder, &t);
+
+	pthread_barrier_wait(&t.barrier);
+
+	ncx_slab_destroy(t.sp);
+	t.sp = NULL;
+
+	t.next = ncx_slab_create(64 * 1024 * 1024, 0, 0);
+	if (t.next == NULL) {
+		return -1;
+	}
+
+	ncx_slab_retain(t.next, 0);
+
+	pthread_barrier_wait(&t.barrier);
+	pthread_join(tids[0], NULL);
+	pthread_barrier_destroy(&t.barrier);
+
+	if (ncx_slab_stat(t.next, &stat) != 0 || stat.cached_size != 0
+		|| stat.free_page != stat.pages || t.bad)
+	{
+		printf("tcache: new pool free %zu/%zu pages, cached %zu\n",
+			   stat.free_page, stat.pages, stat.cached_size);
+		ret = -1;
+	}
+
+	ncx_slab_destroy(t.next);
+
+	return ret;
+}
+#endif
+
+/*
+ * 按需初始化: 刚创建的大池没有切出任何页, 页描述符数组末尾和数据页都不驻留;
+ * 逐块分配直到用满, 全部释放后仍合并成一整块
+ */
+int test_lazy()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	unsigned char vec;
+	u_char 	*p, *head;
+	size_t 	size, n, total;
+	int 	ret;
+
+	sp = ncx_slab_create(256 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ret = (sp->carved == 0) ? 0 : -1;
+
+	// 页描述符数组的最后一页紧挨在数据区之前
+	p = (u_char *) ((uintptr_t) (ncx_slab_start(sp) - 1)
+					& ~(uintptr_t) (getpagesize() - 1));
+
+	if (mincore(p, getpagesize(), &vec) == 0 && (vec & 1)) {
+		ret = -1;
+	}
+
+	p = ncx_slab_end(sp) - getpagesize();
+
+	if (mincore(p, getpagesize(), &vec) == 0 && (vec & 1)) {
+		ret = -1;
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages
+		|| stat.max_free_pages != stat.pages)
+	{
+		ret = -1;
+	}
+
+	// 每块的开头记下一块的地址, 串成链表
+	size = 1024 * 1024 - 64;
+	head = NULL;
+	total = 0;
+
+	while ((p = ncx_slab_alloc(sp, size)) != NULL) {
+		*(u_char **) p = head;
+		head = p;
+		total += size;
+	}
+
+	n = stat.pages * sp->pagesize;
+
+	if (sp->carved != sp->real_pages || total < n - n / 64) {
+		ret = -1;
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		ret = -1;
+	}
+
+	while (head) {
+		p = head;
+		head = *(u_char **) p;
+		ncx_slab_free(sp, p);
+	}
+
+	ncx_slab_tcache_flush(sp);
+	ncx_slab_retain(sp, 0);
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages) {
+		ret = -1;
+	}
+
+#if (PAGE_MERGE)
+	if (stat.max_free_pages != stat.pages) {
+		ret = -1;
+	}
+#endif
+
+	if (ret != 0) {
+		printf("lazy: carved %zu/%zu, allocated %zu, free %zu/%zu pages\n",
+			   (size_t) sp->carved, (size_t) sp->real_pages, total,
+			   stat.free_page, stat.pages);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+/*
+ * 同一个桶里够用的块排在许多不够用的块后面, 更大的桶都空时,
+ * 分配仍要找到它, 而不是报告内存不足
+ */
+int test_free_scan()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	u_char 	*p, *head, *big, *runs[10];
+	size_t 	pagesize, gap;
+	int 	i, ret;
+
+	sp = ncx_slab_create(16 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ncx_slab_retain(sp, 0);
+	pagesize = sp->pagesize;
+
+	// 比 run class 大才按页分配, 用来隔开空闲块, 不会与它们共用一个run
+	gap = sp->run_size + 1;
+
+	// 31页, 10个16页, 之间各隔一段, 其余也占满, 剩下不足一段的页进不了17页的桶
+	head = NULL;
+	big = ncx_slab_alloc(sp, 31 * pagesize);
+
+	for (i = 0; i < 10; i++) {
+		p = ncx_slab_alloc(sp, gap);
+		if (p != NULL) {
+			*(u_char **) p = head;
+			head = p;
+		}
+
+		runs[i] = ncx_slab_alloc(sp, 16 * pagesize);
+	}
+
+	while ((p = ncx_slab_alloc(sp, gap)) != NULL) {
+		*(u_char **) p = head;
+		head = p;
+	}
+
+	ret = (big != NULL) ? 0 : -1;
+
+	// 先放回的31页排在桶尾
+	ncx_slab_free(sp, big);
+
+	for (i = 0; i < 10; i++) {
+		if (runs[i] == NULL) {
+			ret = -1;
+			continue;
+		}
+
+		ncx_slab_free(sp, runs[i]);
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.max_free_pages != 31) {
+		ret = -1;
+	}
+
+	p = ncx_slab_alloc(sp, 17 * pagesize);
+	if (p == NULL) {
+		ret = -1;
+	} else {
+		ncx_slab_free(sp, p);
+	}
+
+	while (head) {
+		p = head;
+		head = *(u_char **) p;
+		ncx_slab_free(sp, p);
+	}
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("free scan: max free %zu, free %zu/%zu pages\n",
+			   stat.max_free_pages, stat.free_page, stat.pages);
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+/*
+ * 批量分配/释放: 随机的大小和批量交替进行, 每个chunk写满按地址算出的字节,
+ * 释放前检查没有被覆盖; 释放的一批从存活的chunk中随机挑选, 同一页的、
+ * 不同页的、不同class的混在一起. 另外, 指向从未切出过的页的指针只报错
+ */
+#define BATCH_LIVE 	4096
+
+int test_batch()
+{
+	ncx_slab_pool_t *sp;
+	ncx_slab_stat_t stat;
+	static void *live[BATCH_LIVE];
+	static size_t lsize[BATCH_LIVE];
+	void 	*out[64];
+	size_t 	size, sizes[] = { 8, 24, 100, 500, 1500, 3000, 9000, 40000 };
+	u_char 	*p, c;
+	unsigned int r;
+	int 	i, k, n, w, nlive, round, ret;
+
+	sp = ncx_slab_create(64 * 1024 * 1024, 0, 0);
+	if (sp == NULL) {
+		return -1;
+	}
+
+	ncx_slab_retain(sp, 0);
+	ret = 0;
+
+	p = ncx_slab_alloc(sp, 24);
+	if (p == NULL || sp->carved >= sp->real_pages) {
+		ret = -1;
+
+	} else {
+		out[0] = p;
+		out[1] = ncx_slab_end(sp) - sp->pagesize;
+		out[2] = ncx_slab_end(sp) - sp->pagesize + 8;
+
+		ncx_slab_free_batch(sp, out, 3);
+		ncx_slab_tcache_flush(sp);
+
+		if (ncx_slab_stat(sp, &stat) != 0 || stat.used_size != 0) {
+			ret = -1;
+		}
+	}
+
+	r = 1;
+	nlive = 0;
+
+	for (round = 0; ret == 0 && round < 20000; round++)
+	{
+		r = r * 1103515245 + 12345;
+		w = 1 + (r >> 8) % 64;
+
+		if ((r >> 4) % 2 == 0 && nlive + w <= BATCH_LIVE) {
+			size = sizes[(r >> 16) % (sizeof(sizes) / sizeof(size_t))];
+			n = ncx_slab_alloc_batch(sp, size, w, out);
+
+			for (i = 0; i < n; i++) {
+				c = (u_char) ((uintptr_t) out[i] >> 3);
+				memset(out[i], c, size);
+
+				live[nlive] = out[i];
+				lsize[nlive] = size;
+				nlive++;
+			}
+
+			continue;
+		}
+
+		if (w > nlive) {
+			w = nlive;
+		}
+
+		for (i = 0; i < w; i++) {
+			r = r * 1103515245 + 12345;
+			k = (r >> 8) % nlive;
+
+			p = live[k];
+			c = (u_char) ((uintptr_t) p >> 3);
+
+			if (p[0] != c || p[lsize[k] - 1] != c) {
+				printf("batch: chunk %p of %zu bytes overwritten\n",
+					   (void *) p, lsize[k]);
+				ret = -1;
+			}
+
+			out[i] = p;
+			nlive--;
+			live[k] = live[nlive];
+			lsize[k] = lsize[nlive];
+		}
+
+		ncx_slab_free_batch(sp, out, w);
+
+		if (round % 1000 == 0 && ncx_slab_stat(sp, &stat) != 0) {
+			printf("batch: counters mismatch after %d rounds\n", round);
+			ret = -1;
+		}
+	}
+
+	while (nlive > 0) {
+		n = (nlive > 64) ? 64 : nlive;
+		nlive -= n;
+
+		ncx_slab_free_batch(sp, &live[nlive], n);
+	}
+
+	ncx_slab_tcache_flush(sp);
+
+	if (ncx_slab_stat(sp, &stat) != 0 || stat.free_page != stat.pages) {
+		printf("batch: free %zu/%zu pages\n", stat.free_page, stat.pages);
+		ret = -1;
+	}
+
+	ncx_slab_destroy(sp);
+
+	return ret;
+}
+
+#if (NCX_SLAB_PIC)
+/*
+ * 位置无关: 同一块共享内存映射到两个不同的地址, 在一个映射上分配的chunk
+ * 换算到另一个映射上访问和释放, 两边看到的链表和计数一致;
+ * 解除第一个映射后第二个映射仍可单独使用
+ */
+int test_pic()
+{
+	ncx_slab_pool_t *a, *b;
+	ncx_slab_stat_t stat;
+	char 	name[64];
+	size_t 	size, sizes[4] = { 24, 1000, 3000, 20000 };
+	u_char 	*p[64], *q;
+	int 	fd, i, ret;
+
+	size = 4 * 1024 * 1024;
+
+	snprintf(name, sizeof(name), "/ncx_pic_test.%d", (int) getpid());
+
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+
+	shm_unlink(name);
+
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	a = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	b = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (a == MAP_FAILED || b == MAP_FAILED) {
+		return -1;
+	}
+
+	a->addr = (u_char *) a;
+	a->min_shift = 3;
+	a->end = (u_char *) a + size;
+
+	ncx_slab_init(a);
+
+	ret = 0;
+
+	for (i = 0; i < 64; i++) {
+		p[i] = ncx_slab_alloc(a, sizes[i % 4]);
+		if (p[i] == NULL) {
+			ret = -1;
+			break;
+		}
+
+		memset(p[i], i, sizes[i % 4]);
+	}
+
+	ncx_slab_tcache_flush(a);
+
+	// 偶数个在 b 上释放, 再从 b 分配同样多的
+	for (i = 0; ret == 0 && i < 64; i += 2) {
+		q = (u_char *) b + (p[i] - (u_char *) a);
+
+		if (q[sizes[i % 4] - 1] != i) {
+			ret = -1;
+		}
+
+		ncx_slab_free(b, q);
+
+		p[i] = ncx_slab_alloc(b, sizes[i % 4]);
+		if (p[i] == NULL) {
+			ret = -1;
+			break;
+		}
+
+		memset(p[i], i, sizes[i % 4]);
+		p[i] = (u_char *) a + (p[i] - (u_char *) b);
+	}
+
+	ncx_slab_tcache_flush(b);
+
+	if (ncx_slab_stat(a, &stat) != 0 || ncx_slab_stat(b, &stat) != 0) {
+		ret = -1;
+	}
+
+	munmap(a, size);
+
+	for (i = 0; ret == 0 && i < 64; i++) {
+		q = (u_char *) b + (p[i] - (u_char *) a);
+
+		if (q[0] != i) {
+			ret = -1;
+		}
+
+		ncx_slab_free(b, q);
+	}
+
+	ncx_slab_tcache_flush(b);
+	ncx_slab_retain(b, 0);
+
+	if (ncx_slab_stat(b, &stat) != 0 || stat.free_page != stat.pages) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		printf("pic: free %zu/%zu pages\n", stat.free_page, stat.pages);
+	}
+
+	munmap(b, size);
+
+	return ret;
+}
+#endif
 
 int main(int argc, char **argv)
 {
@@ -33,7 +1641,9 @@ int main(int argc, char **argv)
 		}   
 		//ncx_slab_free(sp, p); 
 	}   
-	ncx_slab_stat(sp, &stat);
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		return -1;
+	}
 
 	printf("##########################################################################\n");
 	for (i = 0; i < 2500; i++) 
@@ -50,9 +1660,40 @@ int main(int argc, char **argv)
 			ncx_slab_free(sp, p);
 		}
 	}   
-	ncx_slab_stat(sp, &stat);
+	if (ncx_slab_stat(sp, &stat) != 0) {
+		return -1;
+	}
 
+	ncx_slab_tcache_flush(sp);
 	free(space);
 
+	if (test_many_pools() != 0 || test_pagesize() != 0
+		|| test_size_class() != 0 || test_class_stat() != 0
+		|| test_aligned() != 0 || test_cache() != 0
+		|| test_grow() != 0 || test_purge() != 0 || test_retain() != 0
+		|| test_persist() != 0 || test_lazy() != 0
+		|| test_free_scan() != 0 || test_batch() != 0)
+	{
+		return -1;
+	}
+
+#if (NCX_HAVE_SHMTX)
+	if (test_stat_shared() != 0 || test_shmtx_owner() != 0) {
+		return -1;
+	}
+#endif
+
+#if (NCX_SLAB_PIC)
+	if (test_pic() != 0) {
+		return -1;
+	}
+#endif
+
+#if (NCX_SLAB_TCACHE)
+	if (test_tcache() != 0) {
+		return -1;
+	}
+#endif
+
 	return 0;
 }
@@ -23,4 +23,65 @@ typedef intptr_t        ncx_int_t;
 #define ncx_memzero(buf, n)       (void) memset(buf, 0, n) 
 #define ncx_memset(buf, c, n)     (void) memset(buf, c, n)
 
+/*
+ * ncx_ctz: 最低位1的位置, ncx_clz: 最高位1之前0的个数(x都不能为0),
+ * ncx_popcount: 1的个数
+ * 定义 NCX_NO_BUILTIN_BITOPS 可强制使用可移植实现
+ */
+#if ((__GNUC__ >= 4 || __clang__) && !NCX_NO_BUILTIN_BITOPS)
+
+#define ncx_ctz(x)          ((ncx_uint_t) __builtin_ctzl(x))
+#define ncx_clz(x)          ((ncx_uint_t) __builtin_clzl(x))
+#define ncx_popcount(x)     ((ncx_uint_t) __builtin_popcountl(x))
+
+#else
+
+static inline ncx_uint_t
+ncx_ctz(uintptr_t x)
+{
+    ncx_uint_t  n, half;
+
+    n = 0;
+
+    for (half = sizeof(uintptr_t) * 4; half; half >>= 1) {
+        if ((x & (((uintptr_t) 1 << half) - 1)) == 0) {
+            x >>= half;
+            n += half;
+        }
+    }
+
+    return n;
+}
+
+static inline ncx_uint_t
+ncx_clz(uintptr_t x)
+{
+    ncx_uint_t  n, half;
+
+    n = 0;
+
+    for (half = sizeof(uintptr_t) * 4; half; half >>= 1) {
+        if ((x >> (sizeof(uintptr_t) * 8 - half)) == 0) {
+            x <<= half;
+            n += half;
+        }
+    }
+
+    return n;
+}
+
+static inline ncx_uint_t
+ncx_popcount(uintptr_t x)
+{
+    ncx_uint_t  n;
+
+    for (n = 0; x; n++) {
+        x &= x - 1;
+    }
+
+    return n;
+}
+
+#endif
+
 #endif
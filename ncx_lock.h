@@ -1,13 +1,56 @@
 #ifndef _NCX_LOCK_H_
 #define _NCX_LOCK_H_
 
+#include <sys/types.h>
+
+typedef volatile uint32_t   ncx_atomic_t;
+
+#define ncx_atomic_cmp_set(lock, old, set)                                    \
+    __sync_bool_compare_and_swap(lock, old, set)
+
+#define ncx_atomic_fetch_add(value, add)                                      \
+    __sync_fetch_and_add(value, add)
+
+#define ncx_memory_barrier()    __sync_synchronize()
+
+#if (__i386__ || __i386 || __amd64__ || __amd64)
+#define ncx_cpu_pause()         __asm__ ("pause")
+#else
+#define ncx_cpu_pause()
+#endif
+
+
+#if (NCX_HAVE_SHMTX)
+
+/*
+ * 多进程共享内存锁: 放在共享内存中的 ncx_slab_pool_t 里.
+ * lock 保存持有者的 pid (0 表示空闲), 先自旋退避, 再用 futex 睡眠;
+ * 持有者进程异常退出后, 等待者检测到 pid 不存在即接管该锁.
+ */
+typedef struct {
+    ncx_atomic_t    lock;   // 持有者pid
+    ncx_atomic_t    wait;   // futex 上睡眠的等待者数量
+    ncx_uint_t      spin;   // 自旋上限, (ncx_uint_t) -1 表示不自旋
+} ncx_shmtx_t;
+
+void ncx_shmtx_init(ncx_shmtx_t *mtx);
+ncx_uint_t ncx_shmtx_trylock(ncx_shmtx_t *mtx);
+void ncx_shmtx_lock(ncx_shmtx_t *mtx);
+void ncx_shmtx_unlock(ncx_shmtx_t *mtx);
+ncx_uint_t ncx_shmtx_force_unlock(ncx_shmtx_t *mtx, pid_t pid);
+
+#else
+
+#define ncx_shmtx_init(x)   { /*void*/ }
 #define ncx_shmtx_lock(x)   { /*void*/ }
 #define ncx_shmtx_unlock(x) { /*void*/ }
 
 typedef struct {
 
 	ncx_uint_t spin;
-	
+
 } ncx_shmtx_t;
 
 #endif
+
+#endif
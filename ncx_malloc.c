@@ -0,0 +1,466 @@
+#include "ncx_slab.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+/*
+ * libncx_malloc.so: 以 LD_PRELOAD 方式替换 malloc 系列函数, 所有分配走一个
+ * 进程私有的 ncx_slab 池. 环境变量:
+ *   NCX_MALLOC_SIZE      池大小, 默认1G (只占虚拟地址, 用到才分配物理页)
+ *   NCX_MALLOC_MMAP_MIN  不小于此大小的请求直接 mmap, 默认1M
+ * 池用满之后的请求也退回到 mmap.
+ */
+
+#if !(NCX_HAVE_SHMTX)
+#error "libncx_malloc needs NCX_HAVE_SHMTX for the pool lock"
+#endif
+
+#define NCX_MALLOC_SIZE         ((size_t) 1024 * 1024 * 1024)
+#define NCX_MALLOC_MMAP_MIN     ((size_t) 1024 * 1024)
+
+// 返回给调用者的最小对齐, 与 glibc 一致
+#define NCX_MALLOC_ALIGN        16
+#define NCX_MALLOC_ALIGN_SHIFT  4
+
+// 初始化池的过程中(pthread_atfork 等)需要的少量内存从这里切
+#define NCX_MALLOC_BOOTSTRAP    (64 * 1024)
+
+#define NCX_MALLOC_UNINIT       0
+#define NCX_MALLOC_INITING      1
+#define NCX_MALLOC_READY        2
+
+/* mmap 出来的块和 bootstrap 中的块, 头部放在返回地址之前 */
+typedef struct {
+    u_char                     *base;
+    size_t                      len;
+} __attribute__((aligned(NCX_MALLOC_ALIGN))) ncx_malloc_map_t;
+
+
+static ncx_slab_pool_t  *ncx_malloc_pool;
+static size_t            ncx_malloc_mmap_min = NCX_MALLOC_MMAP_MIN;
+
+static ncx_atomic_t      ncx_malloc_state;
+static pthread_t         ncx_malloc_owner;
+
+static u_char            ncx_malloc_bootstrap[NCX_MALLOC_BOOTSTRAP]
+                             __attribute__((aligned(NCX_MALLOC_ALIGN)));
+static size_t            ncx_malloc_bootstrap_used;
+
+
+static void ncx_malloc_init(void);
+static void *ncx_malloc_alloc(size_t size, size_t align);
+static void *ncx_malloc_bootstrap_alloc(size_t size);
+static void *ncx_malloc_map(size_t size, size_t align);
+static size_t ncx_malloc_size(void *p);
+static size_t ncx_malloc_env(const char *name, size_t def);
+static void ncx_malloc_prepare(void);
+static void ncx_malloc_parent(void);
+static void ncx_malloc_child(void);
+
+
+#define ncx_malloc_in_pool(p)                                                 \
+    ((u_char *) (p) >= ncx_slab_start(ncx_malloc_pool)                        \
+     && (u_char *) (p) < ncx_slab_end(ncx_malloc_pool))
+
+#define ncx_malloc_in_bootstrap(p)                                            \
+    ((u_char *) (p) >= ncx_malloc_bootstrap                                  \
+     && (u_char *) (p) < ncx_malloc_bootstrap + NCX_MALLOC_BOOTSTRAP)
+
+
+void *
+malloc(size_t size)
+{
+    return ncx_malloc_alloc(size, NCX_MALLOC_ALIGN);
+}
+
+
+void
+free(void *p)
+{
+    ncx_malloc_map_t  *m;
+
+    if (p == NULL || ncx_malloc_in_bootstrap(p)) {
+        return;
+    }
+
+    if (ncx_malloc_pool && ncx_malloc_in_pool(p)) {
+        ncx_slab_free(ncx_malloc_pool, p);
+        return;
+    }
+
+    m = (ncx_malloc_map_t *) p - 1;
+
+    munmap(m->base, m->len);
+}
+
+
+void *
+calloc(size_t n, size_t size)
+{
+    void    *p;
+    size_t   total;
+
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p = ncx_malloc_alloc(total, NCX_MALLOC_ALIGN);
+
+    // 新 mmap 的内存本来就是0
+    if (p && ((ncx_malloc_pool && ncx_malloc_in_pool(p))
+              || ncx_malloc_in_bootstrap(p)))
+    {
+        ncx_memzero(p, total);
+    }
+
+    return p;
+}
+
+
+void *
+realloc(void *p, size_t size)
+{
+    void    *n;
+    size_t   old;
+
+    if (p == NULL) {
+        return malloc(size);
+    }
+
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+
+    old = ncx_malloc_size(p);
+
+    // 原chunk放得下且缩小不到一半时原地返回
+    if (size <= old && size >= old / 2) {
+        return p;
+    }
+
+    n = malloc(size);
+    if (n == NULL) {
+        return NULL;
+    }
+
+    memcpy(n, p, size < old ? size : old);
+    free(p);
+
+    return n;
+}
+
+
+void *
+memalign(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return ncx_malloc_alloc(size, align);
+}
+
+
+int
+posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void  *p;
+
+    if (align < sizeof(void *) || (align & (align - 1))) {
+        return EINVAL;
+    }
+
+    p = ncx_malloc_alloc(size, align);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+
+    *memptr = p;
+
+    return 0;
+}
+
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+
+void *
+valloc(size_t size)
+{
+    return memalign(getpagesize(), size);
+}
+
+
+void *
+pvalloc(size_t size)
+{
+    return memalign(getpagesize(), ncx_align(size, (size_t) getpagesize()));
+}
+
+
+size_t
+malloc_usable_size(void *p)
+{
+    if (p == NULL) {
+        return 0;
+    }
+
+    return ncx_malloc_size(p);
+}
+
+
+/* align 为2的幂, 超过页大小的对齐或大块内存走 mmap */
+
+static void *
+ncx_malloc_alloc(size_t size, size_t align)
+{
+    void  *p;
+
+    if (ncx_malloc_state != NCX_MALLOC_READY) {
+
+        ncx_malloc_init();
+
+        if (ncx_malloc_state != NCX_MALLOC_READY) {
+            // 初始化池的线程自己在初始化过程中的分配
+            return ncx_malloc_bootstrap_alloc(ncx_align(size, align));
+        }
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    if (size >= ncx_malloc_mmap_min || align > ncx_malloc_pool->pagesize) {
+        return ncx_malloc_map(size, align);
+    }
+
+    p = ncx_slab_alloc_aligned(ncx_malloc_pool, size, align);
+
+    if (p == NULL) {
+        return ncx_malloc_map(size, align);
+    }
+
+    return p;
+}
+
+
+static void *
+ncx_malloc_map(size_t size, size_t align)
+{
+    size_t             len;
+    u_char            *base, *p;
+    ncx_malloc_map_t  *m;
+
+    if (align < NCX_MALLOC_ALIGN) {
+        align = NCX_MALLOC_ALIGN;
+    }
+
+    if (size > (size_t) -1 / 2 - align) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    len = ncx_align(size + align + sizeof(ncx_malloc_map_t),
+                    (size_t) getpagesize());
+
+    base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                -1, 0);
+    if (base == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p = ncx_align_ptr(base + sizeof(ncx_malloc_map_t), align);
+
+    m = (ncx_malloc_map_t *) p - 1;
+    m->base = base;
+    m->len = len;
+
+    return p;
+}
+
+
+static size_t
+ncx_malloc_size(void *p)
+{
+    ncx_malloc_map_t  *m;
+
+    if (ncx_malloc_pool && ncx_malloc_in_pool(p)) {
+        return ncx_slab_usable_size(ncx_malloc_pool, p);
+    }
+
+    m = (ncx_malloc_map_t *) p - 1;
+
+    if (ncx_malloc_in_bootstrap(p)) {
+        return m->len;
+    }
+
+    return m->base + m->len - (u_char *) p;
+}
+
+
+/* 只分配不回收, 头部记录大小供 realloc 使用 */
+
+static void *
+ncx_malloc_bootstrap_alloc(size_t size)
+{
+    ncx_malloc_map_t  *m;
+
+    size = ncx_align(size, NCX_MALLOC_ALIGN);
+
+    if (size > NCX_MALLOC_BOOTSTRAP - ncx_malloc_bootstrap_used
+               - sizeof(ncx_malloc_map_t))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    m = (ncx_malloc_map_t *)
+        (ncx_malloc_bootstrap + ncx_malloc_bootstrap_used);
+    m->base = NULL;
+    m->len = size;
+
+    ncx_malloc_bootstrap_used += sizeof(ncx_malloc_map_t) + size;
+
+    return m + 1;
+}
+
+
+/*
+ * 第一次分配时创建池. 同时到来的其他线程等待初始化完成,
+ * 初始化线程在此期间的递归分配由 bootstrap 缓冲区满足
+ */
+
+static void
+ncx_malloc_init(void)
+{
+    size_t            size;
+    u_char           *space;
+    ncx_slab_pool_t  *pool;
+
+    if (!ncx_atomic_cmp_set(&ncx_malloc_state, NCX_MALLOC_UNINIT,
+                            NCX_MALLOC_INITING))
+    {
+        if (pthread_equal(ncx_malloc_owner, pthread_self())) {
+            return;
+        }
+
+        while (ncx_malloc_state != NCX_MALLOC_READY) {
+            sched_yield();
+        }
+
+        return;
+    }
+
+    ncx_malloc_owner = pthread_self();
+
+    size = ncx_malloc_env("NCX_MALLOC_SIZE", NCX_MALLOC_SIZE);
+    ncx_malloc_mmap_min = ncx_malloc_env("NCX_MALLOC_MMAP_MIN",
+                                         NCX_MALLOC_MMAP_MIN);
+
+    space = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+    if (space != MAP_FAILED) {
+        pool = (ncx_slab_pool_t *) space;
+
+        pool->addr = space;
+        pool->min_shift = NCX_MALLOC_ALIGN_SHIFT;
+        pool->end = space + size;
+
+        ncx_slab_init(pool);
+
+        ncx_malloc_pool = pool;
+
+    } else {
+        // 没有池时所有请求都走 mmap
+        ncx_malloc_mmap_min = 0;
+    }
+
+    if (ncx_malloc_pool) {
+        pthread_atfork(ncx_malloc_prepare, ncx_malloc_parent,
+                       ncx_malloc_child);
+    }
+
+    ncx_memory_barrier();
+    ncx_malloc_state = NCX_MALLOC_READY;
+}
+
+
+/* 尽早初始化, 避免在多线程中第一次分配时才创建池 */
+
+static void __attribute__((constructor))
+ncx_malloc_constructor(void)
+{
+    if (ncx_malloc_state == NCX_MALLOC_UNINIT) {
+        ncx_malloc_init();
+    }
+}
+
+
+/*
+ * fork 时持有池锁, 保证子进程得到的池处于一致的状态;
+ * 子进程里只剩调用 fork 的线程, 重新初始化锁即可
+ */
+
+static void
+ncx_malloc_prepare(void)
+{
+    ncx_shmtx_lock(&ncx_malloc_pool->mutex);
+}
+
+
+static void
+ncx_malloc_parent(void)
+{
+    ncx_shmtx_unlock(&ncx_malloc_pool->mutex);
+}
+
+
+static void
+ncx_malloc_child(void)
+{
+    ncx_shmtx_init(&ncx_malloc_pool->mutex);
+}
+
+
+/* 十进制数, 可带 k/m/g 后缀; 不能用会分配内存的函数 */
+
+static size_t
+ncx_malloc_env(const char *name, size_t def)
+{
+    char    *s;
+    size_t   n;
+
+    s = getenv(name);
+    if (s == NULL || *s < '0' || *s > '9') {
+        return def;
+    }
+
+    for (n = 0; *s >= '0' && *s <= '9'; s++) {
+        n = n * 10 + (*s - '0');
+    }
+
+    switch (*s | 0x20) {
+    case 'g':
+        n <<= 10;
+        /* fall through */
+    case 'm':
+        n <<= 10;
+        /* fall through */
+    case 'k':
+        n <<= 10;
+    }
+
+    return n;
+}
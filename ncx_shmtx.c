@@ -0,0 +1,195 @@
+#include "ncx_core.h"
+#include "ncx_lock.h"
+#include "ncx_log.h"
+
+#if (NCX_HAVE_SHMTX)
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#if (__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <sched.h>
+#endif
+
+// futex 睡眠超时, 到时后重新检查持有者是否还活着
+#define NCX_SHMTX_WAIT_NSEC     10000000
+
+static pid_t       ncx_pid;
+static ncx_uint_t  ncx_ncpu;
+
+static void ncx_shmtx_atfork(void);
+static void ncx_shmtx_wait(ncx_shmtx_t *mtx, pid_t owner);
+static void ncx_shmtx_wakeup(ncx_shmtx_t *mtx);
+
+
+static inline pid_t
+ncx_shmtx_pid(void)
+{
+    if (ncx_pid == 0) {
+        ncx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        pthread_atfork(NULL, NULL, ncx_shmtx_atfork);
+        ncx_pid = getpid();
+    }
+
+    return ncx_pid;
+}
+
+
+static void
+ncx_shmtx_atfork(void)
+{
+    ncx_pid = getpid();
+}
+
+
+void
+ncx_shmtx_init(ncx_shmtx_t *mtx)
+{
+    mtx->lock = 0;
+    mtx->wait = 0;
+    mtx->spin = 2048;
+
+    (void) ncx_shmtx_pid();
+}
+
+
+ncx_uint_t
+ncx_shmtx_trylock(ncx_shmtx_t *mtx)
+{
+    return (mtx->lock == 0
+            && ncx_atomic_cmp_set(&mtx->lock, 0, ncx_shmtx_pid()));
+}
+
+
+void
+ncx_shmtx_lock(ncx_shmtx_t *mtx)
+{
+    pid_t       pid, owner;
+    ncx_uint_t  i, n;
+
+    pid = ncx_shmtx_pid();
+
+    for ( ;; ) {
+
+        if (mtx->lock == 0 && ncx_atomic_cmp_set(&mtx->lock, 0, pid)) {
+            return;
+        }
+
+        if (ncx_ncpu > 1) {
+
+            for (n = 1; n < mtx->spin; n <<= 1) {
+
+                for (i = 0; i < n; i++) {
+                    ncx_cpu_pause();
+                }
+
+                if (mtx->lock == 0
+                    && ncx_atomic_cmp_set(&mtx->lock, 0, pid))
+                {
+                    return;
+                }
+            }
+        }
+
+        owner = mtx->lock;
+
+        if (owner == 0) {
+            continue;
+        }
+
+        // 持有者已退出, 接管锁 (池内数据可能停留在持有者死亡时的状态)
+        if (kill(owner, 0) == -1 && errno == ESRCH) {
+
+            if (ncx_atomic_cmp_set(&mtx->lock, owner, pid)) {
+                alert("ncx_shmtx_lock(): recovered lock from dead pid %d",
+                      (int) owner);
+                return;
+            }
+
+            continue;
+        }
+
+        (void) ncx_atomic_fetch_add(&mtx->wait, 1);
+
+        ncx_shmtx_wait(mtx, owner);
+
+        (void) ncx_atomic_fetch_add(&mtx->wait, -1);
+    }
+}
+
+
+void
+ncx_shmtx_unlock(ncx_shmtx_t *mtx)
+{
+    if (ncx_atomic_cmp_set(&mtx->lock, ncx_pid, 0)) {
+
+        if (mtx->wait) {
+            ncx_shmtx_wakeup(mtx);
+        }
+    }
+}
+
+
+ncx_uint_t
+ncx_shmtx_force_unlock(ncx_shmtx_t *mtx, pid_t pid)
+{
+    if (ncx_atomic_cmp_set(&mtx->lock, pid, 0)) {
+        ncx_shmtx_wakeup(mtx);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+#if (__linux__)
+
+static void
+ncx_shmtx_wait(ncx_shmtx_t *mtx, pid_t owner)
+{
+    struct timespec  ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = NCX_SHMTX_WAIT_NSEC;
+
+    // 进程间共享, 不能使用 FUTEX_PRIVATE_FLAG
+    if (syscall(SYS_futex, &mtx->lock, FUTEX_WAIT, (uint32_t) owner,
+                &ts, NULL, 0) == -1
+        && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+    {
+        error("futex(FUTEX_WAIT) failed: %d", errno);
+    }
+}
+
+
+static void
+ncx_shmtx_wakeup(ncx_shmtx_t *mtx)
+{
+    if (syscall(SYS_futex, &mtx->lock, FUTEX_WAKE, 1, NULL, NULL, 0) == -1) {
+        error("futex(FUTEX_WAKE) failed: %d", errno);
+    }
+}
+
+#else
+
+static void
+ncx_shmtx_wait(ncx_shmtx_t *mtx, pid_t owner)
+{
+    (void) sched_yield();
+}
+
+
+static void
+ncx_shmtx_wakeup(ncx_shmtx_t *mtx)
+{
+}
+
+#endif
+
+#endif /* NCX_HAVE_SHMTX */
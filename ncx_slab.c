@@ -1,11 +1,23 @@
 #include "ncx_slab.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+// 旧的头文件没有 MADV_FREE, 用Linux上的值, 内核不支持时 madvise 失败后换用其他advice
+#ifndef MADV_FREE
+#define MADV_FREE  8
+#endif
 
-#define NCX_SLAB_PAGE_MASK   3
+#define NCX_SLAB_PAGE_MASK   7
 #define NCX_SLAB_PAGE        0
 #define NCX_SLAB_BIG         1
 #define NCX_SLAB_EXACT       2
 #define NCX_SLAB_SMALL       3
+#define NCX_SLAB_RUN         4
+#define NCX_SLAB_CACHE       5
 
 #if (NCX_PTR_SIZE == 4)
 
@@ -13,9 +25,9 @@
 #define NCX_SLAB_PAGE_BUSY   0xffffffff
 #define NCX_SLAB_PAGE_START  0x80000000
 
-#define NCX_SLAB_SHIFT_MASK  0x0000000f
-#define NCX_SLAB_MAP_MASK    0xffff0000
-#define NCX_SLAB_MAP_SHIFT   16
+#define NCX_SLAB_CLASS_MASK  0x0000007f
+#define NCX_SLAB_MAP_MASK    0xffffff80
+#define NCX_SLAB_MAP_SHIFT   7
 
 #define NCX_SLAB_BUSY        0xffffffff
 
@@ -25,14 +37,134 @@
 #define NCX_SLAB_PAGE_BUSY   0xffffffffffffffff
 #define NCX_SLAB_PAGE_START  0x8000000000000000
 
-#define NCX_SLAB_SHIFT_MASK  0x000000000000000f
-#define NCX_SLAB_MAP_MASK    0xffffffff00000000
-#define NCX_SLAB_MAP_SHIFT   32
+#define NCX_SLAB_CLASS_MASK  0x00000000000000ff
+#define NCX_SLAB_MAP_MASK    0xffffffffffffff00
+#define NCX_SLAB_MAP_SHIFT   8
 
 #define NCX_SLAB_BUSY        0xffffffffffffffff
 
 #endif
 
+/*
+ * slab 的低位保存 size class 序号, 其余高位: SMALL页为第一个可能有空闲位的
+ * 位图下标, BIG页和RUN首页为chunk占用位图. 比 exact_size 大的class一页最多
+ * 51 (32位系统为25) 个chunk, 高位放得下.
+ * RUN: 比 max_size 大的class从连续多页中切分, 首页同BIG页,
+ * 其余页 slab = NCX_SLAB_PAGE_BUSY, next 指向首页
+ */
+
+// magic 的精度要求 页内偏移 * magic 不超过64位
+#define NCX_SLAB_MAX_PAGESIZE  ((size_t) 1 << 22)
+
+#define NCX_SLAB_RUN_PAGES   16  // 一个run最多的页数
+#define NCX_SLAB_RUN_CHUNKS  4   // 一个run至少切出的chunk数(页数允许时)
+
+#define NCX_SLAB_CACHE_OBJS  8   // 对象缓存的一个slab至少放下的对象数(页数允许时)
+#define NCX_SLAB_CACHE_EMPTY 1   // 对象缓存保留的全空slab数
+#define NCX_SLAB_RETAIN      2   // 每个class默认保留的空slab数, 见 ncx_slab_retain()
+#define NCX_SLAB_CARVE_PAGES 256 // 一次至少初始化的页描述符数, 见 ncx_slab_carve()
+
+// 页内(run内)偏移换算成chunk序号
+#define ncx_slab_chunk(cls, off)                                              \
+    ((ncx_uint_t) (((uint64_t) (off) * (cls)->magic) >> (cls)->shift))
+
+// SMALL页位图占用的uintptr_t个数
+#define ncx_slab_map(cls)                                                     \
+    (((cls)->chunks + sizeof(uintptr_t) * 8 - 1) / (sizeof(uintptr_t) * 8))
+
+
+// 空闲块按长度分桶后, 在桶内寻找最合适块时最多检查的个数
+#define NCX_SLAB_FREE_SCAN   8
+
+#define ncx_slab_free_index(pages)                                            \
+    (sizeof(uintptr_t) * 8 - 1 - ncx_clz(pages))
+
+/*
+ * 空闲块的首页: slab = 页数, next/prev 挂在 pool->free[] 上;
+ * 空闲块的尾页(页数 > 1 时): slab = 0, next 指向首页, prev = NCX_SLAB_PAGE;
+ * 中间页全部为0. 已分配的页 next 为 NULL 或 prev 带有 slab 类型,
+ * 所以相邻页只看首/尾页即可在 O(1) 内判断是否空闲
+ */
+#define ncx_slab_page_is_free(page)                                           \
+    (((page)->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_PAGE                    \
+     && (page)->next != NULL)
+
+/*
+ * 开启回收(ncx_slab_purge_decay)后, 空闲块中间页的 prev 高位记录变为空闲的时间(ms),
+ * NCX_SLAB_PAGE_PURGED 表示该页已 madvise 还给系统; slab/next 仍为0, 不影响上面的判断.
+ * 只回收中间页: 首尾页的描述符有别的用途, 块被切分时切下的部分从首页开始
+ */
+#define NCX_SLAB_PAGE_PURGED  0x08
+#define NCX_SLAB_IDLE_SHIFT   4
+
+#define NCX_SLAB_PURGE_PAGES  4   // 只回收至少这么多页的空闲块
+#define NCX_SLAB_PURGE_STEPS  4   // 释放页时最多每 decay/4 毫秒检查一次
+#define NCX_SLAB_PURGE_WORK   8192 // 每次回收最多检查的页描述符数, 至少检查一个空闲块
+
+#define ncx_slab_page_idle(page, now)                                         \
+    ((((uintptr_t) (now) << NCX_SLAB_IDLE_SHIFT)                              \
+      - ((page)->prev & ~(((uintptr_t) 1 << NCX_SLAB_IDLE_SHIFT) - 1)))       \
+     >> NCX_SLAB_IDLE_SHIFT)
+
+#define ncx_slab_page_time(page)  ((page)->prev >> NCX_SLAB_IDLE_SHIFT)
+
+/*
+ * 多页空闲块的尾页 prev 高位是块内最早变为空闲的未回收中间页的时间(不晚于它即可),
+ * 中间页全部已回收时只有 NCX_SLAB_PAGE_PURGED 标记; 回收时据此整块跳过.
+ * 首页的 next/prev 是空闲链表, 所以放在尾页上
+ */
+#define ncx_slab_run_since(tail, t)                                           \
+    (((tail)->prev & NCX_SLAB_PAGE_PURGED) || ncx_slab_page_time(tail) > (t)  \
+     ? (t) : ncx_slab_page_time(tail))
+
+/*
+ * 池内地址的读写, 见 ncx_slab.h 中的 NCX_SLAB_PIC.
+ * 原样复制 next/prev 不需要转换; prev 的低位是页类型
+ */
+#define ncx_slab_pages(pool)                                                  \
+    ((ncx_slab_page_t *) ncx_slab_base(pool, (pool)->pages))
+#define ncx_slab_classes(pool)                                                \
+    ((ncx_slab_class_t *) ncx_slab_base(pool, (pool)->classes))
+#define ncx_slab_next(pool, page)                                             \
+    ((ncx_slab_page_t *) ncx_slab_addr(pool, (page)->next))
+#define ncx_slab_prev(pool, page)                                             \
+    ((ncx_slab_page_t *)                                                      \
+     ncx_slab_addr(pool, (page)->prev & ~NCX_SLAB_PAGE_MASK))
+#define ncx_slab_link(pool, page, type)                                       \
+    ((uintptr_t) ncx_slab_off(pool, page) | (type))
+// 页描述符与其数据页首地址互相换算
+#define ncx_slab_page_addr(pool, page)                                        \
+    (ncx_slab_start(pool)                                                     \
+     + (((page) - ncx_slab_pages(pool)) << (pool)->pagesize_shift))
+#define ncx_slab_addr_page(pool, p)                                           \
+    (&ncx_slab_pages(pool)[((u_char *) (p) - ncx_slab_start(pool))          \
+                           >> (pool)->pagesize_shift])
+
+/*
+ * 文件池的格式版本: 低7位为版本号, 之后是 NCX_SLAB_PIC 以及池和class结构的大小
+ * (随 NCX_PTR_SIZE, NCX_SLAB_STATS 等变化), 任何一项不同的文件都不能直接挂载
+ */
+#define NCX_SLAB_VERSION     1
+
+#if (NCX_SLAB_PIC)
+#define NCX_SLAB_VERSION_PIC  1
+#else
+#define NCX_SLAB_VERSION_PIC  0
+#endif
+
+#define ncx_slab_version()                                                    \
+    ((uint32_t) (NCX_SLAB_VERSION | NCX_SLAB_VERSION_PIC << 7                 \
+                 | sizeof(ncx_slab_pool_t) << 8                               \
+                 | sizeof(ncx_slab_class_t) << 20))
+
+#if (NCX_SLAB_PIC)
+// cache 在池内, cache->pool 记录cache到池头的距离
+#define ncx_slab_cache_pool(cache)                                            \
+    ((ncx_slab_pool_t *) ((u_char *) (cache) - (uintptr_t) (cache)->pool))
+#else
+#define ncx_slab_cache_pool(cache)  ((cache)->pool)
+#endif
+
 
 #if (NCX_DEBUG_MALLOC)
 
@@ -49,93 +181,321 @@ static ncx_slab_page_t *ncx_slab_alloc_pages(ncx_slab_pool_t *pool,
     ncx_uint_t pages);
 static void ncx_slab_free_pages(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
     ncx_uint_t pages);
-static bool ncx_slab_empty(ncx_slab_pool_t *pool, ncx_slab_page_t *page);
-
-static ncx_uint_t  ncx_slab_max_size;//2048    slab的一次最大分配空间，默认为pagesize/2
-/*对于64位与32位系统，nginx里面默认的值是不一样的，我们看到数字可能会更好理解一点，所以我们就以32位来看，用实际的数字来说话！
-这个时依赖slab的分配算法.它的值是这样来的.4096/32，2048是slab页大小，而32是一个int的位数，最后的值是128。
-why? 我们在分配时,在一页中，我们可以将这一页分成多个块,而某个块需要标记是否被分配,而一页空间正好被分成32个128字节大小的块，于是我们可以用一个int的32位表示这块的使用情况，
-而此时,我们是使用ngx_slab_page_s结构体中的slab成员来表示块的使用情况的。另外，在分配大于128与小于128时，表示块的占用情况有所有同
-*/
-static ncx_uint_t  ncx_slab_exact_size;//64     slab精确分配大小，这个是一个分界点，通常是4096/32，为什么会这样，我们后面会有介绍
-static ncx_uint_t  ncx_slab_exact_shift;//6     slab精确分配大小对应的移位数
-static ncx_uint_t  ncx_pagesize; //4K        // 页大小
-static ncx_uint_t  ncx_pagesize_shift;//12  // 页大小对应的移位数
-static ncx_uint_t  ncx_real_pages;  // 对齐后，在计算page的个数
+static ncx_uint_t ncx_slab_slot(ncx_slab_pool_t *pool, size_t size);
+static void ncx_slab_free_insert(ncx_slab_pool_t *pool, ncx_slab_page_t *page);
+static ncx_uint_t ncx_slab_carve(ncx_slab_pool_t *pool, ncx_uint_t pages);
+static ncx_uint_t ncx_slab_top_pages(ncx_slab_pool_t *pool);
+static void ncx_slab_free_remove(ncx_slab_pool_t *pool, ncx_slab_page_t *page);
+static void ncx_slab_geometry(ncx_slab_pool_t *pool, size_t pagesize);
+static void ncx_slab_stat_counters(ncx_slab_pool_t *pool,
+    ncx_slab_stat_t *stat);
+static size_t ncx_slab_class_size(ncx_slab_pool_t *pool, ncx_uint_t slot);
+static ncx_uint_t ncx_slab_run_pages(ncx_slab_pool_t *pool, size_t size);
+static void *ncx_slab_alloc_obj(ncx_slab_pool_t *pool, size_t size);
+static uintptr_t ncx_slab_alloc_large(ncx_slab_pool_t *pool, size_t size);
+static ncx_uint_t ncx_slab_alloc_objs(ncx_slab_pool_t *pool, size_t size,
+    ncx_uint_t n, void **out);
+static void ncx_slab_account(ncx_slab_pool_t *pool, size_t size,
+    ncx_uint_t n);
+static bool ncx_slab_small_empty(uintptr_t *bitmap, ncx_slab_class_t *cls);
+static ncx_uint_t ncx_slab_alloc_chunks(ncx_slab_pool_t *pool,
+    ncx_slab_page_t *page, ncx_uint_t slot, ncx_uint_t n, void **out);
+static void ncx_slab_free_chunks(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    void **ptrs, ncx_uint_t n);
+static void ncx_slab_init_pool(ncx_slab_pool_t *pool, size_t pagesize,
+    size_t align);
+static bool ncx_slab_thp_enabled(ncx_uint_t flags);
+static void ncx_slab_count_fail(ncx_slab_pool_t *pool, size_t size);
+static ncx_slab_pool_t *ncx_slab_create_pool(size_t size, size_t pagesize,
+    ncx_uint_t flags, size_t min_shift);
+static ncx_uint_t ncx_slab_arena_alloc(ncx_slab_pool_t *pool, size_t size,
+    ncx_uint_t n, void **out);
+static ncx_slab_pool_t *ncx_slab_arena_grow(ncx_slab_pool_t *pool,
+    size_t size);
+static ncx_slab_pool_t *ncx_slab_arena_find(ncx_slab_pool_t *pool, void *p);
+static void ncx_slab_stat_walk(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat);
+static void ncx_slab_stat_add(ncx_slab_stat_t *stat, ncx_slab_stat_t *s);
+static void ncx_slab_stat_class(ncx_slab_pool_t *pool,
+    ncx_slab_class_stat_t *cs, ncx_uint_t n);
+static void ncx_slab_idle_pages(ncx_slab_page_t *page, ncx_uint_t n,
+    ncx_uint_t now);
+static void ncx_slab_purge_locked(ncx_slab_pool_t *pool, ncx_uint_t now);
+static void ncx_slab_purge_pages(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t n);
+static ncx_uint_t ncx_slab_msec(void);
+static void ncx_slab_free_slab(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_slab_class_t *cls);
+static ncx_uint_t ncx_slab_release_retained(ncx_slab_pool_t *pool,
+    ncx_slab_class_t *cls, ncx_uint_t keep);
+static void ncx_slab_cache_free_chunk(ncx_slab_cache_t *cache,
+    ncx_slab_page_t *page, void *p);
+static ncx_slab_page_t *ncx_slab_cache_grow(ncx_slab_cache_t *cache);
+static ncx_uint_t ncx_slab_cache_layout(ncx_slab_pool_t *pool,
+    ncx_uint_t pages, size_t size, size_t align, ncx_uint_t *offset);
+static ncx_slab_pool_t *ncx_slab_file_create(int fd, size_t size,
+    size_t pagesize);
+static ncx_slab_pool_t *ncx_slab_file_attach(int fd, size_t len, size_t size,
+    size_t pagesize);
+static void ncx_slab_repair(ncx_slab_pool_t *pool);
+static bool ncx_slab_repair_page(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t *pages);
+static void ncx_slab_repair_free(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t now);
+
+
+
+#if (NCX_SLAB_TCACHE)
+
+#include <pthread.h>
+
+#define NCX_SLAB_TCACHE_SLOTS   32  // 缓存的slot数, 更大的slot直接走池
+#define NCX_SLAB_TCACHE_SIZE    32  // 每个slot最多缓存的chunk数
+#define NCX_SLAB_TCACHE_BATCH   16  // 一次加锁补充/归还的chunk数
+#define NCX_SLAB_TCACHE_POOLS   4   // 每个线程同时缓存的池数
+#define NCX_SLAB_TCACHE_MISSES  64  // 表满时连续这么多次未命中才替换一项
+
+typedef struct {
+    ncx_uint_t              count;
+    void                   *chunk[NCX_SLAB_TCACHE_SIZE];
+} ncx_slab_tcache_bin_t;
+
+typedef struct {
+    ncx_slab_pool_t        *pool;       // 绑定的池, NULL表示空闲
+    ncx_atomic_t            stale;      // 池已在别的线程中销毁或重新初始化, 不能再访问
+    size_t                  size;       // 缓存中的字节数
+    size_t                  published;  // 已计入 pool->tcache_size 的字节数
+    size_t                  requested;  // 尚未计入 pool->requested 的字节数
+    size_t                  consumed;   // 尚未计入 pool->consumed 的字节数
+    ncx_slab_tcache_bin_t   bins[NCX_SLAB_TCACHE_SLOTS];
+} ncx_slab_tcache_t;
+
+/*
+ * 每个线程按池各有一份缓存, 交替使用几个池时不必每次都整体归还.
+ * 各线程的表串在 ncx_slab_tcache_tables 上, 池被销毁或重新初始化时
+ * 据此把所有线程中该池的缓存标记作废
+ */
+typedef struct ncx_slab_tcache_table_s  ncx_slab_tcache_table_t;
+
+struct ncx_slab_tcache_table_s {
+    ncx_uint_t              last;       // 上次用到的项
+    ncx_uint_t              victim;     // 表满时下一个被替换的项
+    ncx_uint_t              misses;     // 表满后连续未命中的次数
+    ncx_uint_t              registered; // 已挂在 ncx_slab_tcache_tables 上
+    ncx_slab_tcache_table_t *next;
+    ncx_slab_tcache_t       caches[NCX_SLAB_TCACHE_POOLS];
+};
+
+static __thread ncx_slab_tcache_table_t  ncx_slab_tcaches;
+static ncx_slab_tcache_table_t          *ncx_slab_tcache_tables;
+static pthread_mutex_t                   ncx_slab_tcache_mutex =
+                                             PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t                     ncx_slab_tcache_key;
+static pthread_once_t                    ncx_slab_tcache_once = PTHREAD_ONCE_INIT;
+
+static void *ncx_slab_tcache_alloc(ncx_slab_tcache_t *t, ncx_slab_pool_t *pool,
+    ncx_uint_t slot, size_t request);
+static ncx_uint_t ncx_slab_tcache_free(ncx_slab_pool_t *pool, void *p);
+static ncx_slab_tcache_t *ncx_slab_tcache_find(ncx_slab_pool_t *pool);
+static ncx_slab_tcache_t *ncx_slab_tcache_get(ncx_slab_pool_t *pool);
+static void ncx_slab_tcache_drop(ncx_slab_pool_t *pool);
+static void ncx_slab_tcache_flush_bin(ncx_slab_tcache_t *t, ncx_uint_t slot,
+    ncx_uint_t n);
+
+#endif
+
+/* 维护 cls->used, 定义 NCX_SLAB_STATS 时同时累计分配/释放次数 */
+
+static inline void
+ncx_slab_count_alloc(ncx_slab_class_t *cls, ncx_uint_t n)
+{
+    cls->used += n;
+
+#if (NCX_SLAB_STATS)
+    cls->counters.allocs += n;
+
+    if (cls->used > cls->counters.peak) {
+        cls->counters.peak = cls->used;
+    }
+#endif
+}
+
+
+static inline void
+ncx_slab_count_free(ncx_slab_class_t *cls, ncx_uint_t n)
+{
+    cls->used -= n;
+
+#if (NCX_SLAB_STATS)
+    cls->counters.frees += n;
+#endif
+}
+
 
 void
 ncx_slab_init(ncx_slab_pool_t *pool)
 {
-    u_char           *p;
-    size_t            size;
-    ncx_uint_t        i, n, pages;
-    ncx_slab_page_t  *slots;
+    ncx_slab_init_pagesize(pool, 0);
+}
 
-	/*pagesize*/
-	ncx_pagesize = getpagesize();//4K
-	for (n = ncx_pagesize, ncx_pagesize_shift = 0; 
-			n >>= 1; ncx_pagesize_shift++) { /* void */ }
 
-    /* STUB */
-    if (ncx_slab_max_size == 0) {
-        // 最大分配空间为页大小的一半
-        ncx_slab_max_size = ncx_pagesize / 2;//2K
-        // 精确分配大小，8为一个字节的位数，sizeof(uintptr_t)为一个uintptr_t的字节，我们后面会根据这个size来判断使用不同的分配算法 
-        ncx_slab_exact_size = ncx_pagesize / (8 * sizeof(uintptr_t));//64  uintptr_t 类型的位图变量表示的页划分
-        // 计算出此精确分配的移位数
-        for (n = ncx_slab_exact_size; n >>= 1; ncx_slab_exact_shift++) {
-            /* void */
-        }
+void
+ncx_slab_init_pagesize(ncx_slab_pool_t *pool, size_t pagesize)
+{
+    ncx_slab_init_pool(pool, pagesize, 0);
+}
+
+
+/* align: pool->start 额外的对齐要求, 如大页边界 */
+
+static void
+ncx_slab_init_pool(ncx_slab_pool_t *pool, size_t pagesize, size_t align)
+{
+    u_char            *p, *start, *end;
+    size_t             size;
+    ncx_uint_t         i, n, pages;
+    ncx_slab_page_t   *slots;
+    ncx_slab_class_t  *cls;
+
+    // 调用者设置的 pool->end 是地址, NCX_SLAB_PIC 时此后保存偏移
+    end = pool->end;
+    pool->end = ncx_slab_off(pool, end);
+
+    ncx_slab_geometry(pool, pagesize);
+
+    if (align < pool->pagesize) {
+        align = pool->pagesize;
     }
 
+    pool->backing = NCX_SLAB_BACKING_NONE;
+
     pool->min_size = 1 << pool->min_shift;//8byte
 
+    ncx_shmtx_init(&pool->mutex);
+
+    pool->tcache_size = 0;
+    pool->requested = 0;
+    pool->consumed = 0;
+
+    pool->grow_size = 0;
+    pool->grow_limit = 0;
+    pool->grow_flags = 0;
+    pool->narenas = 0;
+
+    pool->purge_decay = 0;
+    pool->purge_advice = 0;
+    pool->purge_last = 0;
+    pool->purged_pages = 0;
+
+    pool->retain = NCX_SLAB_RETAIN;
+
+    pool->magic = 0;
+    pool->version = 0;
+    pool->state = 0;
+    pool->fd = -1;
+    pool->root = NULL;
+
+#if (NCX_SLAB_TCACHE)
+    // 同一地址上重新初始化的池, 丢弃本线程缓存的旧chunk
+    ncx_slab_tcache_drop(pool);
+#endif
+
     // p 指向slot数组
     p = (u_char *) pool + sizeof(ncx_slab_pool_t);//sizeof:80
 
     // 某一个大小范围内的页，放到一起，具有相同的移位数
     slots = (ncx_slab_page_t *) p;//sizeof(page):24
 
-    // 最大移位数，减去最小移位数，得到需要的slot数量  
-    // 默认为8
-    n = ncx_pagesize_shift - pool->min_shift;
+    // 每个size class一个slot, 4K页时为28个
+    n = pool->nclasses;
     // 初始化各个slot
-    for (i = 0; i < n; i++) {//9([0~8])
+    for (i = 0; i < n; i++) {
         slots[i].slab = 0;
-        slots[i].next = &slots[i];
+        slots[i].next = ncx_slab_off(pool, &slots[i]);
         slots[i].prev = 0;
     }
 
-    // 指向页数组
     p += n * sizeof(ncx_slab_page_t);
 
-    size = pool->end - p;//pages[] + cache
+    // slot数组之后是size class表
+    pool->classes = ncx_slab_off(pool, p);
 
-    // 将开始的size个字节设置为0
-    ncx_slab_junk(p, size);
+    for (i = 0; i < n; i++) {
+        cls = &ncx_slab_classes(pool)[i];
+
+        cls->size = ncx_slab_class_size(pool, i);
+        cls->pages = 1;
+
+        // 偏移最大 pages * pagesize, magic 的精度要保证 偏移 * size 以内都准确
+        cls->shift = 2 * pool->pagesize_shift;
+
+        if (cls->size > pool->max_size) {
+            cls->pages = ncx_slab_run_pages(pool, cls->size);
+            cls->shift += 8;
+        }
+
+        cls->chunks = (cls->pages << pool->pagesize_shift) / cls->size;
+        cls->magic = (((uint64_t) 1 << cls->shift) + cls->size - 1)
+                     / cls->size;
+        cls->reserved = 0;
+        cls->used = 0;
+        cls->slabs = 0;
+        cls->empty = NULL;
+        cls->retained = 0;
+#if (NCX_SLAB_STATS)
+        ncx_memzero(&cls->counters, sizeof(ncx_slab_counters_t));
+#endif
+
+        if (cls->size < pool->exact_size) {
+            cls->reserved = (ncx_slab_map(cls) * sizeof(uintptr_t)
+                             + cls->size - 1) / cls->size;
+        }
+    }
+
+    // 指向页数组, 页描述符要8字节对齐
+    p = ncx_align_ptr(p + n * sizeof(ncx_slab_class_t),
+                      sizeof(uint64_t));
+
+    size = end - p;//pages[] + cache
 
     // 计算出当前内存空间可以放下多少个页，此时的计算没有进行对齐，在后面会进行调整
-    pages = (ncx_uint_t) (size / (ncx_pagesize + sizeof(ncx_slab_page_t)));
+    pages = (ncx_uint_t) (size / (pool->pagesize + sizeof(ncx_slab_page_t)));
 
-    ncx_memzero(p, pages * sizeof(ncx_slab_page_t));
+    // 页描述符和数据页都不在这里初始化, 用到时由 ncx_slab_carve() 处理
+    pool->pages = ncx_slab_off(pool, p);
 
-    pool->pages = (ncx_slab_page_t *) p;
+    for (i = 0; i < NCX_SLAB_FREE_LISTS; i++) {
+        pool->free[i].slab = 0;
+        pool->free[i].next = ncx_slab_off(pool, &pool->free[i]);
+        pool->free[i].prev = 0;
+    }
 
-    pool->free.prev = 0;
-    pool->free.next = (ncx_slab_page_t *) p;//可用的page
-    //page数据第一个元素
-    pool->pages->slab = pages;//994
-    pool->pages->next = &pool->free;
-    pool->pages->prev = (uintptr_t) &pool->free;
+    pool->free_map = 0;
+    pool->free_pages = 0;
+    pool->large_pages = 0;
+    pool->cache_pages = 0;
+    pool->cache_used = 0;
+#if (NCX_SLAB_STATS)
+    ncx_memzero(&pool->large_counters, sizeof(ncx_slab_counters_t));
+#endif
 
     // 计算出对齐后的返回内存的地址
-    pool->start = (u_char *)
-                  ncx_align_ptr((uintptr_t) p + pages * sizeof(ncx_slab_page_t),
-                                 ncx_pagesize);
+    start = (u_char *)
+            ncx_align_ptr((uintptr_t) p + pages * sizeof(ncx_slab_page_t),
+                          align);
+
+    pool->start = ncx_slab_off(pool, start);
 
     // 说明之前是没有对齐过的，由于对齐之后，最后那一页，有可能不够一页，所以要去掉那一块
-	ncx_real_pages = (pool->end - pool->start) / ncx_pagesize;//994 地址对齐后还是994：可能会少一
-	pool->pages->slab = ncx_real_pages;
+	pool->real_pages = end > start
+	                   ? (end - start) / pool->pagesize : 0;//994 地址对齐后还是994：可能会少一
+	if (pool->real_pages == 0) {
+		error("ncx_slab_init(): pool is smaller than one page");
+		return;
+	}
+
+	// 全部页都还没切出, 空闲链表为空, 但都计入空闲页
+	pool->carved = 0;
+	pool->free_pages = pool->real_pages;
 }
 
 
@@ -144,6 +504,23 @@ ncx_slab_alloc(ncx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+#if (NCX_SLAB_TCACHE)
+    ncx_uint_t          slot;
+    ncx_slab_tcache_t  *t;
+
+    if (size < pool->max_size) {
+        slot = ncx_slab_slot(pool, size);
+
+        if (slot < NCX_SLAB_TCACHE_SLOTS) {
+            t = ncx_slab_tcache_get(pool);
+
+            if (t) {
+                return ncx_slab_tcache_alloc(t, pool, slot, size);
+            }
+        }
+    }
+#endif
+
     ncx_shmtx_lock(&pool->mutex);
 
     p = ncx_slab_alloc_locked(pool, size);
@@ -157,126 +534,169 @@ ncx_slab_alloc(ncx_slab_pool_t *pool, size_t size)
 void *
 ncx_slab_alloc_locked(ncx_slab_pool_t *pool, size_t size)
 {
-    size_t            s;
-    uintptr_t         p, n, m, mask, *bitmap;
-    ncx_uint_t        i, slot, shift, map;
-    ncx_slab_page_t  *page, *prev, *slots;
+    void  *p;
 
-    // 如果超出slab最大可分配大小，即大于2048，则我们需要计算出需要的page数，  
-    // 然后从空闲页中分配出连续的几个可用页
-    if (size >= ncx_slab_max_size) {
+    p = ncx_slab_alloc_obj(pool, size);
+
+    if (p == NULL && pool->grow_size) {
+        ncx_slab_arena_alloc(pool, size, 1, &p);
+    }
 
-		debug("slab alloc: %zu", size);
+    if (p == NULL) {
+        ncx_slab_count_fail(pool, size);
+        return NULL;
+    }
 
-        // 计算需要的页数，然后分配指针页数
-        page = ncx_slab_alloc_pages(pool, (size >> ncx_pagesize_shift)
-                                          + ((size % ncx_pagesize) ? 1 : 0));
-        if (page) {
-            // 由返回page在页数组中的偏移量，计算出实际数组地址的偏移量
-            p = (page - pool->pages) << ncx_pagesize_shift;
-            // 计算出实际的数据地址
-            p += (uintptr_t) pool->start;
+    ncx_slab_account(pool, size, 1);
 
-        } else {
-            p = 0;
+    return p;
+}
+
+
+/*
+ * align 为2的幂且不超过页大小. chunk 从页首(run首)起按 size class 等距排列,
+ * class 大小是 align 的倍数时chunk就是对齐的, 所以把 size 放大到满足条件的
+ * 最小class; 没有这样的class时按页分配, 页首天然对齐
+ */
+
+void *
+ncx_slab_alloc_aligned(ncx_slab_pool_t *pool, size_t size, size_t align)
+{
+    ncx_uint_t  slot;
+
+    if (align & (align - 1) || align > pool->pagesize) {
+        error("ncx_slab_alloc_aligned(): invalid alignment %zu", align);
+        return NULL;
+    }
+
+    if (align <= pool->min_size) {
+        return ncx_slab_alloc(pool, size);
+    }
+
+    size = ncx_align(size, align);
+
+    if (size <= pool->run_size) {
+
+        for (slot = ncx_slab_slot(pool, size); slot < pool->nclasses; slot++) {
+            if (ncx_slab_classes(pool)[slot].size % align == 0) {
+                break;
+            }
         }
 
-        goto done;
+        size = (slot < pool->nclasses) ? ncx_slab_classes(pool)[slot].size
+                                       : pool->run_size + 1;
     }
 
-    // 如果小于2048，则启用slab分配算法进行分配
+    return ncx_slab_alloc(pool, size);
+}
 
-     // 计算出此size的移位数以及此size对应的slot以及移位数
-    if (size > pool->min_size) {
-        shift = 1;
-        // 计算移位数
-        for (s = size - 1; s >>= 1; shift++) { /* void */ }
-        // 由移位数得到slot
-        slot = shift - pool->min_shift;
 
-    } else {
-         // 小于最小可分配大小的都放到一个slot里面
-        size = pool->min_size;
-        shift = pool->min_shift;
-        // 因为小于最小分配的，所以就放在第一个slot里面 
-        slot = 0;
+static void *
+ncx_slab_alloc_obj(ncx_slab_pool_t *pool, size_t size)
+{
+    size_t             s;
+    uintptr_t          p, n, mask, *bitmap;
+    ncx_uint_t         i, slot, map, type;
+    ncx_slab_page_t   *page, *prev, *slots;
+    ncx_slab_class_t  *cls;
+
+    // 如果超出最大的run class，则我们需要计算出需要的page数，  
+    // 然后从空闲页中分配出连续的几个可用页
+    if (size > pool->run_size) {
+        p = ncx_slab_alloc_large(pool, size);
+        cls = NULL;
+        goto done;
     }
 
+    // 否则启用slab分配算法进行分配, 大于max_size的class从多页的run中切分
+
+    // 计算出此size对应的slot, 即size class, 按class的chunk大小分配
+    slot = ncx_slab_slot(pool, size);
+    cls = &ncx_slab_classes(pool)[slot];
+    s = cls->size;
+
     slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
     // 得到当前slot所占用的页
-    page = slots[slot].next;
+    page = ncx_slab_next(pool, &slots[slot]);
+
+    // 没有未满的页时先启用保留的空slab, 不必向页分配器申请
+    if (page == &slots[slot] && cls->empty) {
+        page = ncx_slab_addr(pool, cls->empty);
+        cls->empty = page->next;
+        cls->retained--;
+
+        page->next = ncx_slab_off(pool, &slots[slot]);
+        page->prev = ncx_slab_link(pool, &slots[slot], page->prev);
+
+        slots[slot].next = ncx_slab_off(pool, page);
+    }
 
     // 找到一个可用空间
-    if (page->next != page) {
+    if (page != &slots[slot]) {
         // 分配大小小于128字节时的算法，看不懂的童鞋可以先看等于128字节的情况  
         // 当分配空间小于128字节时，我们不可能用一个int来表示这些块的占用情况  
         // 此时，我们就需要几个int了，即一个bitmap数组  
         // 我们此时没有使用page->slab，而是使用页数据空间的开始几个int空间来表示了  
         // 看代码 
-        if (shift < ncx_slab_exact_shift) {//小于精确分配
+        if (s < pool->exact_size) {//小于精确分配
 
             do {
                 // 得到页数据部分
-                p = (page - pool->pages) << ncx_pagesize_shift;
+                p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
 
                 // 页的开始几个int大小的空间来存放位图数据
-                bitmap = (uintptr_t *) (pool->start + p);
+                bitmap = (uintptr_t *) (ncx_slab_start(pool) + p);
                 
-                //32=》2位 16=》4位  8=》8位
-                // 当前页，在当前size下可分成map*32个块  
-                // 我们需要map个int来表示这些块空间
-                map = (1 << (ncx_pagesize_shift - shift))
-                          / (sizeof(uintptr_t) * 8);//128/8*8=2  计算需要几个uintptr_t类型位图
+                // 当前页在当前class下可分成chunks个块, 需要map个uintptr_t来表示
+                map = ncx_slab_map(cls);
 
-                for (n = 0; n < map; n++) {
+                // slab高位保存第一个可能有空闲位的bitmap下标, 之前的bitmap都已占满
+                for (n = page->slab >> NCX_SLAB_MAP_SHIFT; n < map; n++) {
 
                     if (bitmap[n] != NCX_SLAB_BUSY) {
 
-                        for (m = 1, i = 0; m; m <<= 1, i++) {
-                            if ((bitmap[n] & m)) {
-                                // 当前位表示的块已被使用了
-                                continue;
-                            }
+                        // 最低的0位即第一个空闲块
+                        i = ncx_ctz(~bitmap[n]);
 
-                            // 设置已占用
-                            bitmap[n] |= m;
+                        // 设置已占用
+                        bitmap[n] |= (uintptr_t) 1 << i;
 
-                            i = ((n * sizeof(uintptr_t) * 8) << shift)
-                                + (i << shift);
+                        i = ((n * sizeof(uintptr_t) * 8) + i) * s;
 
-                            // 如果当前bitmap所表示的空间已都被占用，就查找下一个bitmap
-                            if (bitmap[n] == NCX_SLAB_BUSY) {
-                                for (n = n + 1; n < map; n++) {
-                                    // 找到下一个还剩下空间的bitmap
-                                     if (bitmap[n] != NCX_SLAB_BUSY) {
-                                         p = (uintptr_t) bitmap + i;
+                        p = (uintptr_t) bitmap + i;
 
-                                         goto done;
-                                     }
+                        // 如果当前bitmap所表示的空间已都被占用，就查找下一个bitmap
+                        if (bitmap[n] == NCX_SLAB_BUSY) {
+                            for (n = n + 1; n < map; n++) {
+                                // 找到下一个还剩下空间的bitmap
+                                if (bitmap[n] != NCX_SLAB_BUSY) {
+                                    break;
                                 }
+                            }
+
+                            if (n == map) {
                                 // 剩下所有的bitmap都被占用了，表明当前的页已完全被使用了，把当前页从链表中删除 
-                                prev = (ncx_slab_page_t *)
-                                            (page->prev & ~NCX_SLAB_PAGE_MASK);
+                                prev = ncx_slab_prev(pool, page);
                                 prev->next = page->next;
-                                page->next->prev = page->prev;
+                                ncx_slab_next(pool, page)->prev = page->prev;
 
                                 page->next = NULL;
                                 // 小内存分配 
                                 page->prev = NCX_SLAB_SMALL;
                             }
+                        }
 
-                            p = (uintptr_t) bitmap + i;
+                        page->slab = ((uintptr_t) n << NCX_SLAB_MAP_SHIFT) | slot;
 
-                            goto done;
-                        }
+                        goto done;
                     }
                 }
 
-                page = page->next;
+                page = ncx_slab_next(pool, page);
 
             } while (page);
 
-        } else if (shift == ncx_slab_exact_shift) {//精确分配
+        } else if (s == pool->exact_size) {//精确分配
                 // 如果分配大小正好是128字节，则一页可以分成32个块，我们可以用一个int来表示这些个块的使用情况  
             // 这里我们使用page->slab来表示这些块的使用情况，当所有块被占用后，该值就变成了0xffffffff，即NGX_SLAB_BUSY  
             // 表示该块都被占用了
@@ -285,40 +705,34 @@ ncx_slab_alloc_locked(ncx_slab_pool_t *pool, size_t size)
                 // 当前页可用
                 if (page->slab != NCX_SLAB_BUSY) {
 
-                    for (m = 1, i = 0; m; m <<= 1, i++) {
-                        // 如果当前位被使用了，就继续查找下一块
-                        if ((page->slab & m)) {
-                            continue;
-                        }
-
-                        // 设置当前为已被使用
-                        page->slab |= m;
-                        // 最后一块也被使用了，就表示此页已使用完
-                        if (page->slab == NCX_SLAB_BUSY) {
-                            // 将当前页从链表中移除
-                            prev = (ncx_slab_page_t *)
-                                            (page->prev & ~NCX_SLAB_PAGE_MASK);
-                            prev->next = page->next;
-                            page->next->prev = page->prev;
-
-                            page->next = NULL;
-                            // 标识使用类型，精确
-                            page->prev = NCX_SLAB_EXACT;
-                        }
+                    // 最低的0位即第一个空闲块, 设置当前为已被使用
+                    i = ncx_ctz(~page->slab);
+                    page->slab |= (uintptr_t) 1 << i;
 
-                        p = (page - pool->pages) << ncx_pagesize_shift;
-                        p += i << shift;
-                        p += (uintptr_t) pool->start;
+                    // 最后一块也被使用了，就表示此页已使用完
+                    if (page->slab == NCX_SLAB_BUSY) {
+                        // 将当前页从链表中移除
+                        prev = ncx_slab_prev(pool, page);
+                        prev->next = page->next;
+                        ncx_slab_next(pool, page)->prev = page->prev;
 
-                        goto done;
+                        page->next = NULL;
+                        // 标识使用类型，精确
+                        page->prev = NCX_SLAB_EXACT;
                     }
+
+                    p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+                    p += i * s;
+                    p += (uintptr_t) ncx_slab_start(pool);
+
+                    goto done;
                 }
                 // 查找下一页 
-                page = page->next;
+                page = ncx_slab_next(pool, page);
 
             } while (page);
 
-        } else { /* shift > ncx_slab_exact_shift */
+        } else { /* s > pool->exact_size */
             // 当需要分配的空间大于128或64时，我们可以用一个int的位来表示这些空间  64位机器是64
             //所以我们依然采用跟等于128时类似的情况，用page->slab来表示  
             // 但由于 大于128的情况比较多，移位数分别为8、9、10、11这些情况  
@@ -331,131 +745,204 @@ ncx_slab_alloc_locked(ncx_slab_pool_t *pool, size_t size)
             // 看代码  
 
 
-            // page->slab & NGX_SLAB_SHIFT_MASK 即得到最低一位的值，其实就是当前页的分配大小的移位数  
-            // ngx_pagesize_shift减掉后，就是在一页中标记这些块所需要的移位数，也就是块数对应的移位数 
-            n = ncx_pagesize_shift - (page->slab & NCX_SLAB_SHIFT_MASK);//已经占用移位->可移动位数
-            // 得到一个页面所能放下的块数
-            n = 1 << n;
-            // 得到表示这些块数都用完的bitmap，用现在是低16位的
-            n = ((uintptr_t) 1 << n) - 1;
-            // 将低16位转换成高16位，因为我们是用高16位来表示空间地址的占用情况的
-            mask = n << NCX_SLAB_MAP_SHIFT;//0xffffffff00000000
+            // 一个页面(run)所能放下的块数由size class决定, 得到表示这些块数都用完的bitmap
+            n = ((uintptr_t) 1 << cls->chunks) - 1;
+            // 转换到高位，因为我们是用高位来表示空间地址的占用情况的
+            mask = n << NCX_SLAB_MAP_SHIFT;
+            type = (s > pool->max_size) ? NCX_SLAB_RUN : NCX_SLAB_BIG;
  
-            do {//高32位表示占用情况：0x100000000 表示，占用一个
+            do {//高位表示占用情况：0x100 表示，占用一个
                 // 判断高16位是否全被占用了
                 if ((page->slab & NCX_SLAB_MAP_MASK) != mask) {//slab&0xffffffff00000000   != 0xffffffff
 
-                    //m为位图表示内存使用情况
-                    // NGX_SLAB_MAP_SHIFT 为移位偏移， 得到0x10000
-                    for (m = (uintptr_t) 1 << NCX_SLAB_MAP_SHIFT, i = 0;//NCX_SLAB_MAP_SHIFT=32
-                         m & mask;
-                         m <<= 1, i++)
-                    {   // 当前块是否被占用 
-                        if ((page->slab & m)) {//判断当前位是否已经使用
-                            continue;
-                        }
-                        // 将当前位设置成1
-                        page->slab |= m;
-                        // 当前页是否完全被占用完
-                        if ((page->slab & NCX_SLAB_MAP_MASK) == mask) {
-                            prev = (ncx_slab_page_t *)
-                                            (page->prev & ~NCX_SLAB_PAGE_MASK);
-                            prev->next = page->next;
-                            page->next->prev = page->prev;
-
-                            page->next = NULL;
-                            page->prev = NCX_SLAB_BIG;
-                        }
+                    // 高位中最低的0位即第一个空闲块, 将其设置成1
+                    i = ncx_ctz(~(page->slab >> NCX_SLAB_MAP_SHIFT));
+                    page->slab |= (uintptr_t) 1 << (i + NCX_SLAB_MAP_SHIFT);
 
-                        p = (page - pool->pages) << ncx_pagesize_shift;
-                        p += i << shift;
-                        p += (uintptr_t) pool->start;
+                    // 当前页是否完全被占用完
+                    if ((page->slab & NCX_SLAB_MAP_MASK) == mask) {
+                        prev = ncx_slab_prev(pool, page);
+                        prev->next = page->next;
+                        ncx_slab_next(pool, page)->prev = page->prev;
 
-                        goto done;
+                        page->next = NULL;
+                        page->prev = type;
                     }
+
+                    p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+                    p += i * s;
+                    p += (uintptr_t) ncx_slab_start(pool);
+
+                    goto done;
                 }
 
-                page = page->next;
+                page = ncx_slab_next(pool, page);
 
             } while (page);
         }
     }
-    // 如果当前slab对应的page中没有空间可分配了，则重新从空闲page中分配一个页  
-    page = ncx_slab_alloc_pages(pool, 1);
+    // 如果当前slab对应的page中没有空间可分配了，则重新从空闲page中分配一个页(run)
+    page = ncx_slab_alloc_pages(pool, cls->pages);
 
     if (page) {
-        if (shift < ncx_slab_exact_shift) {
+        cls->slabs++;
+
+        if (s < pool->exact_size) {
             // 精确分配，小于64时 
-            p = (page - pool->pages) << ncx_pagesize_shift;//数据页对应的首地址
-            bitmap = (uintptr_t *) (pool->start + p);//前8个字节
-            // 需要的空间大小
-            s = 1 << shift;//申请size大小
-            n = (1 << (ncx_pagesize_shift - shift)) / 8 / s;
+            p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;//数据页对应的首地址
+            bitmap = (uintptr_t *) (ncx_slab_start(pool) + p);//前8个字节
+            // 位图本身占用的块数
+            n = cls->reserved;
+
+            // 需要使用的uintptr_t数组个数
+            map = ncx_slab_map(cls);
 
-            if (n == 0) {
-                n = 1;
+            // 前n块存放位图, 第n块分配出去, 共n+1位; 大页上n可能超过一个uintptr_t的位数
+            for (i = 0; i < (n + 1) / (sizeof(uintptr_t) * 8); i++) {
+                bitmap[i] = NCX_SLAB_BUSY;
             }
 
-            bitmap[0] = (2 << n) - 1;//第一个字节为3 :0011
-            // 需要使用的uintptr_t数组个数
-            map = (1 << (ncx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);//计算申请的size，占用内存块数、1<<7  128/64=2块
+            bitmap[i] = ((uintptr_t) 1 << ((n + 1) % (sizeof(uintptr_t) * 8))) - 1;//第一个字节为3 :0011
+
+            page->slab = ((uintptr_t) i << NCX_SLAB_MAP_SHIFT) | slot;
 
-            for (i = 1; i < map; i++) {
+            for (i++; i < map; i++) {
                 bitmap[i] = 0;
             }
 
-            page->slab = shift;
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_SMALL;
+            // 页尾放不下一个chunk的部分, 对应的位永远置1
+            if (cls->chunks % (sizeof(uintptr_t) * 8)) {
+                bitmap[map - 1] |= ~(((uintptr_t) 1
+                                      << (cls->chunks % (sizeof(uintptr_t) * 8)))
+                                     - 1);
+            }
+
+            page->next = ncx_slab_off(pool, &slots[slot]);
+            page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_SMALL);
 
-            slots[slot].next = page;
+            slots[slot].next = ncx_slab_off(pool, page);
 
-            p = ((page - pool->pages) << ncx_pagesize_shift) + s * n;//偏移s*n=32*1=32字节
-            p += (uintptr_t) pool->start;//p=p+start=32+startH
+            p = ((page - ncx_slab_pages(pool)) << pool->pagesize_shift) + s * n;//偏移s*n=32*1=32字节
+            p += (uintptr_t) ncx_slab_start(pool);//p=p+start=32+startH
 
             goto done;
 
-        } else if (shift == ncx_slab_exact_shift) {
+        } else if (s == pool->exact_size) {
             //  slab位图表示64块内存使用情况
             page->slab = 1;//第一块空间被占用
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_EXACT;
+            page->next = ncx_slab_off(pool, &slots[slot]);
+            page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_EXACT);
+
+            slots[slot].next = ncx_slab_off(pool, page);
+
+            p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+            p += (uintptr_t) ncx_slab_start(pool);
+
+            goto done;
 
-            slots[slot].next = page;
+        } else if (s <= pool->max_size) {
+            // 低位表示size class
+            page->slab = ((uintptr_t) 1 << NCX_SLAB_MAP_SHIFT) | slot;
+            page->next = ncx_slab_off(pool, &slots[slot]);
+            page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_BIG);
 
-            p = (page - pool->pages) << ncx_pagesize_shift;
-            p += (uintptr_t) pool->start;
+            slots[slot].next = ncx_slab_off(pool, page);
+
+            p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+            p += (uintptr_t) ncx_slab_start(pool);
 
             goto done;
 
-        } else { /* shift > ncx_slab_exact_shift */
-            // 低位表示存放数据的大小
-            page->slab = ((uintptr_t) 1 << NCX_SLAB_MAP_SHIFT) | shift;//NCX_SLAB_MAP_SHIFT=32
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_BIG;
+        } else { /* s > pool->max_size */
+            // run首页同BIG页
+            page->slab = ((uintptr_t) 1 << NCX_SLAB_MAP_SHIFT) | slot;
+            page->next = ncx_slab_off(pool, &slots[slot]);
+            page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_RUN);
+
+            slots[slot].next = ncx_slab_off(pool, page);
 
-            slots[slot].next = page;
+            // 其余页的 slab 已是 NCX_SLAB_PAGE_BUSY, next 指向首页
+            for (i = 1; i < cls->pages; i++) {
+                page[i].next = ncx_slab_off(pool, page);
+                page[i].prev = NCX_SLAB_RUN;
+            }
 
-            p = (page - pool->pages) << ncx_pagesize_shift;
-            p += (uintptr_t) pool->start;
+            p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+            p += (uintptr_t) ncx_slab_start(pool);
 
             goto done;
         }
     }
 
+    // 凑不出一整个run时退回按页分配
+    if (cls->pages > 1) {
+        p = ncx_slab_alloc_large(pool, size);
+        cls = NULL;
+        goto done;
+    }
+
     p = 0;
 
 done:
 
+    // 各class已分配的chunk数, 按页分配的在 ncx_slab_alloc_large 中统计;
+    // 失败由调用者统计, 可增长池还要再试其他arena
+    if (p && cls) {
+        ncx_slab_count_alloc(cls, 1);
+    }
+
     debug("slab alloc: %p", (void *)p);
 
     return (void *) p;
 }
 
 
+static uintptr_t
+ncx_slab_alloc_large(ncx_slab_pool_t *pool, size_t size)
+{
+    uintptr_t         p;
+    ncx_uint_t        pages;
+    ncx_slab_page_t  *page;
+
+	debug("slab alloc: %zu", size);
+
+    // 计算需要的页数，然后分配指针页数
+    pages = (size >> pool->pagesize_shift)
+            + ((size % pool->pagesize) ? 1 : 0);
+
+    page = ncx_slab_alloc_pages(pool, pages);
+    if (page == NULL) {
+        return 0;
+    }
+
+    pool->large_pages += pages;
+
+#if (NCX_SLAB_STATS)
+    pool->large_counters.allocs++;
+
+    if (pool->large_pages > pool->large_counters.peak) {
+        pool->large_counters.peak = pool->large_pages;
+    }
+#endif
+
+    // 由返回page在页数组中的偏移量，计算出实际数组地址的偏移量
+    p = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+    // 计算出实际的数据地址
+    p += (uintptr_t) ncx_slab_start(pool);
+
+    return p;
+}
+
+
 void
 ncx_slab_free(ncx_slab_pool_t *pool, void *p)
 {
+#if (NCX_SLAB_TCACHE)
+    if (ncx_slab_tcache_free(pool, p)) {
+        return;
+    }
+#endif
+
     ncx_shmtx_lock(&pool->mutex);
 
     ncx_slab_free_locked(pool, p);
@@ -467,20 +954,35 @@ ncx_slab_free(ncx_slab_pool_t *pool, void *p)
 void
 ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p)
 {
-    size_t            size;
-    uintptr_t         slab, m, *bitmap;
-    ncx_uint_t        n, type, slot, shift, map;
-    ncx_slab_page_t  *slots, *page;
+    size_t             size;
+    uintptr_t          slab, m, *bitmap;
+    ncx_uint_t         i, n, type, slot;
+    ncx_slab_page_t   *slots, *page;
+    ncx_slab_class_t  *cls;
 
     debug("slab free: %p", p);
 
-    if ((u_char *) p < pool->start || (u_char *) p > pool->end) {
+    if ((u_char *) p < ncx_slab_start(pool)
+        || (u_char *) p > ncx_slab_end(pool))
+    {
+
+        if (pool->narenas && ncx_slab_arena_find(pool, p)) {
+            ncx_slab_free_locked(ncx_slab_arena_find(pool, p), p);
+            return;
+        }
+
         error("ncx_slab_free(): outside of pool");
         goto fail;
     }
 
-    n = ((u_char *) p - pool->start) >> ncx_pagesize_shift;//size找下page表下表
-    page = &pool->pages[n];
+    n = ((u_char *) p - ncx_slab_start(pool)) >> pool->pagesize_shift;//size找下page表下表
+
+    // 从未切出过的页, 描述符还没有初始化
+    if (n >= pool->carved) {
+        goto chunk_already_free;
+    }
+
+    page = &ncx_slab_pages(pool)[n];
     slab = page->slab;
     type = page->prev & NCX_SLAB_PAGE_MASK;
 
@@ -488,53 +990,48 @@ ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p)
 
     case NCX_SLAB_SMALL:
 
-        shift = slab & NCX_SLAB_SHIFT_MASK;//0x000000000000000f
-        size = 1 << shift;//计算出这块内存，申请时使用多大size
+        slot = slab & NCX_SLAB_CLASS_MASK;
+        cls = &ncx_slab_classes(pool)[slot];
+        size = cls->size;//计算出这块内存，申请时使用多大size
 
-        if ((uintptr_t) p & (size - 1)) {
+        // 由页内偏移算出chunk序号, 不在chunk起始处或落在位图/页尾的都不对
+        n = (uintptr_t) p & (pool->pagesize - 1);
+        i = ncx_slab_chunk(cls, n);
+
+        if (i * size != n || i < cls->reserved || i >= cls->chunks) {
             goto wrong_chunk;
         }
 
-        n = ((uintptr_t) p & (ncx_pagesize - 1)) >> shift;
-        m = (uintptr_t) 1 << (n & (sizeof(uintptr_t) * 8 - 1));
-        n /= (sizeof(uintptr_t) * 8);
-        bitmap = (uintptr_t *) ((uintptr_t) p & ~(ncx_pagesize - 1));
+        m = (uintptr_t) 1 << (i & (sizeof(uintptr_t) * 8 - 1));
+        n = i / (sizeof(uintptr_t) * 8);
+        bitmap = (uintptr_t *) ((uintptr_t) p & ~(pool->pagesize - 1));
 
         if (bitmap[n] & m) {
 
             if (page->next == NULL) {
                 slots = (ncx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ncx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
-                slots[slot].next = page;
+                slots[slot].next = ncx_slab_off(pool, page);
 
-                page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_SMALL;
-                page->next->prev = (uintptr_t) page | NCX_SLAB_SMALL;
+                page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_SMALL);
+                ncx_slab_next(pool, page)->prev =
+                    ncx_slab_link(pool, page, NCX_SLAB_SMALL);
             }
 
             bitmap[n] &= ~m;
+            ncx_slab_count_free(cls, 1);
 
-            n = (1 << (ncx_pagesize_shift - shift)) / 8 / (1 << shift);
-
-            if (n == 0) {
-                n = 1;
+            if (n < (page->slab >> NCX_SLAB_MAP_SHIFT)) {
+                page->slab = ((uintptr_t) n << NCX_SLAB_MAP_SHIFT) | slot;
             }
 
-            if (bitmap[0] & ~(((uintptr_t) 1 << n) - 1)) {
+            if (!ncx_slab_small_empty(bitmap, cls)) {
                 goto done;
             }
 
-            map = (1 << (ncx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);
-
-            for (n = 1; n < map; n++) {
-                if (bitmap[n]) {
-                    goto done;
-                }
-            }
-
-            ncx_slab_free_pages(pool, page, 1);
+            ncx_slab_free_slab(pool, page, cls);
 
             goto done;
         }
@@ -544,33 +1041,37 @@ ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p)
     case NCX_SLAB_EXACT:
 
         m = (uintptr_t) 1 <<
-                (((uintptr_t) p & (ncx_pagesize - 1)) >> ncx_slab_exact_shift);
-        size = ncx_slab_exact_size;
+                (((uintptr_t) p & (pool->pagesize - 1)) >> pool->exact_shift);
+        size = pool->exact_size;
 
         if ((uintptr_t) p & (size - 1)) {
             goto wrong_chunk;
         }
 
         if (slab & m) {
+            slot = ncx_slab_slot(pool, pool->exact_size);
+            cls = &ncx_slab_classes(pool)[slot];
+
             if (slab == NCX_SLAB_BUSY) {
                 slots = (ncx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ncx_slab_pool_t));
-                slot = ncx_slab_exact_shift - pool->min_shift;
 
                 page->next = slots[slot].next;
-                slots[slot].next = page;
+                slots[slot].next = ncx_slab_off(pool, page);
 
-                page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_EXACT;
-                page->next->prev = (uintptr_t) page | NCX_SLAB_EXACT;
+                page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_EXACT);
+                ncx_slab_next(pool, page)->prev =
+                    ncx_slab_link(pool, page, NCX_SLAB_EXACT);
             }
 
             page->slab &= ~m;
+            ncx_slab_count_free(cls, 1);
 
             if (page->slab) {
                 goto done;
             }
 
-            ncx_slab_free_pages(pool, page, 1);
+            ncx_slab_free_slab(pool, page, cls);
 
             goto done;
         }
@@ -579,50 +1080,114 @@ ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p)
 
     case NCX_SLAB_BIG:
 
-        shift = slab & NCX_SLAB_SHIFT_MASK;
-        size = 1 << shift;
+        slot = slab & NCX_SLAB_CLASS_MASK;
+        cls = &ncx_slab_classes(pool)[slot];
+        size = cls->size;
 
-        if ((uintptr_t) p & (size - 1)) {
+        n = (uintptr_t) p & (pool->pagesize - 1);
+        i = ncx_slab_chunk(cls, n);
+
+        if (i * size != n || i >= cls->chunks) {
+            goto wrong_chunk;
+        }
+
+        m = (uintptr_t) 1 << (i + NCX_SLAB_MAP_SHIFT);
+
+        if (slab & m) {
+
+            if (page->next == NULL) {
+                slots = (ncx_slab_page_t *)
+                                   ((u_char *) pool + sizeof(ncx_slab_pool_t));
+
+                page->next = slots[slot].next;
+                slots[slot].next = ncx_slab_off(pool, page);
+
+                page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_BIG);
+                ncx_slab_next(pool, page)->prev =
+                    ncx_slab_link(pool, page, NCX_SLAB_BIG);
+            }
+
+            page->slab &= ~m;
+            ncx_slab_count_free(cls, 1);
+
+            if (page->slab & NCX_SLAB_MAP_MASK) {
+                goto done;
+            }
+
+            ncx_slab_free_slab(pool, page, cls);
+
+            goto done;
+        }
+
+        goto chunk_already_free;
+
+    case NCX_SLAB_RUN:
+
+        // run中的其余页, 由next找到首页
+        if (slab == NCX_SLAB_PAGE_BUSY) {
+            page = ncx_slab_next(pool, page);
+            slab = page->slab;
+        }
+
+        slot = slab & NCX_SLAB_CLASS_MASK;
+        cls = &ncx_slab_classes(pool)[slot];
+        size = cls->size;
+
+        n = (u_char *) p - ncx_slab_start(pool)
+            - ((page - ncx_slab_pages(pool)) << pool->pagesize_shift);
+        i = ncx_slab_chunk(cls, n);
+
+        if (i * size != n || i >= cls->chunks) {
             goto wrong_chunk;
         }
 
-        m = (uintptr_t) 1 << ((((uintptr_t) p & (ncx_pagesize - 1)) >> shift)
-                              + NCX_SLAB_MAP_SHIFT);
+        m = (uintptr_t) 1 << (i + NCX_SLAB_MAP_SHIFT);
 
         if (slab & m) {
 
             if (page->next == NULL) {
                 slots = (ncx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ncx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
-                slots[slot].next = page;
+                slots[slot].next = ncx_slab_off(pool, page);
 
-                page->prev = (uintptr_t) &slots[slot] | NCX_SLAB_BIG;
-                page->next->prev = (uintptr_t) page | NCX_SLAB_BIG;
+                page->prev = ncx_slab_link(pool, &slots[slot], NCX_SLAB_RUN);
+                ncx_slab_next(pool, page)->prev =
+                    ncx_slab_link(pool, page, NCX_SLAB_RUN);
             }
 
             page->slab &= ~m;
+            ncx_slab_count_free(cls, 1);
 
             if (page->slab & NCX_SLAB_MAP_MASK) {
                 goto done;
             }
 
-            ncx_slab_free_pages(pool, page, 1);
+            ncx_slab_free_slab(pool, page, cls);
 
             goto done;
         }
 
         goto chunk_already_free;
 
+    case NCX_SLAB_CACHE:
+
+        if (slab == NCX_SLAB_PAGE_BUSY) {
+            page = ncx_slab_next(pool, page);
+        }
+
+        ncx_slab_cache_free_chunk(ncx_slab_addr(pool, page->slab), page, p);
+
+        return;
+
     case NCX_SLAB_PAGE:
 
-        if ((uintptr_t) p & (ncx_pagesize - 1)) {
+        if ((uintptr_t) p & (pool->pagesize - 1)) {
             goto wrong_chunk;
         }
 
-		if (slab == NCX_SLAB_PAGE_FREE) {
+		if (slab == NCX_SLAB_PAGE_FREE || page->next != NULL) {
 			alert("ncx_slab_free(): page is already free");
 			goto fail;
         }
@@ -632,12 +1197,16 @@ ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p)
 			goto fail;
         }
 
-        n = ((u_char *) p - pool->start) >> ncx_pagesize_shift;
+        n = ((u_char *) p - ncx_slab_start(pool)) >> pool->pagesize_shift;
         size = slab & ~NCX_SLAB_PAGE_START;
 
-        ncx_slab_free_pages(pool, &pool->pages[n], size);
+        pool->large_pages -= size;
+#if (NCX_SLAB_STATS)
+        pool->large_counters.frees++;
+#endif
+        ncx_slab_free_pages(pool, &ncx_slab_pages(pool)[n], size);
 
-        ncx_slab_junk(p, size << ncx_pagesize_shift);
+        ncx_slab_junk(p, size << pool->pagesize_shift);
 
         return;
     }
@@ -668,283 +1237,3409 @@ fail:
 }
 
 
-static ncx_slab_page_t *
-ncx_slab_alloc_pages(ncx_slab_pool_t *pool, ncx_uint_t pages)
+ncx_uint_t
+ncx_slab_alloc_batch(ncx_slab_pool_t *pool, size_t size, ncx_uint_t n,
+    void **out)
 {
-    ncx_slab_page_t  *page, *p;
-	
-    for (page = pool->free.next; page != &pool->free; page = page->next) {
-	
-        if (page->slab >= pages) {
+    ncx_shmtx_lock(&pool->mutex);
 
-            if (page->slab > pages) {//从第二个开始
-                page[pages].slab = page->slab - pages;
-                page[pages].next = page->next;
-                page[pages].prev = page->prev;
+    n = ncx_slab_alloc_batch_locked(pool, size, n, out);
 
-                p = (ncx_slab_page_t *) page->prev;
-                p->next = &page[pages];
-                page->next->prev = (uintptr_t) &page[pages];
+    ncx_shmtx_unlock(&pool->mutex);
 
-            } else {
-                p = (ncx_slab_page_t *) page->prev;
-                p->next = page->next;
-                page->next->prev = page->prev;
-            }
+    return n;
+}
 
-            page->slab = pages | NCX_SLAB_PAGE_START;//0x8000000000000000
-            page->next = NULL;
-            page->prev = NCX_SLAB_PAGE;//0
 
-            if (--pages == 0) {
-                return page;
-            }
+/*
+ * 一次分配n个同样大小的chunk, 返回实际分配的个数.
+ * 每次从slot链表的第一页里一次取走尽可能多的空闲位, 不够再换页
+ */
 
-            for (p = page + 1; pages; pages--) {
-                p->slab = NCX_SLAB_PAGE_BUSY;//0xffffffffffffffff
-                p->next = NULL;
-                p->prev = NCX_SLAB_PAGE;//0
-                p++;
-            }
+ncx_uint_t
+ncx_slab_alloc_batch_locked(ncx_slab_pool_t *pool, size_t size, ncx_uint_t n,
+    void **out)
+{
+    ncx_uint_t  k;
 
-            return page;
-        }
-	}
+    k = ncx_slab_alloc_objs(pool, size, n, out);
 
-    error("ncx_slab_alloc() failed: no memory");
+    if (k < n && pool->grow_size) {
+        k += ncx_slab_arena_alloc(pool, size, n - k, &out[k]);
+    }
 
-    return NULL;
+    if (k < n) {
+        ncx_slab_count_fail(pool, size);
+    }
+
+    ncx_slab_account(pool, size, k);
+
+    return k;
 }
 
-static void
-ncx_slab_free_pages(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
-    ncx_uint_t pages)
+
+static ncx_uint_t
+ncx_slab_alloc_objs(ncx_slab_pool_t *pool, size_t size, ncx_uint_t n,
+    void **out)
 {
-    ncx_slab_page_t  *prev, *next;
+    void             *p;
+    ncx_uint_t        i, k, slot;
+    ncx_slab_page_t  *page, *slots;
 
-	if (pages > 1) {
-		ncx_memzero(&page[1], (pages - 1)* sizeof(ncx_slab_page_t));
-	}  
+    if (size > pool->run_size) {
 
-    if (page->next) {
-        prev = (ncx_slab_page_t *) (page->prev & ~NCX_SLAB_PAGE_MASK);
-        prev->next = page->next;
-        page->next->prev = page->prev;
+        for (i = 0; i < n; i++) {
+            out[i] = ncx_slab_alloc_obj(pool, size);
+            if (out[i] == NULL) {
+                break;
+            }
+        }
+
+        return i;
     }
 
-	page->slab = pages;
-	page->prev = (uintptr_t) &pool->free;  
-	page->next = pool->free.next;
-	page->next->prev = (uintptr_t) page;
+    slot = ncx_slab_slot(pool, size);
 
-	pool->free.next = page;
+    slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
 
-#ifdef PAGE_MERGE
-	if (pool->pages != page) {
-		prev = page - 1;
-		if (ncx_slab_empty(pool, prev)) {
-			for (; prev >= pool->pages; prev--) {
-				if (prev->slab != 0) 
-				{
-					pool->free.next = page->next;
-					page->next->prev = (uintptr_t) &pool->free;
+    for (i = 0; i < n; /* void */) {
 
-					prev->slab += pages;
-					ncx_memzero(page, sizeof(ncx_slab_page_t));
+        page = ncx_slab_next(pool, &slots[slot]);
 
-					page = prev;
+        // 没有可用页时走单个分配的流程申请新页, 新页会挂到slot链表上
+        if (page == &slots[slot]) {
+            p = ncx_slab_alloc_obj(pool, size);
+            if (p == NULL) {
+                break;
+            }
 
-					break;
-				}
-			}
-		}
-	}
+            out[i++] = p;
+            continue;
+        }
+
+        k = ncx_slab_alloc_chunks(pool, page, slot, n - i, &out[i]);
+
+        ncx_slab_count_alloc(&ncx_slab_classes(pool)[slot], k);
+        i += k;
+    }
+
+    return i;
+}
+
+
+/* 按申请大小和取整后的大小累计 */
+
+static void
+ncx_slab_account(ncx_slab_pool_t *pool, size_t size, ncx_uint_t n)
+{
+    size_t  s;
+
+    if (size > pool->run_size) {
+        s = ncx_align(size, pool->pagesize);
+
+    } else {
+        s = ncx_slab_classes(pool)[ncx_slab_slot(pool, size)].size;
+    }
+
+    pool->requested += size * n;
+    pool->consumed += s * n;
+}
+
+
+/* 从一个slab页中取出最多n个空闲chunk, 页被取满时从slot链表中摘除 */
+
+static ncx_uint_t
+ncx_slab_alloc_chunks(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t slot, ncx_uint_t n, void **out)
+{
+    size_t             s;
+    uintptr_t          base, free, mask, *bitmap;
+    ncx_uint_t         i, k, w, map, type;
+    ncx_slab_page_t   *prev;
+    ncx_slab_class_t  *cls;
+
+    cls = &ncx_slab_classes(pool)[slot];
+    s = cls->size;
+
+    base = ((page - ncx_slab_pages(pool)) << pool->pagesize_shift)
+           + (uintptr_t) ncx_slab_start(pool);
+    k = 0;
+
+    if (s < pool->exact_size) {
+
+        bitmap = (uintptr_t *) base;
+        map = ncx_slab_map(cls);
+
+        for (w = page->slab >> NCX_SLAB_MAP_SHIFT; w < map && k < n; w++) {
+
+            free = ~bitmap[w];
+
+            while (free && k < n) {
+                i = ncx_ctz(free);
+                free &= free - 1;
+
+                out[k++] = (void *)
+                    (base + ((w * sizeof(uintptr_t) * 8) + i) * s);
+            }
+
+            bitmap[w] = ~free;
+
+            if (free) {
+                break;
+            }
+        }
+
+        while (w < map && bitmap[w] == NCX_SLAB_BUSY) {
+            w++;
+        }
+
+        page->slab = ((uintptr_t) w << NCX_SLAB_MAP_SHIFT) | slot;
+
+        if (w < map) {
+            return k;
+        }
+
+        type = NCX_SLAB_SMALL;
+
+    } else if (s == pool->exact_size) {
+
+        free = ~page->slab;
+
+        while (free && k < n) {
+            i = ncx_ctz(free);
+            free &= free - 1;
+
+            out[k++] = (void *) (base + i * s);
+        }
+
+        page->slab = ~free;
+
+        if (page->slab != NCX_SLAB_BUSY) {
+            return k;
+        }
+
+        type = NCX_SLAB_EXACT;
+
+    } else { /* s > pool->exact_size, BIG页或run */
+
+        mask = (((uintptr_t) 1 << cls->chunks) - 1) << NCX_SLAB_MAP_SHIFT;
+        free = ~page->slab & mask;
+
+        while (free && k < n) {
+            i = ncx_ctz(free) - NCX_SLAB_MAP_SHIFT;
+            free &= free - 1;
+
+            out[k++] = (void *) (base + i * s);
+        }
+
+        page->slab = (page->slab | mask) & ~free;
+
+        if (free) {
+            return k;
+        }
+
+        type = (s > pool->max_size) ? NCX_SLAB_RUN : NCX_SLAB_BIG;
+    }
+
+    prev = ncx_slab_prev(pool, page);
+    prev->next = page->next;
+    ncx_slab_next(pool, page)->prev = page->prev;
+
+    page->next = NULL;
+    page->prev = type;
+
+    return k;
+}
+
+
+void
+ncx_slab_free_batch(ncx_slab_pool_t *pool, void **ptrs, ncx_uint_t n)
+{
+    ncx_shmtx_lock(&pool->mutex);
+
+    ncx_slab_free_batch_locked(pool, ptrs, n);
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+static int
+ncx_slab_ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t  x, y;
+
+    x = (uintptr_t) *(void **) a;
+    y = (uintptr_t) *(void **) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * 批量释放: 先按地址排序(会改变ptrs中的顺序), 同一页里的指针一起
+ * 清位图, 链表和空页检查每页只做一次
+ */
+
+void
+ncx_slab_free_batch_locked(ncx_slab_pool_t *pool, void **ptrs, ncx_uint_t n)
+{
+    ncx_uint_t        i, j, k;
+    ncx_slab_page_t  *page;
+
+    qsort(ptrs, n, sizeof(void *), ncx_slab_ptr_cmp);
+
+    for (i = 0; i < n; i = j) {
+
+        j = i + 1;
+
+        if ((u_char *) ptrs[i] < ncx_slab_start(pool)
+            || (u_char *) ptrs[i] >= ncx_slab_end(pool))
+        {
+            ncx_slab_free_locked(pool, ptrs[i]);
+            continue;
+        }
+
+        k = ((u_char *) ptrs[i] - ncx_slab_start(pool)) >> pool->pagesize_shift;
+        page = &ncx_slab_pages(pool)[k];
+
+        while (j < n
+               && (u_char *) ptrs[j] < ncx_slab_end(pool)
+               && (((u_char *) ptrs[j] - ncx_slab_start(pool))
+                   >> pool->pagesize_shift) == k)
+        {
+            j++;
+        }
+
+        // 整页分配, run和对象缓存中的chunk逐个释放;
+        // 从未切出过的页描述符未初始化, 不能读, 也逐个释放并报错
+        if (j - i == 1
+            || k >= pool->carved
+            || (page->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_PAGE
+            || (page->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_RUN
+            || (page->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_CACHE)
+        {
+            for (k = i; k < j; k++) {
+                ncx_slab_free_locked(pool, ptrs[k]);
+            }
+
+            continue;
+        }
+
+        ncx_slab_free_chunks(pool, page, &ptrs[i], j - i);
+    }
+}
+
+
+static void
+ncx_slab_free_chunks(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    void **ptrs, ncx_uint_t n)
+{
+    size_t             size;
+    uintptr_t          base, off, m, *bitmap;
+    ncx_uint_t         i, k, w, hint, freed, type, slot;
+    ncx_slab_page_t   *slots;
+    ncx_slab_class_t  *cls;
+
+    type = page->prev & NCX_SLAB_PAGE_MASK;
+    slot = (type == NCX_SLAB_EXACT) ? ncx_slab_slot(pool, pool->exact_size)
+                                    : page->slab & NCX_SLAB_CLASS_MASK;
+    cls = &ncx_slab_classes(pool)[slot];
+    size = cls->size;
+
+    base = ((page - ncx_slab_pages(pool)) << pool->pagesize_shift)
+           + (uintptr_t) ncx_slab_start(pool);
+    bitmap = (uintptr_t *) base;
+    hint = page->slab >> NCX_SLAB_MAP_SHIFT;
+    freed = 0;
+
+    for (k = 0; k < n; k++) {
+
+        off = (uintptr_t) ptrs[k] - base;
+        i = ncx_slab_chunk(cls, off);
+
+        if (i * size != off || i < cls->reserved || i >= cls->chunks) {
+            error("ncx_slab_free(): pointer to wrong chunk");
+            continue;
+        }
+
+        switch (type) {
+
+        case NCX_SLAB_SMALL:
+
+            w = i / (sizeof(uintptr_t) * 8);
+            m = (uintptr_t) 1 << (i % (sizeof(uintptr_t) * 8));
+
+            if (!(bitmap[w] & m)) {
+                goto chunk_already_free;
+            }
+
+            bitmap[w] &= ~m;
+
+            if (w < hint) {
+                hint = w;
+            }
+
+            break;
+
+        case NCX_SLAB_EXACT:
+
+            m = (uintptr_t) 1 << i;
+
+            if (!(page->slab & m)) {
+                goto chunk_already_free;
+            }
+
+            page->slab &= ~m;
+
+            break;
+
+        default: /* NCX_SLAB_BIG */
+
+            m = (uintptr_t) 1 << (i + NCX_SLAB_MAP_SHIFT);
+
+            if (!(page->slab & m)) {
+                goto chunk_already_free;
+            }
+
+            page->slab &= ~m;
+
+            break;
+        }
+
+        ncx_slab_junk(ptrs[k], size);
+
+        freed++;
+
+        continue;
+
+    chunk_already_free:
+
+        error("ncx_slab_free(): chunk is already free");
+    }
+
+    if (freed == 0) {
+        return;
+    }
+
+    ncx_slab_count_free(cls, freed);
+
+    if (type == NCX_SLAB_SMALL) {
+        page->slab = ((uintptr_t) hint << NCX_SLAB_MAP_SHIFT) | slot;
+    }
+
+    // 原来是满页, 重新挂回slot链表
+    if (page->next == NULL) {
+        slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
+
+        page->next = slots[slot].next;
+        slots[slot].next = ncx_slab_off(pool, page);
+
+        page->prev = ncx_slab_link(pool, &slots[slot], type);
+        ncx_slab_next(pool, page)->prev = ncx_slab_link(pool, page, type);
+    }
+
+    switch (type) {
+
+    case NCX_SLAB_SMALL:
+        if (!ncx_slab_small_empty(bitmap, cls)) {
+            return;
+        }
+        break;
+
+    case NCX_SLAB_EXACT:
+        if (page->slab) {
+            return;
+        }
+        break;
+
+    default: /* NCX_SLAB_BIG */
+        if (page->slab & NCX_SLAB_MAP_MASK) {
+            return;
+        }
+        break;
+    }
+
+    ncx_slab_free_slab(pool, page, cls);
+}
+
+
+/*
+ * 对象缓存: 每个cache有自己的slab, 按对象的实际大小(按align取整)紧密排列,
+ * 不经过size class. slab开头是已用对象数和占用位图, 之后是对象.
+ * 对象在slab创建时调用一次ctor, 释放时不清理, 再次分配得到的仍是构造过的对象.
+ * slab首页 slab = cache指针, 其余页 slab = NCX_SLAB_PAGE_BUSY, next 指向首页
+ */
+
+ncx_slab_cache_t *
+ncx_slab_cache_create(ncx_slab_pool_t *pool, size_t size, size_t align,
+    ncx_slab_cache_ctor_pt ctor)
+{
+    ncx_uint_t         n, pages, offset;
+    ncx_slab_cache_t  *cache;
+
+    if (align == 0) {
+        align = NCX_ALIGNMENT;
+    }
+
+    if (size == 0 || align & (align - 1) || align > pool->pagesize) {
+        error("ncx_slab_cache_create(): invalid size %zu or align %zu",
+              size, align);
+        return NULL;
+    }
+
+    size = ncx_align(size, align);
+
+    // 一个slab至少放 NCX_SLAB_CACHE_OBJS 个对象, 页数允许时
+    for (pages = 1; /* void */; pages <<= 1) {
+        n = ncx_slab_cache_layout(pool, pages, size, align, &offset);
+
+        if (n >= NCX_SLAB_CACHE_OBJS || pages == NCX_SLAB_RUN_PAGES) {
+            break;
+        }
+    }
+
+    if (n == 0) {
+        error("ncx_slab_cache_create(): object size %zu is too large", size);
+        return NULL;
+    }
+
+    cache = ncx_slab_alloc(pool, sizeof(ncx_slab_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    ncx_memzero(cache, sizeof(ncx_slab_cache_t));
+
+#if (NCX_SLAB_PIC)
+    cache->pool = ncx_slab_off(pool, cache);
+#else
+    cache->pool = pool;
+#endif
+    cache->ctor = ctor;
+    cache->offset = offset;
+
+    cache->cls.size = size;
+    cache->cls.chunks = n;
+    cache->cls.pages = pages;
+    cache->cls.shift = 2 * pool->pagesize_shift + (pages > 1 ? 8 : 0);
+    cache->cls.magic = (((uint64_t) 1 << cache->cls.shift) + size - 1) / size;
+
+    cache->partial.next = ncx_slab_off(pool, &cache->partial);
+
+    return cache;
+}
+
+
+/* 释放cache的所有slab, 包括仍在使用中的对象 */
+
+void
+ncx_slab_cache_destroy(ncx_slab_cache_t *cache)
+{
+    uintptr_t         *hdr;
+    ncx_uint_t         i;
+    ncx_slab_pool_t   *pool;
+    ncx_slab_page_t   *page;
+
+    pool = ncx_slab_cache_pool(cache);
+
+    ncx_shmtx_lock(&pool->mutex);
+
+    for (i = 0; i < pool->carved; i++) {
+        page = &ncx_slab_pages(pool)[i];
+
+        if ((page->prev & NCX_SLAB_PAGE_MASK) != NCX_SLAB_CACHE
+            || page->slab != (uintptr_t) ncx_slab_off(pool, cache))
+        {
+            continue;
+        }
+
+        hdr = (uintptr_t *) ncx_slab_page_addr(pool, page);
+
+        ncx_slab_count_free(&cache->cls, hdr[0]);
+        pool->cache_used -= hdr[0] * cache->cls.size;
+        pool->cache_pages -= cache->cls.pages;
+
+        ncx_slab_free_pages(pool, page, cache->cls.pages);
+    }
+
+    ncx_slab_free_locked(pool, cache);
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+void *
+ncx_slab_cache_alloc(ncx_slab_cache_t *cache)
+{
+    void  *p;
+
+    ncx_shmtx_lock(&ncx_slab_cache_pool(cache)->mutex);
+
+    p = ncx_slab_cache_alloc_locked(cache);
+
+    ncx_shmtx_unlock(&ncx_slab_cache_pool(cache)->mutex);
+
+    return p;
+}
+
+
+void *
+ncx_slab_cache_alloc_locked(ncx_slab_cache_t *cache)
+{
+    u_char           *base;
+    uintptr_t        *hdr, *bitmap;
+    ncx_uint_t        i, w;
+    ncx_slab_pool_t  *pool;
+    ncx_slab_page_t  *page, *prev;
+
+    pool = ncx_slab_cache_pool(cache);
+    page = ncx_slab_next(pool, &cache->partial);
+
+    if (page == &cache->partial) {
+        page = ncx_slab_cache_grow(cache);
+
+        if (page == NULL) {
+#if (NCX_SLAB_STATS)
+            cache->cls.counters.fails++;
+#endif
+            return NULL;
+        }
+    }
+
+    base = ncx_slab_page_addr(pool, page);
+    hdr = (uintptr_t *) base;
+    bitmap = hdr + 1;
+
+    // 链表上的slab一定有空闲对象, 最低的0位在 chunks 之内
+    for (w = 0; bitmap[w] == NCX_SLAB_BUSY; w++) { /* void */ }
+
+    i = ncx_ctz(~bitmap[w]);
+    bitmap[w] |= (uintptr_t) 1 << i;
+    i += w * sizeof(uintptr_t) * 8;
+
+    if (hdr[0]++ == 0) {
+        cache->empty--;
+    }
+
+    if (hdr[0] == cache->cls.chunks) {
+        prev = ncx_slab_prev(pool, page);
+        prev->next = page->next;
+        ncx_slab_next(pool, page)->prev = page->prev;
+
+        page->next = NULL;
+        page->prev = NCX_SLAB_CACHE;
+    }
+
+    ncx_slab_count_alloc(&cache->cls, 1);
+    pool->cache_used += cache->cls.size;
+
+    return base + cache->offset + i * cache->cls.size;
+}
+
+
+void
+ncx_slab_cache_free(ncx_slab_cache_t *cache, void *p)
+{
+    ncx_shmtx_lock(&ncx_slab_cache_pool(cache)->mutex);
+
+    ncx_slab_cache_free_locked(cache, p);
+
+    ncx_shmtx_unlock(&ncx_slab_cache_pool(cache)->mutex);
+}
+
+
+void
+ncx_slab_cache_free_locked(ncx_slab_cache_t *cache, void *p)
+{
+    ncx_slab_pool_t  *pool;
+    ncx_slab_page_t  *page;
+
+    pool = ncx_slab_cache_pool(cache);
+
+    if ((u_char *) p < ncx_slab_start(pool)
+        || (u_char *) p >= ncx_slab_end(pool))
+    {
+        error("ncx_slab_cache_free(): outside of pool");
+        return;
+    }
+
+    page = ncx_slab_addr_page(pool, p);
+
+    if ((page->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_CACHE
+        && page->slab == NCX_SLAB_PAGE_BUSY)
+    {
+        page = ncx_slab_next(pool, page);
+    }
+
+    if ((page->prev & NCX_SLAB_PAGE_MASK) != NCX_SLAB_CACHE
+        || page->slab != (uintptr_t) ncx_slab_off(pool, cache))
+    {
+        error("ncx_slab_cache_free(): pointer to wrong cache");
+        return;
+    }
+
+    ncx_slab_cache_free_chunk(cache, page, p);
+}
+
+
+/* page 为slab首页; 释放后全空的slab保留 NCX_SLAB_CACHE_EMPTY 个, 多余的还给池 */
+
+static void
+ncx_slab_cache_free_chunk(ncx_slab_cache_t *cache, ncx_slab_page_t *page,
+    void *p)
+{
+    u_char           *base;
+    uintptr_t         m, off, *hdr, *bitmap;
+    ncx_uint_t        i;
+    ncx_slab_pool_t  *pool;
+
+    pool = ncx_slab_cache_pool(cache);
+
+    base = ncx_slab_page_addr(pool, page);
+    off = (u_char *) p - base - cache->offset;
+    i = ncx_slab_chunk(&cache->cls, off);
+
+    if ((u_char *) p < base + cache->offset
+        || i * cache->cls.size != off || i >= cache->cls.chunks)
+    {
+        error("ncx_slab_cache_free(): pointer to wrong chunk");
+        return;
+    }
+
+    hdr = (uintptr_t *) base;
+    bitmap = hdr + 1;
+    m = (uintptr_t) 1 << (i % (sizeof(uintptr_t) * 8));
+    i /= sizeof(uintptr_t) * 8;
+
+    if (!(bitmap[i] & m)) {
+        error("ncx_slab_cache_free(): chunk is already free");
+        return;
+    }
+
+    bitmap[i] &= ~m;
+
+    ncx_slab_count_free(&cache->cls, 1);
+    pool->cache_used -= cache->cls.size;
+
+    // 原来是满的slab, 重新挂回链表
+    if (page->next == NULL) {
+        page->next = cache->partial.next;
+        cache->partial.next = ncx_slab_off(pool, page);
+
+        page->prev = ncx_slab_link(pool, &cache->partial, NCX_SLAB_CACHE);
+        ncx_slab_next(pool, page)->prev =
+            ncx_slab_link(pool, page, NCX_SLAB_CACHE);
+    }
+
+    if (--hdr[0]) {
+        return;
+    }
+
+    if (cache->empty < NCX_SLAB_CACHE_EMPTY) {
+        cache->empty++;
+        return;
+    }
+
+    cache->cls.slabs--;
+    pool->cache_pages -= cache->cls.pages;
+
+    ncx_slab_free_pages(pool, page, cache->cls.pages);
+}
+
+
+/* 新切一个slab挂到链表上, 并构造其中所有对象 */
+
+static ncx_slab_page_t *
+ncx_slab_cache_grow(ncx_slab_cache_t *cache)
+{
+    u_char           *base;
+    ncx_uint_t        i;
+    ncx_slab_pool_t  *pool;
+    ncx_slab_page_t  *page;
+
+    pool = ncx_slab_cache_pool(cache);
+
+    page = ncx_slab_alloc_pages(pool, cache->cls.pages);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    cache->cls.slabs++;
+    cache->empty++;
+    pool->cache_pages += cache->cls.pages;
+
+    base = ncx_slab_page_addr(pool, page);
+
+    // 已用计数和位图清0
+    ncx_memzero(base, cache->offset);
+
+    page->slab = (uintptr_t) ncx_slab_off(pool, cache);
+    page->next = cache->partial.next;
+    cache->partial.next = ncx_slab_off(pool, page);
+
+    page->prev = ncx_slab_link(pool, &cache->partial, NCX_SLAB_CACHE);
+    ncx_slab_next(pool, page)->prev =
+        ncx_slab_link(pool, page, NCX_SLAB_CACHE);
+
+    for (i = 1; i < cache->cls.pages; i++) {
+        page[i].slab = NCX_SLAB_PAGE_BUSY;
+        page[i].next = ncx_slab_off(pool, page);
+        page[i].prev = NCX_SLAB_CACHE;
+    }
+
+    if (cache->ctor) {
+        for (i = 0; i < cache->cls.chunks; i++) {
+            cache->ctor(base + cache->offset + i * cache->cls.size);
+        }
+    }
+
+    return page;
+}
+
+
+/* pages 页的slab能放下的对象数, offset 返回第一个对象的偏移 */
+
+static ncx_uint_t
+ncx_slab_cache_layout(ncx_slab_pool_t *pool, ncx_uint_t pages, size_t size,
+    size_t align, ncx_uint_t *offset)
+{
+    size_t      bytes;
+    ncx_uint_t  n, map;
+
+    bytes = pages << pool->pagesize_shift;
+
+    for (n = bytes / size; n; n--) {
+        map = (n + sizeof(uintptr_t) * 8 - 1) / (sizeof(uintptr_t) * 8);
+        *offset = ncx_align((1 + map) * sizeof(uintptr_t), align);
+
+        if (*offset + n * size <= bytes) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * slab变空: 保留给本class下次使用, 避免分配/释放交替时反复切分和归还页.
+ * 已保留 pool->retain 个时归还此页, 并把保留数一次降到 retain/2,
+ * 保留数在上限附近波动时不会每次都进出页分配器
+ */
+
+static void
+ncx_slab_free_slab(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_slab_class_t *cls)
+{
+    uintptr_t         type;
+    ncx_slab_page_t  *prev;
+
+    if (cls->retained < pool->retain) {
+        type = page->prev & NCX_SLAB_PAGE_MASK;
+
+        prev = ncx_slab_prev(pool, page);
+        prev->next = page->next;
+        ncx_slab_next(pool, page)->prev = page->prev;
+
+        // 保留的页不在slot链表上, prev 只剩类型, next 串成单链表
+        page->next = cls->empty;
+        page->prev = type;
+
+        cls->empty = ncx_slab_off(pool, page);
+        cls->retained++;
+
+        return;
+    }
+
+    cls->slabs--;
+    ncx_slab_free_pages(pool, page, cls->pages);
+
+    ncx_slab_release_retained(pool, cls, pool->retain / 2);
+}
+
+
+/* 归还保留的空slab直到只剩 keep 个, cls 为 NULL 时处理所有class; 返回归还的页数 */
+
+static ncx_uint_t
+ncx_slab_release_retained(ncx_slab_pool_t *pool, ncx_slab_class_t *cls,
+    ncx_uint_t keep)
+{
+    ncx_uint_t         pages;
+    ncx_slab_page_t   *page;
+    ncx_slab_class_t  *last;
+
+    if (cls == NULL) {
+        cls = ncx_slab_classes(pool);
+        last = &ncx_slab_classes(pool)[pool->nclasses - 1];
+
+    } else {
+        last = cls;
+    }
+
+    pages = 0;
+
+    for ( /* void */ ; cls <= last; cls++) {
+
+        while (cls->retained > keep) {
+            page = ncx_slab_addr(pool, cls->empty);
+            cls->empty = page->next;
+            cls->retained--;
+
+            page->next = NULL;
+
+            cls->slabs--;
+            ncx_slab_free_pages(pool, page, cls->pages);
+
+            pages += cls->pages;
+        }
+    }
+
+    return pages;
+}
+
+
+/* SMALL页除了位图自身占用的块和页尾放不下chunk的位之外是否都已释放 */
+
+static bool
+ncx_slab_small_empty(uintptr_t *bitmap, ncx_slab_class_t *cls)
+{
+    uintptr_t   m, tail;
+    ncx_uint_t  i, n, map;
+
+    n = cls->reserved;
+    map = ncx_slab_map(cls);
+
+    tail = 0;
+
+    if (cls->chunks % (sizeof(uintptr_t) * 8)) {
+        tail = ~(((uintptr_t) 1 << (cls->chunks % (sizeof(uintptr_t) * 8)))
+                 - 1);
+    }
+
+    // 跳过位图自身占用的前n位
+    for (i = n / (sizeof(uintptr_t) * 8); i < map; i++) {
+
+        m = NCX_SLAB_BUSY;
+
+        if (i == n / (sizeof(uintptr_t) * 8)) {
+            m &= ~(((uintptr_t) 1 << (n % (sizeof(uintptr_t) * 8))) - 1);
+        }
+
+        if (i == map - 1) {
+            m &= ~tail;
+        }
+
+        if (bitmap[i] & m) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * size class: 4*min_size 以内按 min_size 递增 (8/16/24/32), 之后每个区间
+ * (2^k, 2^(k+1)] 再均分成4档, 如 40/48/56/64, 80/96/112/128, ...,
+ * 1280/1536/1792/2048. 只用clz和移位, 不用除法
+ */
+
+static ncx_uint_t
+ncx_slab_slot(ncx_slab_pool_t *pool, size_t size)
+{
+    ncx_uint_t  k;
+
+    if (size <= ((size_t) 4 << pool->min_shift)) {
+        return size ? (size - 1) >> pool->min_shift : 0;
+    }
+
+    size--;
+    k = sizeof(uintptr_t) * 8 - 1 - ncx_clz(size);
+
+    return ((k - pool->min_shift - 1) << 2) + ((size >> (k - 2)) & 3);
+}
+
+
+static size_t
+ncx_slab_class_size(ncx_slab_pool_t *pool, ncx_uint_t slot)
+{
+    if (slot < 4) {
+        return (size_t) (slot + 1) << pool->min_shift;
+    }
+
+    return (size_t) (5 + (slot & 3)) << (pool->min_shift + (slot >> 2) - 1);
+}
+
+
+/*
+ * run 的页数: 先取 pagesize 与 size 的最小公倍数, run 尾部没有浪费,
+ * chunk 不到 NCX_SLAB_RUN_CHUNKS 个时再成倍增加, 不超过 NCX_SLAB_RUN_PAGES 页.
+ * 放不下2个chunk时返回0, 这样的大小直接按页分配
+ */
+
+static ncx_uint_t
+ncx_slab_run_pages(ncx_slab_pool_t *pool, size_t size)
+{
+    size_t      a, b, t;
+    ncx_uint_t  n, pages;
+
+    for (a = pool->pagesize, b = size; b; a = b, b = t) {
+        t = a % b;
+    }
+
+    // 最小公倍数对应的页数
+    n = size / a;
+    pages = n;
+
+    while (pages + n <= NCX_SLAB_RUN_PAGES
+           && (pages << pool->pagesize_shift) / size < NCX_SLAB_RUN_CHUNKS)
+    {
+        pages += n;
+    }
+
+    if (pages > NCX_SLAB_RUN_PAGES
+        || (pages << pool->pagesize_shift) / size < 2)
+    {
+        return 0;
+    }
+
+    return pages;
+}
+
+
+static void
+ncx_slab_free_insert(ncx_slab_pool_t *pool, ncx_slab_page_t *page)
+{
+    ncx_uint_t        i;
+    ncx_slab_page_t  *head;
+
+    i = ncx_slab_free_index(page->slab);
+    head = &pool->free[i];
+
+    page->prev = ncx_slab_link(pool, head, NCX_SLAB_PAGE);
+    page->next = head->next;
+    ncx_slab_next(pool, page)->prev = ncx_slab_link(pool, page, NCX_SLAB_PAGE);
+
+    head->next = ncx_slab_off(pool, page);
+
+    pool->free_map |= (uintptr_t) 1 << i;
+
+    if (page->slab > 1) {
+        page[page->slab - 1].slab = 0;
+        page[page->slab - 1].next = ncx_slab_off(pool, page);
+        page[page->slab - 1].prev = NCX_SLAB_PAGE;
+    }
+}
+
+
+static void
+ncx_slab_free_remove(ncx_slab_pool_t *pool, ncx_slab_page_t *page)
+{
+    ncx_uint_t        i;
+    ncx_slab_page_t  *prev;
+
+    prev = ncx_slab_prev(pool, page);
+    prev->next = page->next;
+    ncx_slab_next(pool, page)->prev = page->prev;
+
+    i = ncx_slab_free_index(page->slab);
+
+    if (ncx_slab_next(pool, &pool->free[i]) == &pool->free[i]) {
+        pool->free_map &= ~((uintptr_t) 1 << i);
+    }
+}
+
+
+/*
+ * 先在 pages 所在的桶里找最合适的块 (桶内块长度不一定都够),
+ * 找不到再取更大的非空桶, 这些桶里的块一定够用, 只比较前几个取最小的;
+ * 没有更大的非空桶时才把本桶查完
+ */
+
+static ncx_slab_page_t *
+ncx_slab_alloc_pages(ncx_slab_pool_t *pool, ncx_uint_t pages)
+{
+    uintptr_t         map, since;
+    ncx_uint_t        i, n;
+    ncx_slab_page_t  *page, *p, *best, *tail;
+
+    best = NULL;
+    i = ncx_slab_free_index(pages);
+    page = &pool->free[i];
+
+    if (pool->free_map & ((uintptr_t) 1 << i)) {
+
+        for (page = ncx_slab_next(pool, &pool->free[i]), n = 0;
+             page != &pool->free[i] && n < NCX_SLAB_FREE_SCAN;
+             page = ncx_slab_next(pool, page), n++)
+        {
+            if (page->slab >= pages
+                && (best == NULL || page->slab < best->slab))
+            {
+                best = page;
+
+                if (page->slab == pages) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (best == NULL) {
+
+        map = (pool->free_map >> i) >> 1;
+
+        // 更大的桶都空, 本桶剩下的块里可能还有够用的, 不再限制检查个数
+        if (map == 0) {
+            for ( /* void */ ; page != &pool->free[i];
+                 page = ncx_slab_next(pool, page))
+            {
+                if (page->slab >= pages
+                    && (best == NULL || page->slab < best->slab))
+                {
+                    best = page;
+
+                    if (page->slab == pages) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    if (best == NULL) {
+
+        if (map == 0) {
+            // 从未用过的页中再切出一段, 或把各class保留的空slab还回来, 再试一次
+            if (ncx_slab_carve(pool, pages)
+                || ncx_slab_release_retained(pool, NULL, 0))
+            {
+                return ncx_slab_alloc_pages(pool, pages);
+            }
+
+            error("ncx_slab_alloc() failed: no memory");
+            return NULL;
+        }
+
+        i += ncx_ctz(map) + 1;
+
+        for (page = ncx_slab_next(pool, &pool->free[i]), n = 0;
+             page != &pool->free[i] && n < NCX_SLAB_FREE_SCAN;
+             page = ncx_slab_next(pool, page), n++)
+        {
+            if (best == NULL || page->slab < best->slab) {
+                best = page;
+            }
+        }
+    }
+
+    page = best;
+
+    ncx_slab_free_remove(pool, page);
+
+    pool->free_pages -= pages;
+
+    // 尾页上的回收状态不是页本身的回收标记, 先取下, 剩余部分的尾页不变, 再放回
+    tail = NULL;
+    since = 0;
+
+    if (page->slab > 1) {
+        tail = &page[page->slab - 1];
+        since = tail->prev;
+        tail->prev = NCX_SLAB_PAGE;
+    }
+
+    if (page->slab > pages) {//剩余部分重新入桶
+        // 成为首页后不再记录回收标记, 页本身仍未驻留, 用到时由内核补0页
+        if (page[pages].prev & NCX_SLAB_PAGE_PURGED) {
+            pool->purged_pages--;
+        }
+
+        page[pages].slab = page->slab - pages;
+        ncx_slab_free_insert(pool, &page[pages]);
+
+        // 剩余部分的中间页是原来的一部分, 原来的状态仍然成立
+        if (page[pages].slab > 1) {
+            tail->prev = since;
+        }
+    }
+
+    page->slab = pages | NCX_SLAB_PAGE_START;//0x8000000000000000
+    page->next = NULL;
+    page->prev = NCX_SLAB_PAGE;//0
+
+    if (--pages == 0) {
+        return page;
+    }
+
+    for (p = page + 1; pages; pages--) {
+        if (p->prev & NCX_SLAB_PAGE_PURGED) {
+            pool->purged_pages--;
+        }
+
+        p->slab = NCX_SLAB_PAGE_BUSY;//0xffffffffffffffff
+        p->next = NULL;
+        p->prev = NCX_SLAB_PAGE;//0
+        p++;
+    }
+
+    return page;
+}
+
+
+/*
+ * 页描述符按需初始化: pool->carved 之后的页从未用过, 描述符未初始化, 也不在
+ * 空闲链表上. 空闲链表中没有够大的块时, 再切出至少 pages 页(一次至少
+ * NCX_SLAB_CARVE_PAGES 页)放入空闲链表, 与前面相邻的空闲块合并.
+ * 初始化池的开销因此与池大小无关. 返回切出的页数
+ */
+
+static ncx_uint_t
+ncx_slab_carve(ncx_slab_pool_t *pool, ncx_uint_t pages)
+{
+    ncx_uint_t        n;
+    ncx_slab_page_t  *page;
+
+    n = pool->real_pages - pool->carved;
+
+    if (pages < NCX_SLAB_CARVE_PAGES) {
+        pages = NCX_SLAB_CARVE_PAGES;
+    }
+
+    if (n > pages) {
+        n = pages;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    page = &ncx_slab_pages(pool)[pool->carved];
+
+    ncx_memzero(page, n * sizeof(ncx_slab_page_t));
+    ncx_slab_junk(ncx_slab_page_addr(pool, page), n << pool->pagesize_shift);
+
+    pool->carved += n;
+
+    // 未切出的页本来就计入了空闲页
+    pool->free_pages -= n;
+    ncx_slab_free_pages(pool, page, n);
+
+    return n;
+}
+
+
+/* 未切出的页数, 加上紧挨着它们的空闲块: 切出时两者合并, 是一整段可用的页 */
+
+static ncx_uint_t
+ncx_slab_top_pages(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t        n;
+    ncx_slab_page_t  *page;
+
+    n = pool->real_pages - pool->carved;
+
+    if (pool->carved == 0) {
+        return n;
+    }
+
+    page = &ncx_slab_pages(pool)[pool->carved - 1];
+
+    if (!ncx_slab_page_is_free(page)) {
+        return n;
+    }
+
+    // 多页空闲块的尾页指向块首
+    if (page->slab == 0) {
+        page = ncx_slab_next(pool, page);
+    }
+
+    return n + page->slab;
+}
+
+
+static void
+ncx_slab_free_pages(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t pages)
+{
+    uintptr_t         since;
+    ncx_uint_t        now;
+    ncx_slab_page_t  *prev;
+#ifdef PAGE_MERGE
+    ncx_slab_page_t  *next;
+#endif
+
+    pool->free_pages += pages;
+
+    now = pool->purge_decay ? ncx_slab_msec() : 0;
+    since = now;
+
+    if (pages > 1) {
+        ncx_slab_idle_pages(&page[1], pages - 1, now);
+    }
+
+    if (page->next) {
+        prev = ncx_slab_prev(pool, page);
+        prev->next = page->next;
+        ncx_slab_next(pool, page)->prev = page->prev;
+    }
+
+    page->slab = pages;
+
+#ifdef PAGE_MERGE
+    if (page > ncx_slab_pages(pool)) {
+        prev = page - 1;
+
+        if (ncx_slab_page_is_free(prev)) {
+
+            // 左边是多页空闲块的尾页, 由它找到块首
+            if (prev->slab == 0) {
+                since = ncx_slab_run_since(prev, since);
+                next = prev;
+                prev = ncx_slab_next(pool, prev);
+                ncx_slab_idle_pages(next, 1, now);
+            }
+
+            ncx_slab_free_remove(pool, prev);
+
+            prev->slab += page->slab;
+            ncx_slab_idle_pages(page, 1, now);
+
+            page = prev;
+        }
+    }
+
+    next = page + page->slab;
+
+    if (next < ncx_slab_pages(pool) + pool->carved
+        && ncx_slab_page_is_free(next))
+    {
+        if (next->slab > 1) {
+            since = ncx_slab_run_since(&next[next->slab - 1], since);
+        }
+
+        ncx_slab_free_remove(pool, next);
+
+        page->slab += next->slab;
+        ncx_slab_idle_pages(next, 1, now);
+    }
+
+#endif
+
+    ncx_slab_free_insert(pool, page);
+
+    if (page->slab > 1) {
+        page[page->slab - 1].prev = NCX_SLAB_PAGE
+                                    | (since << NCX_SLAB_IDLE_SHIFT);
+    }
+
+    if (pool->purge_decay
+        && now - pool->purge_last >= pool->purge_decay / NCX_SLAB_PURGE_STEPS)
+    {
+        ncx_slab_purge_locked(pool, now);
+    }
+}
+
+
+/* 变成空闲块中间页的页描述符清0, 并记下时间 */
+
+static void
+ncx_slab_idle_pages(ncx_slab_page_t *page, ncx_uint_t n, ncx_uint_t now)
+{
+    ncx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        page[i].slab = NCX_SLAB_PAGE_FREE;
+        page[i].next = NULL;
+        page[i].prev = (uintptr_t) now << NCX_SLAB_IDLE_SHIFT;
+    }
+}
+
+
+/*
+ * 空闲页回收: 空闲超过 msec 毫秒的大空闲块(至少 NCX_SLAB_PURGE_PAGES 页)的中间页
+ * 用 madvise 还给系统. lazy 时用 MADV_FREE, 内存不紧张时页不会被收走, 再次使用时
+ * 省去缺页和内核清0; 否则私有内存用 MADV_DONTNEED, 共享内存用 MADV_REMOVE, 立即降低RSS.
+ * 回收在释放页时顺带进行, 最多每 msec/4 毫秒一次; 空闲的进程可定期调用 ncx_slab_purge
+ */
+
+void
+ncx_slab_purge_decay(ncx_slab_pool_t *pool, ncx_uint_t msec, ncx_uint_t lazy)
+{
+    ncx_uint_t  i;
+
+    // madvise 以系统页为单位
+    if (msec && pool->pagesize < (size_t) getpagesize()) {
+        error("ncx_slab_purge_decay(): page size %zu is smaller than "
+              "system page", (size_t) pool->pagesize);
+        return;
+    }
+
+    ncx_shmtx_lock(&pool->mutex);
+
+    pool->purge_decay = msec;
+    pool->purge_advice = lazy ? MADV_FREE : MADV_REMOVE;
+    pool->purge_last = ncx_slab_msec();
+
+    for (i = 0; i < pool->narenas; i++) {
+        pool->arenas[i]->purge_decay = pool->purge_decay;
+        pool->arenas[i]->purge_advice = pool->purge_advice;
+        pool->arenas[i]->purge_last = pool->purge_last;
+    }
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+void
+ncx_slab_purge(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t  i, now;
+
+    now = ncx_slab_msec();
+
+    ncx_shmtx_lock(&pool->mutex);
+
+    if (pool->purge_decay) {
+        ncx_slab_purge_locked(pool, now);
+    }
+
+    for (i = 0; i < pool->narenas; i++) {
+        if (pool->arenas[i]->purge_decay) {
+            ncx_slab_purge_locked(pool->arenas[i], now);
+        }
+    }
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+/*
+ * 每个size class最多保留 n 个变空的slab(run)不归还, 下次分配直接使用;
+ * 0 表示变空立即归还. 调小时多出的立即归还, 页不够用时也会先归还保留的slab
+ */
+
+void
+ncx_slab_retain(ncx_slab_pool_t *pool, ncx_uint_t n)
+{
+    ncx_uint_t  i;
+
+    ncx_shmtx_lock(&pool->mutex);
+
+    pool->retain = n;
+    ncx_slab_release_retained(pool, NULL, n);
+
+    for (i = 0; i < pool->narenas; i++) {
+        pool->arenas[i]->retain = n;
+        ncx_slab_release_retained(pool->arenas[i], NULL, n);
+    }
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+/*
+ * 每段连续的, 未回收且空闲够久的中间页调用一次 madvise.
+ * 中间页都已回收或最早的未回收页也不够久的块看尾页即可整块跳过;
+ * 检查过的块在尾页记下剩余未回收页中最早的时间, 下一次同样跳过.
+ * 一次最多检查 NCX_SLAB_PURGE_WORK 个页描述符, 剩下的块留到下一次
+ */
+
+static void
+ncx_slab_purge_locked(ncx_slab_pool_t *pool, ncx_uint_t now)
+{
+    uintptr_t         since;
+    ncx_uint_t        i, j, k, n, work, dirty;
+    ncx_slab_page_t  *page, *tail;
+
+    pool->purge_last = now;
+    work = 0;
+
+    for (i = ncx_slab_free_index(NCX_SLAB_PURGE_PAGES);
+         i < NCX_SLAB_FREE_LISTS;
+         i++)
+    {
+        for (page = ncx_slab_next(pool, &pool->free[i]);
+             page != &pool->free[i];
+             page = ncx_slab_next(pool, page))
+        {
+            n = page->slab - 1;
+            tail = &page[n];
+
+            if ((tail->prev & NCX_SLAB_PAGE_PURGED)
+                || ncx_slab_page_idle(tail, now) < pool->purge_decay)
+            {
+                continue;
+            }
+
+            if (work >= NCX_SLAB_PURGE_WORK) {
+                return;
+            }
+
+            work += n;
+            since = now;
+            dirty = 0;
+
+            for (j = 1; j < n; j = k + 1) {
+
+                for (k = j;
+                     k < n && !(page[k].prev & NCX_SLAB_PAGE_PURGED)
+                     && ncx_slab_page_idle(&page[k], now) >= pool->purge_decay;
+                     k++)
+                { /* void */ }
+
+                if (k > j) {
+                    ncx_slab_purge_pages(pool, &page[j], k - j);
+
+                    // madvise 不可用, 已关闭回收
+                    if (pool->purge_decay == 0) {
+                        return;
+                    }
+                }
+
+                // 停在还不够久的页上
+                if (k < n && !(page[k].prev & NCX_SLAB_PAGE_PURGED)) {
+                    dirty = 1;
+
+                    if (ncx_slab_page_time(&page[k]) < since) {
+                        since = ncx_slab_page_time(&page[k]);
+                    }
+                }
+            }
+
+            tail->prev = dirty ? NCX_SLAB_PAGE | (since << NCX_SLAB_IDLE_SHIFT)
+                               : NCX_SLAB_PAGE | NCX_SLAB_PAGE_PURGED;
+        }
+    }
+}
+
+
+static void
+ncx_slab_purge_pages(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t n)
+{
+    u_char      *p;
+    size_t       len;
+    ncx_uint_t   i;
+
+    p = ncx_slab_page_addr(pool, page);
+    len = (size_t) n << pool->pagesize_shift;
+
+    // 共享内存不支持 MADV_FREE, 私有内存不支持 MADV_REMOVE, 失败时依次换用
+    while (madvise(p, len, pool->purge_advice) == -1) {
+
+        if (pool->purge_advice == MADV_FREE) {
+            pool->purge_advice = MADV_REMOVE;
+
+        } else if (pool->purge_advice == MADV_REMOVE) {
+            pool->purge_advice = MADV_DONTNEED;
+
+        } else {
+            error("ncx_slab_purge(): madvise(%p, %zu) failed", p, len);
+            pool->purge_decay = 0;
+            return;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        page[i].prev |= NCX_SLAB_PAGE_PURGED;
+    }
+
+    pool->purged_pages += n;
+}
+
+
+static ncx_uint_t
+ncx_slab_msec(void)
+{
+    struct timespec  ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (ncx_uint_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * 自己映射池所在的内存: 指定 NCX_SLAB_HUGEPAGE 时先尝试 MAP_HUGETLB,
+ * 失败则映射2M对齐的普通内存并 madvise(MADV_HUGEPAGE) 交给透明大页;
+ * pool->start 对齐到大页边界, 实际得到的内存类型记录在 pool->backing
+ */
+
+ncx_slab_pool_t *
+ncx_slab_create(size_t size, size_t pagesize, ncx_uint_t flags)
+{
+    ncx_slab_pool_t  *pool;
+
+    // 新增的arena只映射在当前进程, 共享池的其他进程看不到
+    if ((flags & (NCX_SLAB_GROW|NCX_SLAB_SHARED))
+        == (NCX_SLAB_GROW|NCX_SLAB_SHARED))
+    {
+        error("ncx_slab_create(): NCX_SLAB_GROW with NCX_SLAB_SHARED");
+        return NULL;
+    }
+
+    pool = ncx_slab_create_pool(size, pagesize, flags, 3);
+
+    if (pool && (flags & NCX_SLAB_GROW)) {
+        pool->grow_size = ncx_slab_end(pool) - (u_char *) pool;
+        pool->grow_limit = pool->grow_size * (NCX_SLAB_ARENAS + 1);
+        pool->grow_flags = flags & NCX_SLAB_HUGEPAGE;
+    }
+
+    return pool;
+}
+
+
+/*
+ * 可增长池的设置: 之后新增的arena大小为 arena_size(0则不变),
+ * 自身和所有arena加起来不超过 limit 字节, limit 为0时不再增长
+ */
+
+void
+ncx_slab_grow_limit(ncx_slab_pool_t *pool, size_t arena_size, size_t limit)
+{
+    ncx_shmtx_lock(&pool->mutex);
+
+    if (arena_size) {
+        pool->grow_size = arena_size;
+    }
+
+    pool->grow_limit = limit;
+
+    ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+static ncx_slab_pool_t *
+ncx_slab_create_pool(size_t size, size_t pagesize, ncx_uint_t flags,
+    size_t min_shift)
+{
+    int               mflags;
+    size_t            len;
+    u_char           *addr, *p;
+    ncx_uint_t        backing;
+    ncx_slab_pool_t  *pool;
+
+    mflags = MAP_ANONYMOUS
+             | ((flags & NCX_SLAB_SHARED) ? MAP_SHARED : MAP_PRIVATE);
+
+    addr = MAP_FAILED;
+    backing = NCX_SLAB_BACKING_PAGES;
+
+    if (flags & NCX_SLAB_HUGEPAGE) {
+
+        size = ncx_align(size, NCX_SLAB_HUGEPAGE_SIZE);
+
+#ifdef MAP_HUGETLB
+        addr = mmap(NULL, size, PROT_READ|PROT_WRITE, mflags|MAP_HUGETLB,
+                    -1, 0);
+        if (addr != MAP_FAILED) {
+            backing = NCX_SLAB_BACKING_HUGETLB;
+        }
+#endif
+
+        if (addr == MAP_FAILED) {
+
+            // 多映射一个大页用于对齐, 再把两头多余的部分还回去
+            len = size + NCX_SLAB_HUGEPAGE_SIZE;
+
+            p = mmap(NULL, len, PROT_READ|PROT_WRITE, mflags, -1, 0);
+            if (p == MAP_FAILED) {
+                goto failed;
+            }
+
+            addr = ncx_align_ptr(p, NCX_SLAB_HUGEPAGE_SIZE);
+
+            if (addr != p) {
+                munmap(p, addr - p);
+            }
+
+            munmap(addr + size, p + len - (addr + size));
+
+#ifdef MADV_HUGEPAGE
+            if (madvise(addr, size, MADV_HUGEPAGE) == 0
+                && ncx_slab_thp_enabled(flags))
+            {
+                backing = NCX_SLAB_BACKING_THP;
+            }
+#endif
+        }
+
+    } else {
+        addr = mmap(NULL, size, PROT_READ|PROT_WRITE, mflags, -1, 0);
+    }
+
+    if (addr == MAP_FAILED) {
+        goto failed;
+    }
+
+    pool = (ncx_slab_pool_t *) addr;
+
+    pool->addr = addr;
+    pool->min_shift = min_shift;
+    pool->end = addr + size;
+
+    ncx_slab_init_pool(pool, pagesize, (flags & NCX_SLAB_HUGEPAGE)
+                                       ? NCX_SLAB_HUGEPAGE_SIZE : 0);
+
+    pool->backing = backing;
+
+    return pool;
+
+failed:
+
+    error("ncx_slab_create(): mmap(%zu) failed", size);
+
+    return NULL;
+}
+
+
+void
+ncx_slab_destroy(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t        i;
+    ncx_slab_pool_t  *arena;
+
+    ncx_slab_tcache_flush(pool);
+
+#if (NCX_SLAB_TCACHE)
+    ncx_slab_tcache_drop(pool);
+#endif
+
+    for (i = 0; i < pool->narenas; i++) {
+        arena = pool->arenas[i];
+        munmap(arena, ncx_slab_end(arena) - (u_char *) arena);
+    }
+
+    // pool->addr 是创建者进程中的地址, NCX_SLAB_PIC 时别的进程映射在别处
+    munmap(pool, ncx_slab_end(pool) - (u_char *) pool);
+}
+
+
+/*
+ * 文件池: 池放在 path 文件的 MAP_SHARED 映射中, 进程重启后直接挂载
+ * 上次的分配状态. 文件不存在或为空时按 size/pagesize 新建; 否则检查头部的
+ * magic, 版本和大小 (size/pagesize 为0表示沿用文件中的). 上次由
+ * ncx_slab_close() 正常关闭的直接使用, 与池大小无关; 否则先扫描页数组修复.
+ * 未开启 NCX_SLAB_PIC 时要映射回原来的地址.
+ * 文件用 flock 独占, 同一时间只能有一个进程(及其fork出的子进程)使用
+ */
+
+ncx_slab_pool_t *
+ncx_slab_open(const char *path, size_t size, size_t pagesize)
+{
+    int               fd;
+    struct stat       st;
+    ncx_slab_pool_t  *pool;
+
+    fd = open(path, O_RDWR|O_CREAT, 0600);
+    if (fd == -1) {
+        error("ncx_slab_open(): open(\"%s\") failed", path);
+        return NULL;
+    }
+
+    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+        error("ncx_slab_open(): \"%s\" is in use", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        error("ncx_slab_open(): fstat(\"%s\") failed", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        pool = ncx_slab_file_create(fd, size, pagesize);
+
+    } else {
+        pool = ncx_slab_file_attach(fd, st.st_size, size, pagesize);
+    }
+
+    if (pool == NULL) {
+        error("ncx_slab_open(): cannot use \"%s\"", path);
+        close(fd);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+static ncx_slab_pool_t *
+ncx_slab_file_create(int fd, size_t size, size_t pagesize)
+{
+    u_char           *addr;
+    ncx_slab_pool_t  *pool;
+
+    if (size < sizeof(ncx_slab_pool_t) || ftruncate(fd, size) == -1) {
+        error("ncx_slab_open(): cannot create a pool of %zu bytes", size);
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        error("ncx_slab_open(): mmap(%zu) failed", size);
+        return NULL;
+    }
+
+    pool = (ncx_slab_pool_t *) addr;
+
+    pool->addr = addr;
+    pool->min_shift = 3;
+    pool->end = addr + size;
+
+    ncx_slab_init_pool(pool, pagesize, 0);
+
+    if (pool->real_pages == 0) {
+        munmap(addr, size);
+        return NULL;
+    }
+
+    pool->backing = NCX_SLAB_BACKING_FILE;
+    pool->fd = fd;
+
+    pool->version = ncx_slab_version();
+    pool->state = NCX_SLAB_DIRTY;
+    pool->magic = NCX_SLAB_MAGIC;
+
+    return pool;
+}
+
+
+static ncx_slab_pool_t *
+ncx_slab_file_attach(int fd, size_t len, size_t size, size_t pagesize)
+{
+    int               flags;
+    u_char           *addr, *hint;
+    ncx_slab_pool_t   hdr, *pool;
+
+    if (pread(fd, &hdr, sizeof(ncx_slab_pool_t), 0)
+        != (ssize_t) sizeof(ncx_slab_pool_t)
+        || hdr.magic != NCX_SLAB_MAGIC)
+    {
+        error("ncx_slab_open(): not a pool file");
+        return NULL;
+    }
+
+    if (hdr.version != ncx_slab_version()) {
+        error("ncx_slab_open(): pool version %#x, expected %#x",
+              hdr.version, ncx_slab_version());
+        return NULL;
+    }
+
+    if ((size && size != len) || (pagesize && pagesize != hdr.pagesize)) {
+        error("ncx_slab_open(): pool is %zu bytes with %zu byte pages",
+              len, (size_t) hdr.pagesize);
+        return NULL;
+    }
+
+    flags = MAP_SHARED;
+
+#if (NCX_SLAB_PIC)
+    hint = NULL;
+#else
+    // 池内保存的是绝对地址, 只能映射回原处
+    hint = hdr.addr;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+#endif
+
+    addr = mmap(hint, len, PROT_READ|PROT_WRITE, flags, fd, 0);
+    if (addr == MAP_FAILED) {
+        error("ncx_slab_open(): mmap(%zu) failed", len);
+        return NULL;
+    }
+
+    pool = (ncx_slab_pool_t *) addr;
+
+    if ((hint && addr != hint)
+        || (size_t) (ncx_slab_end(pool) - addr) != len)
+    {
+        error("ncx_slab_open(): pool cannot be mapped at %p again", hint);
+        munmap(addr, len);
+        return NULL;
+    }
+
+    pool->addr = addr;
+    pool->fd = fd;
+
+    // 上一个进程可能持锁退出, 线程缓存中的chunk也随之丢失
+    ncx_shmtx_init(&pool->mutex);
+
+#if (NCX_SLAB_TCACHE)
+    ncx_slab_tcache_drop(pool);
+#endif
+
+    if (pool->state != NCX_SLAB_CLEAN) {
+        info("ncx_slab_open(): pool was not closed cleanly, repairing");
+        ncx_slab_repair(pool);
+    }
+
+    pool->tcache_size = 0;
+    pool->state = NCX_SLAB_DIRTY;
+
+    return pool;
+}
+
+
+/*
+ * 关闭文件池: 写回全部修改后才标记为正常关闭, 下次打开不必修复.
+ * 调用前其他线程应已停止使用该池, 它们线程缓存中的chunk不会被写回
+ */
+
+void
+ncx_slab_close(ncx_slab_pool_t *pool)
+{
+    int     fd;
+    size_t  len;
+
+    ncx_slab_tcache_flush(pool);
+
+#if (NCX_SLAB_TCACHE)
+    ncx_slab_tcache_drop(pool);
+#endif
+
+    fd = pool->fd;
+    len = ncx_slab_end(pool) - (u_char *) pool;
+
+    msync(pool, len, MS_SYNC);
+
+    pool->state = NCX_SLAB_CLEAN;
+    msync(pool, sizeof(ncx_slab_pool_t), MS_SYNC);
+
+    munmap(pool, len);
+
+    // 同时释放 flock
+    close(fd);
+}
+
+
+/* 根对象: 文件池重新挂载后, 由它找到上次放在池中的数据 */
+
+void
+ncx_slab_set_root(ncx_slab_pool_t *pool, void *root)
+{
+    pool->root = ncx_slab_off(pool, root);
+}
+
+
+void *
+ncx_slab_root(ncx_slab_pool_t *pool)
+{
+    return ncx_slab_addr(pool, pool->root);
+}
+
+
+/*
+ * 异常退出后由页数组重建其余的状态: 空闲链表, slot链表, 保留的空slab,
+ * 对象缓存的链表以及各项计数. 页描述符的类型和位图是可信的; 拿到页后还没
+ * 切分完的slab表现为整页分配, 只会泄漏不会重复分配; 认不出的页当作空闲页
+ */
+
+static void
+ncx_slab_repair(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t         i, n, now;
+    ncx_slab_page_t   *page, *slots, *free;
+    ncx_slab_class_t  *cls;
+    ncx_slab_cache_t  *cache;
+
+    now = ncx_slab_msec();
+
+    slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
+
+    for (i = 0; i < pool->nclasses; i++) {
+        slots[i].next = ncx_slab_off(pool, &slots[i]);
+
+        cls = &ncx_slab_classes(pool)[i];
+        cls->used = 0;
+        cls->slabs = 0;
+        cls->empty = NULL;
+        cls->retained = 0;
+    }
+
+    for (i = 0; i < NCX_SLAB_FREE_LISTS; i++) {
+        pool->free[i].next = ncx_slab_off(pool, &pool->free[i]);
+    }
+
+    pool->free_map = 0;
+    pool->free_pages = pool->real_pages - pool->carved;
+    pool->large_pages = 0;
+    pool->cache_pages = 0;
+    pool->cache_used = 0;
+    pool->purged_pages = 0;
+
+    // 对象缓存只能经由slab首页找到, 先清空它们的链表和计数
+    for (i = 0; i < pool->carved; i++) {
+        page = &ncx_slab_pages(pool)[i];
+
+        if ((page->prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_CACHE
+            && page->slab != NCX_SLAB_PAGE_BUSY)
+        {
+            cache = ncx_slab_addr(pool, page->slab);
+
+            cache->partial.next = ncx_slab_off(pool, &cache->partial);
+            cache->empty = 0;
+            cache->cls.used = 0;
+            cache->cls.slabs = 0;
+        }
+    }
+
+    free = NULL;
+
+    for (i = 0; i < pool->carved; i += n) {
+        page = &ncx_slab_pages(pool)[i];
+
+        if (ncx_slab_repair_page(pool, page, &n)) {
+            continue;
+        }
+
+        // 相邻的空闲页合成一块
+        if (free && free + free->slab == page) {
+            free->slab += n;
+            continue;
+        }
+
+        if (free) {
+            ncx_slab_repair_free(pool, free, now);
+        }
+
+        free = page;
+        free->slab = n;
+    }
+
+    if (free) {
+        ncx_slab_repair_free(pool, free, now);
+    }
+
+    ncx_slab_release_retained(pool, NULL, pool->retain);
+}
+
+
+/* 页(slab/run/整页分配的首页)在使用中时返回 true; pages 为占用或空闲的页数 */
+
+static bool
+ncx_slab_repair_page(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t *pages)
+{
+    bool               full;
+    size_t             size;
+    uintptr_t          type, slab, mask, *bitmap;
+    ncx_uint_t         i, n, slot, map, left;
+    ncx_slab_page_t   *slots;
+    ncx_slab_class_t  *cls;
+    ncx_slab_cache_t  *cache;
+
+    type = page->prev & NCX_SLAB_PAGE_MASK;
+    slab = page->slab;
+    left = pool->carved - (page - ncx_slab_pages(pool));
+
+    *pages = 1;
+
+    switch (type) {
+
+    case NCX_SLAB_PAGE:
+
+        if (page->prev == NCX_SLAB_PAGE && (slab & NCX_SLAB_PAGE_START)) {
+            n = slab & ~NCX_SLAB_PAGE_START;
+
+            if (n == 0 || n > left) {
+                return false;
+            }
+
+            for (i = 1; i < n; i++) {
+                page[i].slab = NCX_SLAB_PAGE_BUSY;
+                page[i].next = NULL;
+                page[i].prev = NCX_SLAB_PAGE;
+            }
+
+            pool->large_pages += n;
+            *pages = n;
+
+            return true;
+        }
+
+        // 空闲块首页; 中间页和尾页只有在前一块的长度不对时才会走到, 按单页处理
+        if (page->next && slab && slab <= left) {
+            *pages = slab;
+        }
+
+        return false;
+
+    case NCX_SLAB_CACHE:
+
+        if (slab == NCX_SLAB_PAGE_BUSY) {
+            return false;
+        }
+
+        cache = ncx_slab_addr(pool, slab);
+        cls = &cache->cls;
+
+        if (cls->pages > left) {
+            return false;
+        }
+
+        // 已用数以位图为准
+        bitmap = (uintptr_t *) ncx_slab_page_addr(pool, page);
+        map = (cls->chunks + sizeof(uintptr_t) * 8 - 1)
+              / (sizeof(uintptr_t) * 8);
+
+        for (n = 0, i = 1; i <= map; i++) {
+            n += ncx_popcount(bitmap[i]);
+        }
+
+        bitmap[0] = n;
+
+        for (i = 1; i < cls->pages; i++) {
+            page[i].slab = NCX_SLAB_PAGE_BUSY;
+            page[i].next = ncx_slab_off(pool, page);
+            page[i].prev = NCX_SLAB_CACHE;
+        }
+
+        cls->slabs++;
+        cls->used += n;
+        cache->empty += (n == 0);
+
+        pool->cache_pages += cls->pages;
+        pool->cache_used += n * cls->size;
+
+        if (n == cls->chunks) {
+            page->next = NULL;
+            page->prev = NCX_SLAB_CACHE;
+
+        } else {
+            page->next = cache->partial.next;
+            cache->partial.next = ncx_slab_off(pool, page);
+
+            page->prev = ncx_slab_link(pool, &cache->partial, NCX_SLAB_CACHE);
+            ncx_slab_next(pool, page)->prev =
+                ncx_slab_link(pool, page, NCX_SLAB_CACHE);
+        }
+
+        *pages = cls->pages;
+
+        return true;
+
+    case NCX_SLAB_SMALL:
+    case NCX_SLAB_EXACT:
+    case NCX_SLAB_BIG:
+    case NCX_SLAB_RUN:
+        break;
+
+    default:
+        return false;
+    }
+
+    slot = (type == NCX_SLAB_EXACT) ? ncx_slab_slot(pool, pool->exact_size)
+                                    : slab & NCX_SLAB_CLASS_MASK;
+
+    if (slot >= pool->nclasses) {
+        return false;
+    }
+
+    cls = &ncx_slab_classes(pool)[slot];
+    size = cls->size;
+
+    // 类型要与class大小相符, 正在释放的页 slab 已被改成页数
+    if ((type == NCX_SLAB_SMALL && size >= pool->exact_size)
+        || (type == NCX_SLAB_BIG
+            && (size <= pool->exact_size || size > pool->max_size))
+        || (type == NCX_SLAB_RUN && size <= pool->max_size)
+        || cls->pages > left)
+    {
+        return false;
+    }
+
+    if (type == NCX_SLAB_SMALL) {
+        bitmap = (uintptr_t *) ncx_slab_page_addr(pool, page);
+        map = ncx_slab_map(cls);
+
+        // 位图自身和页尾放不下chunk的位一定为1
+        for (i = 0; i < cls->reserved / (sizeof(uintptr_t) * 8); i++) {
+            bitmap[i] = NCX_SLAB_BUSY;
+        }
+
+        bitmap[i] |= ((uintptr_t) 1
+                      << (cls->reserved % (sizeof(uintptr_t) * 8))) - 1;
+
+        if (cls->chunks % (sizeof(uintptr_t) * 8)) {
+            bitmap[map - 1] |= ~(((uintptr_t) 1
+                                  << (cls->chunks % (sizeof(uintptr_t) * 8)))
+                                 - 1);
+        }
+
+        full = true;
+
+        for (n = 0, i = 0; i < map; i++) {
+            n += ncx_popcount(bitmap[i]);
+            full = full && bitmap[i] == NCX_SLAB_BUSY;
+        }
+
+        n -= cls->reserved + map * sizeof(uintptr_t) * 8 - cls->chunks;
+
+        // 从第一个位图字开始找空闲位
+        page->slab = slot;
+
+    } else if (type == NCX_SLAB_EXACT) {
+        n = ncx_popcount(slab);
+        full = (slab == NCX_SLAB_BUSY);
+
+    } else {
+        mask = (((uintptr_t) 1 << cls->chunks) - 1) << NCX_SLAB_MAP_SHIFT;
+
+        page->slab = (slab & mask) | slot;
+
+        n = ncx_popcount(slab & mask);
+        full = ((slab & mask) == mask);
+    }
+
+    for (i = 1; i < cls->pages; i++) {
+        page[i].slab = NCX_SLAB_PAGE_BUSY;
+        page[i].next = ncx_slab_off(pool, page);
+        page[i].prev = NCX_SLAB_RUN;
+    }
+
+    cls->slabs++;
+    cls->used += n;
+
+    if (full) {
+        page->next = NULL;
+        page->prev = type;
+
+    } else if (n == 0) {
+        // 先全部保留, 超出上限的最后统一归还
+        page->next = cls->empty;
+        page->prev = type;
+
+        cls->empty = ncx_slab_off(pool, page);
+        cls->retained++;
+
+    } else {
+        slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
+
+        page->next = slots[slot].next;
+        slots[slot].next = ncx_slab_off(pool, page);
+
+        page->prev = ncx_slab_link(pool, &slots[slot], type);
+        ncx_slab_next(pool, page)->prev = ncx_slab_link(pool, page, type);
+    }
+
+    *pages = cls->pages;
+
+    return true;
+}
+
+
+/* 重建一个空闲块: 中间页只保留空闲时间和回收标记, 残留的首尾页信息清掉 */
+
+static void
+ncx_slab_repair_free(ncx_slab_pool_t *pool, ncx_slab_page_t *page,
+    ncx_uint_t now)
+{
+    ncx_uint_t  i;
+
+    for (i = 1; i + 1 < page->slab; i++) {
+
+        if (page[i].slab == NCX_SLAB_PAGE_FREE && page[i].next == NULL
+            && (page[i].prev & NCX_SLAB_PAGE_MASK) == NCX_SLAB_PAGE)
+        {
+            if (page[i].prev & NCX_SLAB_PAGE_PURGED) {
+                pool->purged_pages++;
+            }
+
+            continue;
+        }
+
+        ncx_slab_idle_pages(&page[i], 1, now);
+    }
+
+    pool->free_pages += page->slab;
+
+    ncx_slab_free_insert(pool, page);
+}
+
+
+/*
+ * 可增长池自身用满后, 依次在已有的arena中分配, 都不够时映射新的arena.
+ * 各arena只维护自己的页和class计数, requested/consumed 和失败次数记在 pool 上.
+ * 调用时持有 pool 的锁, arena 自己的锁不使用
+ */
+
+static ncx_uint_t
+ncx_slab_arena_alloc(ncx_slab_pool_t *pool, size_t size, ncx_uint_t n,
+    void **out)
+{
+    ncx_uint_t        i, k;
+    ncx_slab_pool_t  *arena;
+
+    k = 0;
+
+    for (i = 0; i < pool->narenas && k < n; i++) {
+        k += ncx_slab_alloc_objs(pool->arenas[i], size, n - k, &out[k]);
+    }
+
+    while (k < n) {
+        arena = ncx_slab_arena_grow(pool, size);
+        if (arena == NULL) {
+            break;
+        }
+
+        i = ncx_slab_alloc_objs(arena, size, n - k, &out[k]);
+
+        // 新的arena也放不下
+        if (i == 0) {
+            break;
+        }
+
+        k += i;
+    }
+
+    return k;
+}
+
+
+static ncx_slab_pool_t *
+ncx_slab_arena_grow(ncx_slab_pool_t *pool, size_t size)
+{
+    size_t            len, total;
+    ncx_uint_t        i;
+    ncx_slab_pool_t  *arena;
+
+    if (pool->narenas == NCX_SLAB_ARENAS || size > pool->grow_limit) {
+        return NULL;
+    }
+
+    // 单个请求较大时, arena 要能放下它和页描述符等开销
+    len = pool->grow_size;
+
+    if (len < 2 * size) {
+        len = ncx_align(2 * size, pool->pagesize);
+    }
+
+    total = ncx_slab_end(pool) - (u_char *) pool;
+
+    for (i = 0; i < pool->narenas; i++) {
+        total += ncx_slab_end(pool->arenas[i]) - (u_char *) pool->arenas[i];
+    }
+
+    if (total + len > pool->grow_limit) {
+        error("ncx_slab_alloc(): grow limit %zu reached", pool->grow_limit);
+        return NULL;
+    }
+
+    // 页大小和最小分配单元与 pool 相同, size class 表也就相同
+    arena = ncx_slab_create_pool(len, pool->pagesize, pool->grow_flags,
+                                 pool->min_shift);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->purge_decay = pool->purge_decay;
+    arena->purge_advice = pool->purge_advice;
+    arena->retain = pool->retain;
+
+    for (i = pool->narenas;
+         i && ncx_slab_start(pool->arenas[i - 1]) > ncx_slab_start(arena);
+         i--)
+    {
+        pool->arenas[i] = pool->arenas[i - 1];
+    }
+
+    pool->arenas[i] = arena;
+    pool->narenas++;
+
+    return arena;
+}
+
+
+/* p 所在的arena, 按地址二分查找 */
+
+static ncx_slab_pool_t *
+ncx_slab_arena_find(ncx_slab_pool_t *pool, void *p)
+{
+    ncx_uint_t        lo, hi, mid;
+    ncx_slab_pool_t  *arena;
+
+    lo = 0;
+    hi = pool->narenas;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        arena = pool->arenas[mid];
+
+        if ((u_char *) p < ncx_slab_start(arena)) {
+            hi = mid;
+
+        } else if ((u_char *) p >= ncx_slab_end(arena)) {
+            lo = mid + 1;
+
+        } else {
+            return arena;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* MADV_HUGEPAGE 成功并不代表能拿到大页, 还要看透明大页是否被禁用 */
+
+static bool
+ncx_slab_thp_enabled(ncx_uint_t flags)
+{
+    int      fd;
+    char     buf[128];
+    ssize_t  n;
+
+    fd = open((flags & NCX_SLAB_SHARED)
+              ? "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+              : "/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = '\0';
+
+    return strstr(buf, "[never]") == NULL && strstr(buf, "[deny]") == NULL;
+}
+
+
+/*
+ * p 所在chunk的实际可用大小, 即其size class或按页分配的字节数.
+ * p 必须是已分配出去的chunk的起始地址; 不在池内时返回0
+ */
+
+size_t
+ncx_slab_usable_size(ncx_slab_pool_t *pool, void *p)
+{
+    ncx_uint_t        n;
+    ncx_slab_page_t  *page;
+
+    if ((u_char *) p < ncx_slab_start(pool)
+        || (u_char *) p >= ncx_slab_end(pool))
+    {
+
+        if (pool->narenas && ncx_slab_arena_find(pool, p)) {
+            return ncx_slab_usable_size(ncx_slab_arena_find(pool, p), p);
+        }
+
+        return 0;
+    }
+
+    n = ((u_char *) p - ncx_slab_start(pool)) >> pool->pagesize_shift;
+
+    if (n >= pool->carved) {
+        return 0;
+    }
+
+    page = &ncx_slab_pages(pool)[n];
+
+    switch (page->prev & NCX_SLAB_PAGE_MASK) {
+
+    case NCX_SLAB_EXACT:
+        return pool->exact_size;
+
+    case NCX_SLAB_CACHE:
+        if (page->slab == NCX_SLAB_PAGE_BUSY) {
+            page = ncx_slab_next(pool, page);
+        }
+
+        return ((ncx_slab_cache_t *) ncx_slab_addr(pool, page->slab))->cls.size;
+
+    case NCX_SLAB_RUN:
+        if (page->slab == NCX_SLAB_PAGE_BUSY) {
+            page = ncx_slab_next(pool, page);
+        }
+
+        /* fall through */
+
+    case NCX_SLAB_SMALL:
+    case NCX_SLAB_BIG:
+        return ncx_slab_classes(pool)[page->slab & NCX_SLAB_CLASS_MASK].size;
+
+    default: /* NCX_SLAB_PAGE */
+
+        if (page->slab == NCX_SLAB_PAGE_BUSY
+            || !(page->slab & NCX_SLAB_PAGE_START))
+        {
+            return 0;
+        }
+
+        return (page->slab & ~NCX_SLAB_PAGE_START) << pool->pagesize_shift;
+    }
+}
+
+
+void
+ncx_slab_dummy_init(ncx_slab_pool_t *pool)
+{
+    ncx_slab_geometry(pool, 0);
+}
+
+
+/*
+ * 页大小及由它决定的各个分界点, 每个池单独保存.
+ * pagesize 为0时使用系统页大小, 否则必须是2的幂, 且一页至少能放下
+ * 一个uintptr_t位数个最小分配单元, 最大 NCX_SLAB_MAX_PAGESIZE
+ */
+
+static void
+ncx_slab_geometry(ncx_slab_pool_t *pool, size_t pagesize)
+{
+    ncx_uint_t n;
+
+    if (pagesize & (pagesize - 1)
+        || (pagesize && pagesize < ((8 * sizeof(uintptr_t)) << pool->min_shift))
+        || pagesize > NCX_SLAB_MAX_PAGESIZE)
+    {
+        error("ncx_slab_init(): invalid page size %zu", pagesize);
+        pagesize = 0;
+    }
+
+	pool->pagesize = pagesize ? pagesize : (size_t) getpagesize();//4K
+	for (n = pool->pagesize, pool->pagesize_shift = 0; 
+			n >>= 1; pool->pagesize_shift++) { /* void */ }
+
+    // 最大分配空间为页大小的一半
+    pool->max_size = pool->pagesize / 2;//2K
+    // 精确分配大小，8为一个字节的位数，sizeof(uintptr_t)为一个uintptr_t的字节，我们后面会根据这个size来判断使用不同的分配算法 
+    pool->exact_size = pool->pagesize / (8 * sizeof(uintptr_t));//64  uintptr_t 类型的位图变量表示的页划分
+    // 计算出此精确分配的移位数
+    for (n = pool->exact_size, pool->exact_shift = 0;
+            n >>= 1; pool->exact_shift++) { /* void */ }
+
+    // 页内切分的class最大正好是max_size, 之后按同样的间隔划分run class,
+    // 直到一个run放不下2个chunk
+    pool->nclasses = ncx_slab_slot(pool, pool->max_size) + 1;
+
+    while (ncx_slab_run_pages(pool,
+                              ncx_slab_class_size(pool, pool->nclasses)))
+    {
+        pool->nclasses++;
+    }
+
+    pool->run_size = ncx_slab_class_size(pool, pool->nclasses - 1);
+}
+
+/*
+ * 遍历整个页数组重新统计, 并与增量维护的计数核对 (校验模式).
+ * 可增长池的各arena一并统计. 遍历和读计数都在锁内, 其他进程/线程同时
+ * 分配释放不会造成误报; 调用者不能已持有池锁. 计数不一致时返回 -1
+ */
+
+ncx_int_t
+ncx_slab_stat(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat)
+{
+	ncx_uint_t 			i;
+	ncx_slab_stat_t 	counters, s;
+
+	ncx_shmtx_lock(&pool->mutex);
+
+	ncx_slab_stat_walk(pool, stat);
+
+	for (i = 0; i < pool->narenas; i++) {
+		ncx_slab_stat_walk(pool->arenas[i], &s);
+		ncx_slab_stat_add(stat, &s);
+	}
+
+	ncx_slab_stat_counters(pool, &counters);
+
+	ncx_shmtx_unlock(&pool->mutex);
+
+	info("pool_size : %zu bytes",	stat->pool_size);
+	info("used_size : %zu bytes",	stat->used_size);
+	info("used_pct  : %zu%%",		stat->used_pct);
+	info("cached    : %zu bytes",	stat->cached_size);
+	info("requested : %zu bytes, consumed : %zu bytes\n",
+		 stat->requested_size, stat->consumed_size);
+
+	info("total page count : %zu",	stat->pages);
+	info("free page count  : %zu",	stat->free_page);
+	info("purged page count: %zu",	stat->purged_page);
+	info("retained page count: %zu\n",	stat->retained_page);
+		
+	info("small slab use page : %zu,\tbytes : %zu",	stat->p_small, stat->b_small);	
+	info("exact slab use page : %zu,\tbytes : %zu",	stat->p_exact, stat->b_exact);
+	info("big   slab use page : %zu,\tbytes : %zu",	stat->p_big,   stat->b_big);	
+	info("run   slab use page : %zu,\tbytes : %zu",	stat->p_run,   stat->b_run);
+	info("page slab use page  : %zu,\tbytes : %zu",	stat->p_page,  stat->b_page);
+	info("cache slab use page : %zu,\tbytes : %zu\n",	stat->p_cache, stat->b_cache);
+
+	info("max free pages : %zu\n",		stat->max_free_pages);
+
+	// 计数给出的最大空闲块只是下限, 不超过实际值即可
+	if (counters.max_free_pages > stat->max_free_pages) {
+		alert("ncx_slab_stat(): max free pages %zu, counters %zu",
+			  stat->max_free_pages, counters.max_free_pages);
+		return -1;
+	}
+
+	counters.max_free_pages = stat->max_free_pages;
+
+	if (memcmp(stat, &counters, sizeof(ncx_slab_stat_t)) != 0) {
+		alert("ncx_slab_stat(): counters mismatch, used %zu/%zu, free pages %zu/%zu",
+			  stat->used_size, counters.used_size,
+			  stat->free_page, counters.free_page);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* 单个arena的页数组遍历 */
+
+static void
+ncx_slab_stat_walk(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat)
+{
+	uintptr_t 			n, slab;
+	uintptr_t 			*bitmap;
+	ncx_uint_t 			i, j, map, type, obj_size;
+	ncx_slab_page_t 	*page;
+	ncx_slab_class_t 	*cls;
+
+	ncx_memzero(stat, sizeof(ncx_slab_stat_t));
+
+	page = ncx_slab_pages(pool);
+ 	stat->pages = (ncx_slab_end(pool) - ncx_slab_start(pool)) / pool->pagesize;;
+
+	// carved 之后的页描述符未初始化, 整段按一个空闲块计
+	for (i = 0; i < pool->carved; i++)
+	{
+		slab = page->slab;
+		type = page->prev & NCX_SLAB_PAGE_MASK;
+
+		switch (type) {
+
+			case NCX_SLAB_SMALL:
+	
+				n = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+                bitmap = (uintptr_t *) (ncx_slab_start(pool) + n);
+
+				cls = &ncx_slab_classes(pool)[slab & NCX_SLAB_CLASS_MASK];
+				map = ncx_slab_map(cls);
+
+				for (n = 0, j = 0; j < map; j++) {
+					n += ncx_popcount(bitmap[j]);
+				}
+
+				// 去掉位图自身和页尾放不下chunk的位
+				n -= cls->reserved + map * sizeof(uintptr_t) * 8 - cls->chunks;
+
+				stat->used_size += n * cls->size;
+				stat->b_small   += n * cls->size;
+	
+				stat->p_small++;
+				stat->retained_page += (n == 0);
+
+				break;
+
+			case NCX_SLAB_EXACT:
+
+				stat->used_size += ncx_popcount(slab) * pool->exact_size;
+				stat->b_exact   += ncx_popcount(slab) * pool->exact_size;
+
+				stat->p_exact++;
+				stat->retained_page += (slab == 0);
+
+				break;
+
+			case NCX_SLAB_BIG:
+
+				obj_size = ncx_slab_classes(pool)[slab & NCX_SLAB_CLASS_MASK].size;
+
+				stat->used_size += ncx_popcount(slab & NCX_SLAB_MAP_MASK) * obj_size;
+				stat->b_big     += ncx_popcount(slab & NCX_SLAB_MAP_MASK) * obj_size;
+
+				stat->p_big++;
+				stat->retained_page += ((slab & NCX_SLAB_MAP_MASK) == 0);
+
+				break;
+
+			case NCX_SLAB_RUN:
+
+				cls = &ncx_slab_classes(pool)[slab & NCX_SLAB_CLASS_MASK];
+
+				stat->used_size += ncx_popcount(slab & NCX_SLAB_MAP_MASK) * cls->size;
+				stat->b_run     += ncx_popcount(slab & NCX_SLAB_MAP_MASK) * cls->size;
+
+				stat->p_run += cls->pages;
+
+				if ((slab & NCX_SLAB_MAP_MASK) == 0) {
+					stat->retained_page += cls->pages;
+				}
+
+				i += (cls->pages - 1);
+
+				break;
+
+			case NCX_SLAB_CACHE:
+
+				// 首页开头是已用对象数
+				n = (page - ncx_slab_pages(pool)) << pool->pagesize_shift;
+				cls = &((ncx_slab_cache_t *) ncx_slab_addr(pool, slab))->cls;
+
+				stat->used_size += *(uintptr_t *) (ncx_slab_start(pool) + n) * cls->size;
+				stat->b_cache   += *(uintptr_t *) (ncx_slab_start(pool) + n) * cls->size;
+
+				stat->p_cache += cls->pages;
+
+				i += (cls->pages - 1);
+
+				break;
+
+			case NCX_SLAB_PAGE:
+
+				if (page->prev == NCX_SLAB_PAGE) {		
+					slab 			=  slab & ~NCX_SLAB_PAGE_START;
+					stat->used_size += slab * pool->pagesize;
+					stat->b_page    += slab * pool->pagesize;
+					stat->p_page    += slab;
+
+					i += (slab - 1);
+
+					break;
+				}
+
+			default:
+
+				if (slab  > stat->max_free_pages) {
+					stat->max_free_pages = page->slab;
+				}
+
+				stat->free_page += slab;
+
+				for (j = 1; j + 1 < slab; j++) {
+					if (page[j].prev & NCX_SLAB_PAGE_PURGED) {
+						stat->purged_page++;
+					}
+				}
+
+				i += (slab - 1);
+
+				break;
+		}
+
+		page = ncx_slab_pages(pool) + i + 1;
+	}
+
+	stat->free_page += pool->real_pages - pool->carved;
+
+	n = ncx_slab_top_pages(pool);
+
+	if (n > stat->max_free_pages) {
+		stat->max_free_pages = n;
+	}
+
+	stat->pool_size = ncx_slab_end(pool) - ncx_slab_start(pool);
+	stat->used_pct = stat->used_size * 100 / stat->pool_size;
+	stat->cached_size = pool->tcache_size;
+	stat->requested_size = pool->requested;
+	stat->consumed_size = pool->consumed;
+}
+
+
+/* 把一个arena的统计 s 累加到 stat 上 */
+
+static void
+ncx_slab_stat_add(ncx_slab_stat_t *stat, ncx_slab_stat_t *s)
+{
+	stat->pool_size += s->pool_size;
+	stat->used_size += s->used_size;
+	stat->pages += s->pages;
+	stat->free_page += s->free_page;
+	stat->purged_page += s->purged_page;
+	stat->retained_page += s->retained_page;
+
+	stat->p_small += s->p_small;
+	stat->p_exact += s->p_exact;
+	stat->p_big += s->p_big;
+	stat->p_page += s->p_page;
+	stat->b_small += s->b_small;
+	stat->b_exact += s->b_exact;
+	stat->b_big += s->b_big;
+	stat->b_page += s->b_page;
+	stat->p_run += s->p_run;
+	stat->b_run += s->b_run;
+	stat->p_cache += s->p_cache;
+	stat->b_cache += s->b_cache;
+
+	if (s->max_free_pages > stat->max_free_pages) {
+		stat->max_free_pages = s->max_free_pages;
+	}
+
+	stat->cached_size += s->cached_size;
+	stat->requested_size += s->requested_size;
+	stat->consumed_size += s->consumed_size;
+
+	stat->used_pct = stat->used_size * 100 / stat->pool_size;
+}
+
+
+/*
+ * 由分配/释放时增量维护的计数得到统计, 不遍历页数组.
+ * 调用者需持有锁
+ */
+
+static void
+ncx_slab_stat_counters(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat)
+{
+	size_t 				b, p;
+	ncx_uint_t 			i, n;
+	ncx_slab_page_t 	*page;
+	ncx_slab_class_t 	*cls;
+	ncx_slab_stat_t 	s;
+
+	ncx_memzero(stat, sizeof(ncx_slab_stat_t));
+
+	for (i = 0; i < pool->nclasses; i++) {
+		cls = &ncx_slab_classes(pool)[i];
+
+		b = cls->used * cls->size;
+		p = cls->slabs * cls->pages;
+
+		stat->retained_page += cls->retained * cls->pages;
+
+		if (cls->size < pool->exact_size) {
+			stat->b_small += b;
+			stat->p_small += p;
+
+		} else if (cls->size == pool->exact_size) {
+			stat->b_exact += b;
+			stat->p_exact += p;
+
+		} else if (cls->pages == 1) {
+			stat->b_big += b;
+			stat->p_big += p;
+
+		} else {
+			stat->b_run += b;
+			stat->p_run += p;
+		}
+	}
+
+	stat->p_page = pool->large_pages;
+	stat->b_page = pool->large_pages << pool->pagesize_shift;
+
+	stat->p_cache = pool->cache_pages;
+	stat->b_cache = pool->cache_used;
+
+	stat->used_size = stat->b_small + stat->b_exact + stat->b_big
+	                  + stat->b_run + stat->b_page + stat->b_cache;
+
+	stat->pages = pool->real_pages;
+	stat->free_page = pool->free_pages;
+	stat->purged_page = pool->purged_pages;
+
+	// carved 之后还没切出的页也是一段空闲页
+	stat->max_free_pages = ncx_slab_top_pages(pool);
+
+	/*
+	 * 最大的空闲块一定在最高的非空桶里, 桶里的块都不短于 1 << i 页;
+	 * 只看桶里的前几个, 得到的是下限, 桶里块不多时即准确值.
+	 * 准确值由 ncx_slab_stat() 遍历页数组得到
+	 */
+	if (pool->free_map) {
+		i = ncx_slab_free_index(pool->free_map);
+
+		for (page = ncx_slab_next(pool, &pool->free[i]), n = 0;
+		     page != &pool->free[i] && n < NCX_SLAB_FREE_SCAN;
+		     page = ncx_slab_next(pool, page), n++)
+		{
+			if (page->slab > stat->max_free_pages) {
+				stat->max_free_pages = page->slab;
+			}
+		}
+	}
+
+	stat->pool_size = ncx_slab_end(pool) - ncx_slab_start(pool);
+	stat->used_pct = stat->used_size * 100 / stat->pool_size;
+	stat->cached_size = pool->tcache_size;
+	stat->requested_size = pool->requested;
+	stat->consumed_size = pool->consumed;
+
+	for (i = 0; i < pool->narenas; i++) {
+		ncx_slab_stat_counters(pool->arenas[i], &s);
+		ncx_slab_stat_add(stat, &s);
+	}
+}
+
+
+void
+ncx_slab_stat_snapshot(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat)
+{
+	ncx_shmtx_lock(&pool->mutex);
+
+	ncx_slab_stat_counters(pool, stat);
 
-	if ((page - pool->pages + page->slab) < ncx_real_pages) {
-		next = page + page->slab;
-		if (ncx_slab_empty(pool, next)) 
+	ncx_shmtx_unlock(&pool->mutex);
+}
+
+
+/* 分配失败计入申请大小对应的class, 超出run class的计入按页分配 */
+
+static void
+ncx_slab_count_fail(ncx_slab_pool_t *pool, size_t size)
+{
+#if (NCX_SLAB_STATS)
+	if (size > pool->run_size) {
+		pool->large_counters.fails++;
+		return;
+	}
+
+	ncx_slab_classes(pool)[ncx_slab_slot(pool, size)].counters.fails++;
+#endif
+}
+
+
+/*
+ * 各size class的使用情况写入cs, 最多n项, 返回写入的项数;
+ * 共 pool->nclasses + 1 项, 最后一项为按页分配.
+ * 未满的slab数需要遍历各slot链表
+ */
+
+ncx_uint_t
+ncx_slab_stat_classes(ncx_slab_pool_t *pool, ncx_slab_class_stat_t *cs,
+    ncx_uint_t n)
+{
+	ncx_uint_t 			i;
+
+	ncx_memzero(cs, n * sizeof(ncx_slab_class_stat_t));
+
+	ncx_shmtx_lock(&pool->mutex);
+
+	ncx_slab_stat_class(pool, cs, n);
+
+	for (i = 0; i < pool->narenas; i++) {
+		ncx_slab_stat_class(pool->arenas[i], cs, n);
+	}
+
+	ncx_shmtx_unlock(&pool->mutex);
+
+	return pool->nclasses < n ? pool->nclasses + 1 : n;
+}
+
+
+/* 把一个arena的各class计数累加到 cs 上, peak 为各arena之和 */
+
+static void
+ncx_slab_stat_class(ncx_slab_pool_t *pool, ncx_slab_class_stat_t *cs,
+    ncx_uint_t n)
+{
+	ncx_uint_t 			i;
+	ncx_slab_page_t 	*slots, *page;
+	ncx_slab_class_t 	*cls;
+
+	slots = (ncx_slab_page_t *) ((u_char *) pool + sizeof(ncx_slab_pool_t));
+
+	for (i = 0; i < pool->nclasses && i < n; i++) {
+		cls = &ncx_slab_classes(pool)[i];
+
+		cs[i].size = cls->size;
+		cs[i].pages = cls->pages;
+		cs[i].used += cls->used;
+		cs[i].slabs += cls->slabs;
+		cs[i].retained += cls->retained;
+
+		for (page = ncx_slab_next(pool, &slots[i]);
+		     page != &slots[i];
+		     page = ncx_slab_next(pool, page))
 		{
-			prev = (ncx_slab_page_t *) (next->prev);
-			prev->next = next->next;
-			next->next->prev = next->prev;
+			cs[i].partial++;
+		}
 
-			page->slab += next->slab;
-			ncx_memzero(next, sizeof(ncx_slab_page_t));
-		}	
+#if (NCX_SLAB_STATS)
+		cs[i].peak += cls->counters.peak;
+		cs[i].allocs += cls->counters.allocs;
+		cs[i].frees += cls->counters.frees;
+		cs[i].fails += cls->counters.fails;
+#endif
 	}
 
+	if (i < n) {
+		cs[i].size = 0;
+		cs[i].pages = 1;
+		cs[i].used += pool->large_pages;
+		cs[i].slabs += pool->large_pages;
+
+#if (NCX_SLAB_STATS)
+		cs[i].peak += pool->large_counters.peak;
+		cs[i].allocs += pool->large_counters.allocs;
+		cs[i].frees += pool->large_counters.frees;
+		cs[i].fails += pool->large_counters.fails;
 #endif
+	}
 }
 
+
+/* 可读的表格 */
+
 void
-ncx_slab_dummy_init(ncx_slab_pool_t *pool)
+ncx_slab_stat_print(ncx_slab_pool_t *pool, FILE *fp)
 {
-    ncx_uint_t n;
+	ncx_uint_t 				i, n;
+	ncx_slab_class_stat_t 	cs[NCX_SLAB_CLASS_MAX];
+
+	n = ncx_slab_stat_classes(pool, cs, NCX_SLAB_CLASS_MAX);
+
+	fprintf(fp, "%8s %5s %10s %10s %8s %8s %8s %12s %12s %8s\n",
+			"size", "pages", "used", "peak", "slabs", "partial", "retained",
+			"allocs", "frees", "fails");
+
+	for (i = 0; i < n; i++) {
+
+		if (cs[i].size == 0) {
+			fprintf(fp, "%8s", "page");
+
+		} else {
+			// 从未使用过的class不输出
+			if (cs[i].slabs == 0 && cs[i].allocs == 0 && cs[i].fails == 0) {
+				continue;
+			}
+
+			fprintf(fp, "%8zu", cs[i].size);
+		}
+
+		fprintf(fp, " %5zu %10zu %10zu %8zu %8zu %8zu %12" PRIu64
+				" %12" PRIu64 " %8" PRIu64 "\n",
+				cs[i].pages, cs[i].used, cs[i].peak, cs[i].slabs,
+				cs[i].partial, cs[i].retained,
+				cs[i].allocs, cs[i].frees, cs[i].fails);
+	}
+}
+
+
+/* 每个class一行的CSV, 包括未使用的class, 便于脚本处理 */
+
+void
+ncx_slab_stat_dump(ncx_slab_pool_t *pool, FILE *fp)
+{
+	ncx_uint_t 				i, n;
+	ncx_slab_class_stat_t 	cs[NCX_SLAB_CLASS_MAX];
+
+	n = ncx_slab_stat_classes(pool, cs, NCX_SLAB_CLASS_MAX);
+
+	fprintf(fp, "size,pages,used,peak,slabs,partial,retained,"
+			"allocs,frees,fails\n");
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%zu,%zu,%zu,%zu,%zu,%zu,%zu,%" PRIu64 ",%" PRIu64
+				",%" PRIu64 "\n",
+				cs[i].size, cs[i].pages, cs[i].used, cs[i].peak,
+				cs[i].slabs, cs[i].partial, cs[i].retained,
+				cs[i].allocs, cs[i].frees, cs[i].fails);
+	}
+}
+
+
+#if (NCX_SLAB_TCACHE)
+
+/*
+ * 线程缓存中的字节数和累计申请量只在加锁补充/归还时计入池, 不为每次
+ * 出入栈加锁或做原子操作; 所以 cached_size 是近似值, 每个线程每个池
+ * 的误差不超过它缓存的chunk
+ */
+
+static void
+ncx_slab_tcache_publish(ncx_slab_pool_t *pool, ncx_slab_tcache_t *t)
+{
+    pool->tcache_size += t->size - t->published;
+    t->published = t->size;
+
+    pool->requested += t->requested;
+    pool->consumed += t->consumed;
+    t->requested = 0;
+    t->consumed = 0;
+}
+
+
+static void *
+ncx_slab_tcache_alloc(ncx_slab_tcache_t *t, ncx_slab_pool_t *pool,
+    ncx_uint_t slot, size_t request)
+{
+    size_t                  size;
+    void                   *p;
+    ncx_uint_t              i, n;
+    ncx_slab_tcache_bin_t  *bin;
+
+    bin = &t->bins[slot];
+    size = ncx_slab_classes(pool)[slot].size;
+
+    if (bin->count == 0) {
+
+        ncx_shmtx_lock(&pool->mutex);
+
+        n = ncx_slab_alloc_objs(pool, size, NCX_SLAB_TCACHE_BATCH, bin->chunk);
+
+        if (n == 0 && pool->grow_size) {
+            n = ncx_slab_arena_alloc(pool, size, NCX_SLAB_TCACHE_BATCH,
+                                     bin->chunk);
+        }
+
+        if (n == 0) {
+            ncx_slab_count_fail(pool, size);
+        }
+
+        // 按地址从低到高出栈
+        for (i = 0; i < n / 2; i++) {
+            p = bin->chunk[i];
+            bin->chunk[i] = bin->chunk[n - 1 - i];
+            bin->chunk[n - 1 - i] = p;
+        }
 
-	ncx_pagesize = getpagesize();
-	for (n = ncx_pagesize, ncx_pagesize_shift = 0; 
-			n >>= 1; ncx_pagesize_shift++) { /* void */ }
+        bin->count = n;
+        t->size += n * size;
 
-    if (ncx_slab_max_size == 0) {
-        ncx_slab_max_size = ncx_pagesize / 2;
-        ncx_slab_exact_size = ncx_pagesize / (8 * sizeof(uintptr_t));
-        for (n = ncx_slab_exact_size; n >>= 1; ncx_slab_exact_shift++) {
-            /* void */
+        ncx_slab_tcache_publish(pool, t);
+
+        ncx_shmtx_unlock(&pool->mutex);
+
+        if (n == 0) {
+            return NULL;
         }
     }
+
+    t->size -= size;
+    t->requested += request;
+    t->consumed += size;
+
+    return bin->chunk[--bin->count];
 }
 
-void
-ncx_slab_stat(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat)
+
+static ncx_uint_t
+ncx_slab_tcache_free(ncx_slab_pool_t *pool, void *p)
 {
-	uintptr_t 			m, n, mask, slab;
-	uintptr_t 			*bitmap;
-	ncx_uint_t 			i, j, map, type, obj_size;
-	ncx_slab_page_t 	*page;
+    uintptr_t               off;
+    ncx_uint_t              i, slot;
+    ncx_slab_page_t        *page;
+    ncx_slab_class_t       *cls;
+    ncx_slab_tcache_t      *t;
+    ncx_slab_tcache_bin_t  *bin;
+
+    if ((u_char *) p < ncx_slab_start(pool)
+        || (u_char *) p >= ncx_slab_end(pool))
+    {
+        return 0;
+    }
 
-	ncx_memzero(stat, sizeof(ncx_slab_stat_t));
+    // chunk未释放前其所在页的类型和size class不会改变, 无需加锁即可读取
+    page = ncx_slab_addr_page(pool, p);
 
-	page = pool->pages;
- 	stat->pages = (pool->end - pool->start) / ncx_pagesize;;
+    switch (page->prev & NCX_SLAB_PAGE_MASK) {
 
-	for (i = 0; i < stat->pages; i++)
-	{
-		slab = page->slab;
-		type = page->prev & NCX_SLAB_PAGE_MASK;
+    case NCX_SLAB_SMALL:
+    case NCX_SLAB_BIG:
+        slot = page->slab & NCX_SLAB_CLASS_MASK;
+        break;
 
-		switch (type) {
+    case NCX_SLAB_EXACT:
+        slot = ncx_slab_slot(pool, pool->exact_size);
+        break;
 
-			case NCX_SLAB_SMALL:
-	
-				n = (page - pool->pages) << ncx_pagesize_shift;
-                bitmap = (uintptr_t *) (pool->start + n);
+    default:
+        return 0;
+    }
 
-				obj_size = 1 << slab;
-                map = (1 << (ncx_pagesize_shift - slab))
-                          / (sizeof(uintptr_t) * 8);
+    if (slot >= NCX_SLAB_TCACHE_SLOTS) {
+        return 0;
+    }
 
-				for (j = 0; j < map; j++) {
-					for (m = 1 ; m; m <<= 1) {
-						if ((bitmap[j] & m)) {
-							stat->used_size += obj_size;
-							stat->b_small   += obj_size;
-						}
+    cls = &ncx_slab_classes(pool)[slot];
+    off = (uintptr_t) p & (pool->pagesize - 1);
+    i = ncx_slab_chunk(cls, off);
 
-					}		
-				}
-	
-				stat->p_small++;
+    // 非法指针交给 ncx_slab_free_locked 报错
+    if (i * cls->size != off || i < cls->reserved || i >= cls->chunks) {
+        return 0;
+    }
 
-				break;
+    t = ncx_slab_tcache_get(pool);
+    if (t == NULL) {
+        return 0;
+    }
 
-			case NCX_SLAB_EXACT:
+    bin = &t->bins[slot];
 
-				if (slab == NCX_SLAB_BUSY) {
-					stat->used_size += sizeof(uintptr_t) * 8 * ncx_slab_exact_size;
-					stat->b_exact   += sizeof(uintptr_t) * 8 * ncx_slab_exact_size;
-				}
-				else {
-					for (m = 1; m; m <<= 1) {
-						if (slab & m) {
-							stat->used_size += ncx_slab_exact_size;
-							stat->b_exact    += ncx_slab_exact_size;
-						}
-					}
-				}
+    if (bin->count == NCX_SLAB_TCACHE_SIZE) {
+        ncx_slab_tcache_flush_bin(t, slot, NCX_SLAB_TCACHE_BATCH);
+    }
 
-				stat->p_exact++;
+    ncx_slab_junk(p, cls->size);
 
-				break;
+    bin->chunk[bin->count++] = p;
+    t->size += cls->size;
 
-			case NCX_SLAB_BIG:
+    return 1;
+}
 
-				j = ncx_pagesize_shift - (slab & NCX_SLAB_SHIFT_MASK);
-				j = 1 << j;
-				j = ((uintptr_t) 1 << j) - 1;
-				mask = j << NCX_SLAB_MAP_SHIFT;
-				obj_size = 1 << (slab & NCX_SLAB_SHIFT_MASK);
-
-				for (m = (uintptr_t) 1 << NCX_SLAB_MAP_SHIFT; m & mask; m <<= 1)
-				{
-					if ((page->slab & m)) {
-						stat->used_size += obj_size;
-						stat->b_big     += obj_size;
-					}
-				}
 
-				stat->p_big++;
+/* 把 bin 底部(最早放入)的 n 个chunk 归还给池 */
 
-				break;
+static void
+ncx_slab_tcache_flush_bin(ncx_slab_tcache_t *t, ncx_uint_t slot, ncx_uint_t n)
+{
+    ncx_slab_pool_t        *pool;
+    ncx_slab_tcache_bin_t  *bin;
 
-			case NCX_SLAB_PAGE:
+    pool = t->pool;
+    bin = &t->bins[slot];
 
-				if (page->prev == NCX_SLAB_PAGE) {		
-					slab 			=  slab & ~NCX_SLAB_PAGE_START;
-					stat->used_size += slab * ncx_pagesize;
-					stat->b_page    += slab * ncx_pagesize;
-					stat->p_page    += slab;
+    if (n > bin->count) {
+        n = bin->count;
+    }
 
-					i += (slab - 1);
+    ncx_shmtx_lock(&pool->mutex);
 
-					break;
-				}
+    ncx_slab_free_batch_locked(pool, bin->chunk, n);
 
-			default:
+    bin->count -= n;
+    t->size -= n * ncx_slab_classes(pool)[slot].size;
 
-				if (slab  > stat->max_free_pages) {
-					stat->max_free_pages = page->slab;
-				}
+    ncx_slab_tcache_publish(pool, t);
 
-				stat->free_page += slab;
+    ncx_shmtx_unlock(&pool->mutex);
 
-				i += (slab - 1);
+    memmove(&bin->chunk[0], &bin->chunk[n], bin->count * sizeof(void *));
+}
 
-				break;
-		}
 
-		page = pool->pages + i + 1;
-	}
+/*
+ * 全部归还并释放这一项. 持有 ncx_slab_tcache_mutex, 池不会在归还到一半时
+ * 被别的线程销毁; 已作废的缓存直接丢弃, 不访问池
+ */
 
-	stat->pool_size = pool->end - pool->start;
-	stat->used_pct = stat->used_size * 100 / stat->pool_size;
+static void
+ncx_slab_tcache_flush_all(ncx_slab_tcache_t *t)
+{
+    ncx_uint_t  slot;
 
-	info("pool_size : %zu bytes",	stat->pool_size);
-	info("used_size : %zu bytes",	stat->used_size);
-	info("used_pct  : %zu%%\n",		stat->used_pct);
+    if (t->pool == NULL) {
+        return;
+    }
 
-	info("total page count : %zu",	stat->pages);
-	info("free page count  : %zu\n",	stat->free_page);
-		
-	info("small slab use page : %zu,\tbytes : %zu",	stat->p_small, stat->b_small);	
-	info("exact slab use page : %zu,\tbytes : %zu",	stat->p_exact, stat->b_exact);
-	info("big   slab use page : %zu,\tbytes : %zu",	stat->p_big,   stat->b_big);	
-	info("page slab use page  : %zu,\tbytes : %zu\n",	stat->p_page,  stat->b_page);				
+    (void) pthread_mutex_lock(&ncx_slab_tcache_mutex);
 
-	info("max free pages : %zu\n",		stat->max_free_pages);
+    if (!t->stale) {
+        for (slot = 0; slot < NCX_SLAB_TCACHE_SLOTS; slot++) {
+            if (t->bins[slot].count) {
+                ncx_slab_tcache_flush_bin(t, slot, t->bins[slot].count);
+            }
+        }
+    }
+
+    ncx_memzero(t, sizeof(ncx_slab_tcache_t));
+
+    (void) pthread_mutex_unlock(&ncx_slab_tcache_mutex);
 }
 
-static bool 
-ncx_slab_empty(ncx_slab_pool_t *pool, ncx_slab_page_t *page)
+
+static void
+ncx_slab_tcache_destroy(void *data)
 {
-	ncx_slab_page_t *prev;
-	
-	if (page->slab == 0) {
-		return true;
-	}
+    ncx_uint_t                 i;
+    ncx_slab_tcache_table_t  **tt;
 
-	//page->prev == PAGE | SMALL | EXACT | BIG
-	if (page->next == NULL ) {
-		return false;
-	}
+    for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+        ncx_slab_tcache_flush_all(&ncx_slab_tcaches.caches[i]);
+    }
 
-	prev = (ncx_slab_page_t *)(page->prev & ~NCX_SLAB_PAGE_MASK);   
-	while (prev >= pool->pages) { 
-		prev = (ncx_slab_page_t *)(prev->prev & ~NCX_SLAB_PAGE_MASK);   
-	};
+    // 线程的 __thread 变量随线程释放, 先从链表上摘下
+    (void) pthread_mutex_lock(&ncx_slab_tcache_mutex);
 
-	if (prev == &pool->free) {
-		return true;
-	}
+    for (tt = &ncx_slab_tcache_tables; *tt; tt = &(*tt)->next) {
+        if (*tt == &ncx_slab_tcaches) {
+            *tt = ncx_slab_tcaches.next;
+            break;
+        }
+    }
+
+    ncx_slab_tcaches.registered = 0;
+    ncx_slab_tcaches.next = NULL;
+
+    (void) pthread_mutex_unlock(&ncx_slab_tcache_mutex);
+}
+
+
+/*
+ * fork 出的子进程继承了父进程线程缓存中的chunk, 对共享内存池来说
+ * 这些chunk仍归父进程所有, 子进程只能丢弃; 其他线程在子进程中不存在,
+ * 它们的表也不再登记, 锁可能在fork时被别的线程持有, 重新初始化
+ */
+
+static void
+ncx_slab_tcache_atfork(void)
+{
+    ncx_memzero(&ncx_slab_tcaches, sizeof(ncx_slab_tcache_table_t));
+
+    ncx_slab_tcache_tables = NULL;
+    (void) pthread_mutex_init(&ncx_slab_tcache_mutex, NULL);
+}
+
+
+static void
+ncx_slab_tcache_key_init(void)
+{
+    (void) pthread_key_create(&ncx_slab_tcache_key, ncx_slab_tcache_destroy);
+    (void) pthread_atfork(NULL, NULL, ncx_slab_tcache_atfork);
+}
+
+
+/* 本线程中 pool 的缓存, 没有时返回 NULL */
+
+static ncx_slab_tcache_t *
+ncx_slab_tcache_find(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t  i;
+
+    for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+        if (ncx_slab_tcaches.caches[i].pool == pool) {
+            return &ncx_slab_tcaches.caches[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * 本线程中 pool 的缓存, 没有时占用一个空闲项. 表满时返回 NULL, 直接走池;
+ * 连续 NCX_SLAB_TCACHE_MISSES 次未命中说明常用的池变了, 才轮流归还并替换一项,
+ * 这样交替使用的池多于表项时也不会每次都整体归还. 连续使用同一个池时只比较一次
+ */
+
+static ncx_slab_tcache_t *
+ncx_slab_tcache_get(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t          i;
+    ncx_slab_tcache_t  *t;
+
+    t = &ncx_slab_tcaches.caches[ncx_slab_tcaches.last];
+
+    if (t->pool == pool && !t->stale) {
+        return t;
+    }
+
+    // 作废的项直接丢弃, 其中的chunk属于已经不存在的池
+    for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+        if (ncx_slab_tcaches.caches[i].stale) {
+            ncx_memzero(&ncx_slab_tcaches.caches[i], sizeof(ncx_slab_tcache_t));
+        }
+    }
+
+    for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+        if (ncx_slab_tcaches.caches[i].pool == pool) {
+            ncx_slab_tcaches.last = i;
+            ncx_slab_tcaches.misses = 0;
+            return &ncx_slab_tcaches.caches[i];
+        }
+    }
+
+    for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+        if (ncx_slab_tcaches.caches[i].pool == NULL) {
+            break;
+        }
+    }
+
+    if (i == NCX_SLAB_TCACHE_POOLS) {
+        if (++ncx_slab_tcaches.misses < NCX_SLAB_TCACHE_MISSES) {
+            return NULL;
+        }
+
+        ncx_slab_tcaches.misses = 0;
+
+        i = ncx_slab_tcaches.victim;
+        ncx_slab_tcaches.victim = (i + 1) % NCX_SLAB_TCACHE_POOLS;
+
+        ncx_slab_tcache_flush_all(&ncx_slab_tcaches.caches[i]);
+    }
+
+    // 线程退出时由 pthread key 的析构归还
+    (void) pthread_once(&ncx_slab_tcache_once, ncx_slab_tcache_key_init);
+    (void) pthread_setspecific(ncx_slab_tcache_key, &ncx_slab_tcaches);
+
+    if (!ncx_slab_tcaches.registered) {
+        (void) pthread_mutex_lock(&ncx_slab_tcache_mutex);
+
+        ncx_slab_tcaches.next = ncx_slab_tcache_tables;
+        ncx_slab_tcache_tables = &ncx_slab_tcaches;
+        ncx_slab_tcaches.registered = 1;
+
+        (void) pthread_mutex_unlock(&ncx_slab_tcache_mutex);
+    }
+
+    t = &ncx_slab_tcaches.caches[i];
+    t->pool = pool;
 
-	return false;
+    ncx_slab_tcaches.last = i;
+
+    return t;
+}
+
+
+/*
+ * 池被销毁, 重新初始化或重新打开, 缓存中的chunk已经无效: 本线程的直接丢弃,
+ * 其他线程的标记作废, 由它们下次用到或线程退出时丢弃, 不再访问池
+ */
+
+static void
+ncx_slab_tcache_drop(ncx_slab_pool_t *pool)
+{
+    ncx_uint_t                i;
+    ncx_slab_tcache_t        *t;
+    ncx_slab_tcache_table_t  *tt;
+
+    (void) pthread_mutex_lock(&ncx_slab_tcache_mutex);
+
+    for (tt = ncx_slab_tcache_tables; tt; tt = tt->next) {
+        for (i = 0; i < NCX_SLAB_TCACHE_POOLS; i++) {
+            if (tt->caches[i].pool == pool) {
+                tt->caches[i].stale = 1;
+            }
+        }
+    }
+
+    (void) pthread_mutex_unlock(&ncx_slab_tcache_mutex);
+
+    t = ncx_slab_tcache_find(pool);
+
+    if (t) {
+        ncx_memzero(t, sizeof(ncx_slab_tcache_t));
+    }
 }
+
+
+void
+ncx_slab_tcache_flush(ncx_slab_pool_t *pool)
+{
+    ncx_slab_tcache_t  *t;
+
+    t = ncx_slab_tcache_find(pool);
+
+    if (t) {
+        ncx_slab_tcache_flush_all(t);
+    }
+}
+
+#else
+
+void
+ncx_slab_tcache_flush(ncx_slab_pool_t *pool)
+{
+}
+
+#endif
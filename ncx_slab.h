@@ -2,50 +2,272 @@
 #define _NCX_SLAB_H_INCLUDED_
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include "ncx_core.h"
 #include "ncx_lock.h"
 #include "ncx_log.h"
 
+#define NCX_SLAB_FREE_LISTS  (sizeof(uintptr_t) * 8)
+
+#define NCX_SLAB_HUGEPAGE_SIZE  (2 * 1024 * 1024)
+
+/* ncx_slab_create() flags */
+#define NCX_SLAB_SHARED         0x01    // MAP_SHARED, fork出的子进程共享同一个池
+#define NCX_SLAB_HUGEPAGE       0x02    // 尽量使用大页
+#define NCX_SLAB_GROW           0x04    // 用满后映射新的arena, 只用于私有池
+
+/* 可增长池最多新增的arena数 */
+#define NCX_SLAB_ARENAS         32
+
+/* pool->backing */
+#define NCX_SLAB_BACKING_NONE       0   // 调用者自己提供的内存
+#define NCX_SLAB_BACKING_PAGES      1   // 普通页
+#define NCX_SLAB_BACKING_HUGETLB    2   // MAP_HUGETLB 预留大页
+#define NCX_SLAB_BACKING_THP        3   // 透明大页 (MADV_HUGEPAGE)
+#define NCX_SLAB_BACKING_FILE       4   // ncx_slab_open() 映射的文件
+
+/* 文件池头部: pool->magic 和 pool->state */
+#define NCX_SLAB_MAGIC          0x62616c73786e636eULL   // "ncxslab"
+#define NCX_SLAB_CLEAN          1   // 已由 ncx_slab_close() 正常关闭
+#define NCX_SLAB_DIRTY          2   // 正在使用, 或上次使用的进程异常退出
+
+/*
+ * NCX_SLAB_PIC: 池内保存的地址 (页描述符的 next/prev, 空闲链表和slot链表,
+ * pool 的 start/end/pages/classes) 都改为相对池头的偏移, 同一块共享内存
+ * 可以被不相关的进程映射到各自不同的地址上直接分配/释放. 偏移0即池头自身,
+ * 不会被链接到, 用来表示NULL. 未开启时这些宏原样返回, 没有额外开销
+ */
+#if (NCX_SLAB_PIC)
+
+#define ncx_slab_addr(pool, off)                                              \
+    ((off) ? (void *) ((u_char *) (pool) + (uintptr_t) (off)) : NULL)
+#define ncx_slab_off(pool, p)                                                 \
+    ((p) ? (void *) ((u_char *) (p) - (u_char *) (pool)) : NULL)
+
+// 池内一定有效的地址, 省去判断NULL
+#define ncx_slab_base(pool, off)                                              \
+    ((void *) ((u_char *) (pool) + (uintptr_t) (off)))
+
+#else
+
+#define ncx_slab_addr(pool, off)  ((void *) (off))
+#define ncx_slab_off(pool, p)     ((void *) (p))
+#define ncx_slab_base(pool, off)  ((void *) (off))
+
+#endif
+
+// 可分配空间在本进程中的地址范围
+#define ncx_slab_start(pool)  ((u_char *) ncx_slab_base(pool, (pool)->start))
+#define ncx_slab_end(pool)    ((u_char *) ncx_slab_base(pool, (pool)->end))
+
 typedef struct ncx_slab_page_s  ncx_slab_page_t;
 
-// 页结构体
+// 页结构体, 按8字节对齐: prev 的低3位保存页类型
 struct ncx_slab_page_s {
     uintptr_t         slab;//多种情况，多个用途（1.分配新页时：剩余页数量 2.分配obj内存时：一对多，表示分配obj的占用情况(是否使用)，以比特位表示）
     ncx_slab_page_t  *next;//分配较小slob时，next指向slab page在pool->pages的位置
     uintptr_t         prev;//上一个
-};
+} __attribute__((aligned(8)));
+
 
+#if (NCX_SLAB_STATS)
 
+/* 分配计数, 每个size class一份, 按页分配的另有一份 */
 typedef struct {
+    uint64_t          allocs;   // 累计分配次数
+    uint64_t          frees;    // 累计释放次数
+    uint64_t          fails;    // 分配失败次数
+    ncx_uint_t        peak;     // 存活对象数的最高值, 按页分配时为页数
+} ncx_slab_counters_t;
+
+#endif
+
+/*
+ * size class: 页内chunk的大小不再只是2的幂, 见 ncx_slab_slot()
+ */
+typedef struct {
+    ncx_uint_t        size;     // chunk大小
+    ncx_uint_t        chunks;   // 一页能放下的chunk数
+    ncx_uint_t        reserved; // SMALL页开头存放位图占用的chunk数
+    ncx_uint_t        pages;    // 每次切分的页数, 大于max_size的run class为多页
+    ncx_uint_t        shift;
+    uint64_t          magic;    // 页内偏移 * magic >> shift 即chunk序号, 省去除法
+    ncx_uint_t        used;     // 已分配出去的chunk数, 含线程缓存中的
+    ncx_uint_t        slabs;    // 当前切分给该class的页(run)数, 含保留的空slab
+    ncx_slab_page_t  *empty;    // 保留的空slab, 经 next 串成单链表
+    ncx_uint_t        retained; // 保留的空slab数
+#if (NCX_SLAB_STATS)
+    ncx_slab_counters_t counters;
+#endif
+} ncx_slab_class_t;
+
+typedef struct ncx_slab_pool_s {
+    uint64_t          magic;   //文件池为 NCX_SLAB_MAGIC, 建好后才写入
+    uint32_t          version; //文件格式, 含结构体大小和编译选项
+    uint32_t          state;   //文件池: NCX_SLAB_CLEAN/NCX_SLAB_DIRTY
+
     size_t            min_size;//最小分配单元
     size_t            min_shift;//最小分配单元，对应位移 3
 
+    ncx_uint_t        pagesize; //4K        // 页大小
+    ncx_uint_t        pagesize_shift;//12  // 页大小对应的移位数
+    ncx_uint_t        max_size;//2048    slab的一次最大分配空间，默认为pagesize/2
+    /*对于64位与32位系统，nginx里面默认的值是不一样的，我们看到数字可能会更好理解一点，所以我们就以32位来看，用实际的数字来说话！
+    这个时依赖slab的分配算法.它的值是这样来的.4096/32，2048是slab页大小，而32是一个int的位数，最后的值是128。
+    why? 我们在分配时,在一页中，我们可以将这一页分成多个块,而某个块需要标记是否被分配,而一页空间正好被分成32个128字节大小的块，于是我们可以用一个int的32位表示这块的使用情况，
+    而此时,我们是使用ngx_slab_page_s结构体中的slab成员来表示块的使用情况的。另外，在分配大于128与小于128时，表示块的占用情况有所有同
+    */
+    ncx_uint_t        exact_size;//64     slab精确分配大小，这个是一个分界点，通常是4096/32
+    ncx_uint_t        exact_shift;//6     slab精确分配大小对应的移位数
+    ncx_uint_t        real_pages;  // 对齐后，在计算page的个数
+    ncx_uint_t        carved;      // 高水位: 描述符已初始化的页数, 之后的页从未用过
+
+    ncx_slab_class_t *classes; //size class表, 紧跟在slot数组之后
+    ncx_uint_t        nclasses; //size class个数, 即slot个数
+    ncx_uint_t        run_size; //最大的run class, 更大的请求按页分配
+
     ncx_slab_page_t  *pages; //页数组
-    ncx_slab_page_t   free; //空闲页链表
+    ncx_slab_page_t   free[NCX_SLAB_FREE_LISTS]; //空闲页链表, 按连续页数分桶: free[i] 中的块长度在 [2^i, 2^(i+1))
+    uintptr_t         free_map; //非空桶的位图
 
-    u_char           *start; //可分配空间的起始地址
+    u_char           *start; //可分配空间的起始地址, NCX_SLAB_PIC 时为偏移, 用 ncx_slab_start() 读取
     u_char           *end; //内存块的结束地址
 
 	ncx_shmtx_t		 mutex;
 
+    size_t            tcache_size; //各线程缓存(NCX_SLAB_TCACHE)中的字节数, 批量补充/归还时才更新
+
+    size_t            requested; //累计申请的字节数
+    size_t            consumed;  //累计按size class/页取整后实际占用的字节数
+
+    ncx_uint_t        free_pages;  //空闲页数, 分配/释放时增量维护
+    ncx_uint_t        large_pages; //按页分配出去的页数
+    ncx_uint_t        cache_pages; //对象缓存(ncx_slab_cache_t)占用的页数
+    size_t            cache_used;  //对象缓存中已分配对象的字节数
+#if (NCX_SLAB_STATS)
+    ncx_slab_counters_t large_counters; //按页分配的计数
+#endif
+
     void             *addr; //指向ncx_slab_pool_t开头
+    ncx_uint_t        backing; //内存来源, ncx_slab_create() 时有效
+    int               fd;      //文件池的文件, 持有 flock, 只在本进程有效
+    void             *root;    //根对象, NCX_SLAB_PIC 时为偏移
+
+    size_t            grow_size;  //NCX_SLAB_GROW: 每次新增arena的大小, 0表示不增长
+    size_t            grow_limit; //NCX_SLAB_GROW: 自身和所有arena的总大小上限
+    ncx_uint_t        grow_flags; //新增arena时传给 ncx_slab_create() 的flags
+    ncx_uint_t        narenas;    //已新增的arena数
+    struct ncx_slab_pool_s *arenas[NCX_SLAB_ARENAS]; //新增的arena, 按地址排序
+
+    ncx_uint_t        purge_decay;  //空闲超过多少毫秒的页还给系统, 0表示不还
+    ncx_uint_t        purge_advice; //madvise 使用的advice
+    ncx_uint_t        purge_last;   //上次回收的时间(ms)
+    ncx_uint_t        purged_pages; //空闲页中已还给系统的页数
+
+    ncx_uint_t        retain; //每个class最多保留的空slab数
 } ncx_slab_pool_t;
 
 typedef struct {
 	size_t 			pool_size, used_size, used_pct; 
 	size_t			pages, free_page;
+	size_t			purged_page;					 /* free_page 中已还给系统(不再驻留)的页数 */
+	size_t			retained_page;					 /* 各class保留的空slab占用的page数, 已计入 p_small 等 */
 	size_t			p_small, p_exact, p_big, p_page; /* 四种slab占用的page数 */
 	size_t			b_small, b_exact, b_big, b_page; /* 四种slab占用的byte数 */
-	size_t			max_free_pages;					 /* 最大的连续可用page数 */
+	size_t			p_run, b_run;					 /* 多页run占用的page数和byte数 */
+	size_t			p_cache, b_cache;				 /* 对象缓存占用的page数和byte数 */
+	size_t			max_free_pages;					 /* 最大的连续可用page数, snapshot中为下限 */
+	size_t			cached_size;					 /* used_size中停留在线程缓存里的字节数, 近似值 */
+	size_t			requested_size, consumed_size;	 /* 累计申请的字节数 / 取整后实际占用的字节数 */
 } ncx_slab_stat_t;
 
+/* ncx_slab_stat_classes() 最多返回的项数: size class的上限加上按页分配一项 */
+#if (NCX_PTR_SIZE == 4)
+#define NCX_SLAB_CLASS_MAX  (128 + 1)
+#else
+#define NCX_SLAB_CLASS_MAX  (256 + 1)
+#endif
+
+/*
+ * 单个size class的使用情况, 见 ncx_slab_stat_classes().
+ * 最后一项 size 为0, 表示按页分配, 此时 used/peak/slabs 均以页计.
+ * allocs/frees/fails/peak 只在定义 NCX_SLAB_STATS 时统计, 否则为0
+ */
+typedef struct {
+	size_t			size, pages;		/* chunk大小, 每个slab的页数 */
+	size_t			used, peak;			/* 存活对象数及其最高值 */
+	size_t			slabs, partial;		/* 持有的slab数, 其中未满的个数 */
+	size_t			retained;			/* 持有的slab中保留的空slab数, 见 ncx_slab_retain() */
+	uint64_t		allocs, frees, fails;
+} ncx_slab_class_stat_t;
+
+typedef void (*ncx_slab_cache_ctor_pt)(void *obj);
+
+/*
+ * 对象缓存: 固定大小对象的专用slab, 对象按 align 紧密排列而不取整到size class,
+ * 每个对象只在所在slab创建时调用一次 ctor. 由 ncx_slab_cache_create() 在池中分配
+ */
+typedef struct {
+    ncx_slab_pool_t        *pool;    //NCX_SLAB_PIC 时为cache相对池头的偏移
+    ncx_slab_class_t        cls;     //对象大小, 每个slab的对象数/页数及计数
+    ncx_uint_t              offset;  //第一个对象在slab中的偏移, 之前是已用数和位图
+    ncx_uint_t              empty;   //全空的slab数
+    ncx_slab_page_t         partial; //未满的slab链表
+    ncx_slab_cache_ctor_pt  ctor;
+} ncx_slab_cache_t;
+
 void ncx_slab_init(ncx_slab_pool_t *pool);
+void ncx_slab_init_pagesize(ncx_slab_pool_t *pool, size_t pagesize);
+ncx_slab_pool_t *ncx_slab_create(size_t size, size_t pagesize, ncx_uint_t flags);
+void ncx_slab_destroy(ncx_slab_pool_t *pool);
+ncx_slab_pool_t *ncx_slab_open(const char *path, size_t size, size_t pagesize);
+void ncx_slab_close(ncx_slab_pool_t *pool);
+void ncx_slab_set_root(ncx_slab_pool_t *pool, void *root);
+void *ncx_slab_root(ncx_slab_pool_t *pool);
+void ncx_slab_grow_limit(ncx_slab_pool_t *pool, size_t arena_size,
+    size_t limit);
+void ncx_slab_purge_decay(ncx_slab_pool_t *pool, ncx_uint_t msec,
+    ncx_uint_t lazy);
+void ncx_slab_purge(ncx_slab_pool_t *pool);
+void ncx_slab_retain(ncx_slab_pool_t *pool, ncx_uint_t n);
 void *ncx_slab_alloc(ncx_slab_pool_t *pool, size_t size);
 void *ncx_slab_alloc_locked(ncx_slab_pool_t *pool, size_t size);
+void *ncx_slab_alloc_aligned(ncx_slab_pool_t *pool, size_t size,
+    size_t align);
 void ncx_slab_free(ncx_slab_pool_t *pool, void *p);
 void ncx_slab_free_locked(ncx_slab_pool_t *pool, void *p);
+ncx_uint_t ncx_slab_alloc_batch(ncx_slab_pool_t *pool, size_t size,
+    ncx_uint_t n, void **out);
+ncx_uint_t ncx_slab_alloc_batch_locked(ncx_slab_pool_t *pool, size_t size,
+    ncx_uint_t n, void **out);
+void ncx_slab_free_batch(ncx_slab_pool_t *pool, void **ptrs, ncx_uint_t n);
+void ncx_slab_free_batch_locked(ncx_slab_pool_t *pool, void **ptrs,
+    ncx_uint_t n);
+
+size_t ncx_slab_usable_size(ncx_slab_pool_t *pool, void *p);
+
+ncx_slab_cache_t *ncx_slab_cache_create(ncx_slab_pool_t *pool, size_t size,
+    size_t align, ncx_slab_cache_ctor_pt ctor);
+void ncx_slab_cache_destroy(ncx_slab_cache_t *cache);
+void *ncx_slab_cache_alloc(ncx_slab_cache_t *cache);
+void *ncx_slab_cache_alloc_locked(ncx_slab_cache_t *cache);
+void ncx_slab_cache_free(ncx_slab_cache_t *cache, void *p);
+void ncx_slab_cache_free_locked(ncx_slab_cache_t *cache, void *p);
 
 void ncx_slab_dummy_init(ncx_slab_pool_t *pool);
-void ncx_slab_stat(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat);
+ncx_int_t ncx_slab_stat(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat);
+void ncx_slab_stat_snapshot(ncx_slab_pool_t *pool, ncx_slab_stat_t *stat);
+ncx_uint_t ncx_slab_stat_classes(ncx_slab_pool_t *pool,
+    ncx_slab_class_stat_t *cs, ncx_uint_t n);
+void ncx_slab_stat_print(ncx_slab_pool_t *pool, FILE *fp);
+void ncx_slab_stat_dump(ncx_slab_pool_t *pool, FILE *fp);
+void ncx_slab_tcache_flush(ncx_slab_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _NCX_SLAB_H_INCLUDED_ */
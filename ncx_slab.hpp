@@ -0,0 +1,284 @@
+#ifndef _NCX_SLAB_HPP_INCLUDED_
+#define _NCX_SLAB_HPP_INCLUDED_
+
+/*
+ * C++ 适配: 让STL容器的节点放在 ncx_slab_pool_t 里.
+ *
+ *   ncx::slab_allocator<T>  标准 Allocator, 用于 std::map<K, V, C, A> 等
+ *   ncx::slab_resource      std::pmr::memory_resource, 用于 std::pmr 容器 (C++17)
+ *   ncx::fixed_pool<...>    编译期确定大小和个数的定长对象池, 存储从池中切出
+ *
+ * 前两者只保存池指针, 池放在 MAP_SHARED 内存中时, fork 出的子进程地址相同,
+ * 可以直接使用父进程中建好的容器.
+ * fixed_pool 的位图和计数在对象自身里, 通常是进程私有内存, fork 后父子进程
+ * 各有一份, 不能跨进程共享同一个 fixed_pool.
+ * 对齐要求不超过页大小, 否则抛出 std::bad_alloc.
+ * 释放不需要大小: ncx_slab_free 由页描述符就能找到chunk所属的class.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#if (__cplusplus >= 201703L) && __has_include(<memory_resource>)
+#include <memory_resource>
+#define NCX_HAVE_PMR  1
+#endif
+
+#include "ncx_slab.h"
+
+
+namespace ncx {
+
+inline void *
+slab_allocate(ncx_slab_pool_t *pool, std::size_t size, std::size_t align)
+{
+    void  *p;
+
+    p = ncx_slab_alloc_aligned(pool, size, align);
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+
+template <typename T>
+class slab_allocator {
+public:
+    typedef T  value_type;
+
+    // 容器移动/交换时带上池, 不同池的容器之间不能直接交换节点
+    typedef std::true_type  propagate_on_container_copy_assignment;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    explicit slab_allocator(ncx_slab_pool_t *pool) noexcept : pool_(pool) {}
+
+    template <typename U>
+    slab_allocator(const slab_allocator<U> &other) noexcept
+        : pool_(other.pool()) {}
+
+    T *
+    allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        return static_cast<T *>(slab_allocate(pool_, n * sizeof(T),
+                                              alignof(T)));
+    }
+
+    void
+    deallocate(T *p, std::size_t) noexcept
+    {
+        ncx_slab_free(pool_, p);
+    }
+
+    ncx_slab_pool_t *
+    pool() const noexcept
+    {
+        return pool_;
+    }
+
+private:
+    ncx_slab_pool_t  *pool_;
+};
+
+
+template <typename T, typename U>
+inline bool
+operator==(const slab_allocator<T> &a, const slab_allocator<U> &b) noexcept
+{
+    return a.pool() == b.pool();
+}
+
+
+template <typename T, typename U>
+inline bool
+operator!=(const slab_allocator<T> &a, const slab_allocator<U> &b) noexcept
+{
+    return a.pool() != b.pool();
+}
+
+
+#if (NCX_HAVE_PMR)
+
+class slab_resource : public std::pmr::memory_resource {
+public:
+    explicit slab_resource(ncx_slab_pool_t *pool) noexcept : pool_(pool) {}
+
+    ncx_slab_pool_t *
+    pool() const noexcept
+    {
+        return pool_;
+    }
+
+private:
+    void *
+    do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        return slab_allocate(pool_, bytes, align);
+    }
+
+    void
+    do_deallocate(void *p, std::size_t, std::size_t) override
+    {
+        ncx_slab_free(pool_, p);
+    }
+
+    bool
+    do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const slab_resource  *r;
+
+        r = dynamic_cast<const slab_resource *>(&other);
+
+        return r != nullptr && r->pool_ == pool_;
+    }
+
+    ncx_slab_pool_t  *pool_;
+};
+
+#endif
+
+
+/*
+ * 定长对象池: 对象大小, 对齐和个数都是模板参数, 对象大小, 位图字数,
+ * 末尾多余的位都是编译期常量, 分配只剩位图查找, 释放的除法被编译成乘法/移位.
+ * 存储是从 ncx_slab_pool_t 一次分配的 Capacity 个对象, 析构时归还.
+ * 不加锁, 与 ncx_slab_alloc_locked 一样由调用者保证互斥; 用满后 allocate 返回 nullptr.
+ * deallocate 与 ncx_slab_free 一样检查指针: 不属于本池, 不在chunk边界或重复释放时
+ * 记录错误后忽略
+ */
+template <std::size_t ObjSize, std::size_t Align = alignof(std::max_align_t),
+          std::size_t Capacity = 64>
+class fixed_pool {
+    static_assert(ObjSize > 0, "ObjSize must be positive");
+    static_assert(Align > 0 && (Align & (Align - 1)) == 0,
+                  "Align must be a power of two");
+    static_assert(Capacity > 0, "Capacity must be positive");
+
+public:
+    static constexpr std::size_t  size = ncx_align(ObjSize, Align);
+    static constexpr std::size_t  capacity = Capacity;
+
+    explicit fixed_pool(ncx_slab_pool_t *pool)
+        : pool_(pool), hint_(0), used_(0)
+    {
+        std::size_t  i;
+
+        start_ = static_cast<u_char *>(slab_allocate(pool, size * Capacity,
+                                                     Align));
+
+        for (i = 0; i < map; i++) {
+            bitmap_[i] = 0;
+        }
+
+        bitmap_[map - 1] = tail;
+    }
+
+    ~fixed_pool()
+    {
+        ncx_slab_free(pool_, start_);
+    }
+
+    fixed_pool(const fixed_pool &) = delete;
+    fixed_pool &operator=(const fixed_pool &) = delete;
+
+    void *
+    allocate() noexcept
+    {
+        std::size_t  i, n;
+
+        // hint_ 之前的字都是满的
+        for (i = hint_; i < map; i++) {
+            if (bitmap_[i] != busy) {
+                n = ncx_ctz(~bitmap_[i]);
+                bitmap_[i] |= (uintptr_t) 1 << n;
+
+                hint_ = i;
+                used_++;
+
+                return start_ + (i * bits + n) * size;
+            }
+        }
+
+        hint_ = map;
+
+        return nullptr;
+    }
+
+    void
+    deallocate(void *p) noexcept
+    {
+        std::size_t  n;
+        uintptr_t    m;
+
+        if (!owns(p)) {
+            error("fixed_pool::deallocate(): outside of pool");
+            return;
+        }
+
+        n = static_cast<u_char *>(p) - start_;
+
+        if (n % size) {
+            error("fixed_pool::deallocate(): pointer to wrong chunk");
+            return;
+        }
+
+        n /= size;
+        m = (uintptr_t) 1 << (n % bits);
+
+        if ((bitmap_[n / bits] & m) == 0) {
+            error("fixed_pool::deallocate(): chunk is already free");
+            return;
+        }
+
+        bitmap_[n / bits] &= ~m;
+
+        if (n / bits < hint_) {
+            hint_ = n / bits;
+        }
+
+        used_--;
+    }
+
+    bool
+    owns(const void *p) const noexcept
+    {
+        return static_cast<const u_char *>(p) >= start_
+               && static_cast<const u_char *>(p) < start_ + size * Capacity;
+    }
+
+    std::size_t
+    used() const noexcept
+    {
+        return used_;
+    }
+
+private:
+    static constexpr std::size_t  bits = sizeof(uintptr_t) * 8;
+    static constexpr std::size_t  map = (Capacity + bits - 1) / bits;
+    static constexpr uintptr_t    busy = ~(uintptr_t) 0;
+
+    // 最后一个字中超出 Capacity 的位预先置1, 永远不会被分配
+    static constexpr uintptr_t    tail = Capacity % bits
+                                         ? busy << (Capacity % bits) : 0;
+
+    ncx_slab_pool_t  *pool_;
+    u_char           *start_;
+    std::size_t       hint_;
+    std::size_t       used_;
+    uintptr_t         bitmap_[map];
+};
+
+} // namespace ncx
+
+#endif /* _NCX_SLAB_HPP_INCLUDED_ */